@@ -4,6 +4,7 @@
 #include <string.h>
 #include <malloc.h>
 #include <string>
+#include <algorithm>
 
 // Windows-specific includes
 #include "targetver.h"
@@ -15,6 +16,7 @@
 #include "Version.h"
 #include "Log.h"
 #include "DosExeEmitter.h"
+#include "Optimizer.h"
 
 // Internal Bison functions and variables used by compiler
 extern int yylex();
@@ -42,6 +44,9 @@ int Compiler::OnRun(int argc, wchar_t* argv[])
     wchar_t* input_filename = nullptr;
     wchar_t* output_filename = nullptr;
 
+    OptimizationLevel optimization_level = OptimizationLevel::Full;
+    std::vector<wchar_t*> pass_lists;
+
     for (int i = 1; i < argc; i++) {
         wchar_t* value;
         if (StringStartsWith(argv[i], L"/target:", value)) {
@@ -51,6 +56,16 @@ int Compiler::OnRun(int argc, wchar_t* argv[])
                 Log::Write(LogType::Error, "Unsupported compilation target specified!");
                 return EXIT_FAILURE;
             }
+        } else if (wcscmp(argv[i], L"/O0") == 0) {
+            optimization_level = OptimizationLevel::None;
+        } else if (wcscmp(argv[i], L"/O1") == 0) {
+            optimization_level = OptimizationLevel::Basic;
+        } else if (wcscmp(argv[i], L"/O2") == 0) {
+            optimization_level = OptimizationLevel::Full;
+        } else if (wcscmp(argv[i], L"/Os") == 0) {
+            optimization_level = OptimizationLevel::Size;
+        } else if (StringStartsWith(argv[i], L"/pass:", value)) {
+            pass_lists.push_back(value);
         } else {
             switch (argIdx) {
                 case 0: input_filename = argv[i]; break;
@@ -61,6 +76,15 @@ int Compiler::OnRun(int argc, wchar_t* argv[])
         }
     }
 
+    // Passes can be enabled or disabled individually on top of optimization level
+    uint32_t optimizer_passes = Optimizer::GetPassesForLevel(optimization_level);
+    for (wchar_t* list : pass_lists) {
+        if (!Optimizer::ParsePassList(list, optimizer_passes)) {
+            Log::Write(LogType::Error, "Unknown optimization pass specified!");
+            return EXIT_FAILURE;
+        }
+    }
+
     // Open input file
     if (argIdx == 0) {
         Log::Write(LogType::Error, "You must specify at least output filename!");
@@ -140,6 +164,11 @@ int Compiler::OnRun(int argc, wchar_t* argv[])
 
         PostprocessSymbolTable();
 
+        {
+            Optimizer optimizer(this, optimizer_passes);
+            optimizer.OptimizeInstructions(instruction_stream_head);
+        }
+
         Log::Write(LogType::Info, "Creating executable file...");
         Log::PushIndent();
 
@@ -248,6 +277,13 @@ void Compiler::ParseCompilerDirective(char* directive, std::function<bool(char*
                 return;
             }
 
+            if (strcmp(directive, "#unroll") == 0) {
+                // Unroll directive, it's applied to the following loop
+                int32_t count = atoi(param);
+                unroll_count = (count > 1 ? count : 1);
+                return;
+            }
+
             if (callback(directive, param)) {
                 return;
             }
@@ -281,6 +317,12 @@ InstructionEntry* Compiler::AddToStream(InstructionType type)
     // Advance abstract instruction pointer
     current_ip++;
 
+    // Unroll directive is bound to the first instruction that follows it
+    if (unroll_count > 0) {
+        unroll_hints[entry] = unroll_count;
+        unroll_count = 0;
+    }
+
     return entry;
 }
 
@@ -317,6 +359,313 @@ void Compiler::BackpatchStream(BackpatchList* list, int32_t new_ip)
     }
 }
 
+BackpatchList* Compiler::AddSwitchToStream(const InstructionOperand& op, SwitchBackpatchList* cases)
+{
+    if (op.type.base == BaseSymbolType::String) {
+        return AddStringSwitchToStream(op, cases);
+    }
+
+    struct SwitchCase {
+        uint32_t value;
+        int32_t ip;
+    };
+
+    struct SwitchCluster {
+        size_t begin;
+        size_t end;
+        bool is_table;
+    };
+
+    // Values of cases are truncated to the size of the expression, the first matching case is used
+    int32_t size = GetSymbolTypeSize(op.type);
+    uint32_t mask = (size >= 4 ? UINT32_MAX : ((1u << (size * 8)) - 1));
+
+    std::vector<SwitchCase> sorted;
+    int32_t default_ip = -1;
+
+    SwitchBackpatchList* current = cases;
+    while (current) {
+        if (current->is_default) {
+            default_ip = current->source_ip;
+        } else {
+            uint32_t value = (uint32_t)atoi(current->value) & mask;
+
+            bool is_duplicate = false;
+            for (size_t j = 0; j < sorted.size(); j++) {
+                if (sorted[j].value == value) {
+                    is_duplicate = true;
+                    break;
+                }
+            }
+
+            if (!is_duplicate) {
+                sorted.push_back({ value, (int32_t)current->source_ip });
+            }
+        }
+
+        current = current->next;
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const SwitchCase& a, const SwitchCase& b) {
+        return a.value < b.value;
+    });
+
+    // Split cases to clusters, each dense range of cases shares one jump table
+    std::vector<SwitchCluster> clusters;
+
+    size_t begin = 0;
+    while (begin < sorted.size()) {
+        size_t end = begin + 1;
+
+        if (op.exp_type == ExpressionType::Variable) {
+            for (size_t j = sorted.size(); j >= begin + SwitchJumpTableMinCases; j--) {
+                uint64_t range = (uint64_t)sorted[j - 1].value - sorted[begin].value + 1;
+                if (range <= (uint64_t)(j - begin) * SwitchJumpTableMaxEntriesPerCase) {
+                    end = j;
+                    break;
+                }
+            }
+        }
+
+        clusters.push_back({ begin, end, (end - begin >= SwitchJumpTableMinCases) });
+        begin = end;
+    }
+
+    BackpatchList* end_list = nullptr;
+
+    auto add_goto_default = [&]() {
+        if (default_ip >= 0) {
+            InstructionEntry* i = AddToStream(InstructionType::Goto);
+            i->goto_statement.ip = default_ip;
+        } else {
+            end_list = MergeLists(end_list, AddToStreamWithBackpatch(InstructionType::Goto));
+        }
+    };
+
+    auto add_if = [&](CompareType type, uint32_t value) {
+        InstructionEntry* i = AddToStream(InstructionType::If);
+        i->if_statement.type = type;
+        i->if_statement.op1 = op;
+        i->if_statement.op2.value = _strdup(std::to_string(value).c_str());
+        i->if_statement.op2.exp_type = ExpressionType::Constant;
+
+        if (value <= UINT8_MAX) {
+            i->if_statement.op2.type = { BaseSymbolType::Uint8, 0 };
+        } else if (value <= UINT16_MAX) {
+            i->if_statement.op2.type = { BaseSymbolType::Uint16, 0 };
+        } else {
+            i->if_statement.op2.type = { BaseSymbolType::Uint32, 0 };
+        }
+        return i;
+    };
+
+    auto add_jump_table = [&](const SwitchCluster& cluster) {
+        uint32_t min_value = sorted[cluster.begin].value;
+        uint32_t count = sorted[cluster.end - 1].value - min_value + 1;
+
+        InstructionEntry* i = AddToStream(InstructionType::Switch);
+        i->switch_statement.op = op;
+        i->switch_statement.min_value = min_value;
+        i->switch_statement.count = count;
+
+        // Every value in the range has its own entry, values without case continue to default
+        size_t next = cluster.begin;
+        for (uint32_t j = 0; j < count; j++) {
+            if (sorted[next].value - min_value == j) {
+                InstructionEntry* entry = AddToStream(InstructionType::Goto);
+                entry->goto_statement.ip = sorted[next].ip;
+                next++;
+            } else {
+                add_goto_default();
+            }
+        }
+
+        // The last entry is used for values out of range
+        add_goto_default();
+    };
+
+    std::function<void(size_t, size_t)> add_clusters = [&](size_t lo, size_t hi) {
+        if (hi - lo == 1 && clusters[lo].is_table) {
+            add_jump_table(clusters[lo]);
+            return;
+        }
+
+        bool is_linear = (hi - lo <= SwitchLinearSearchMaxCases);
+        for (size_t j = lo; j < hi && is_linear; j++) {
+            if (clusters[j].is_table) {
+                is_linear = false;
+            }
+        }
+
+        if (is_linear) {
+            for (size_t j = lo; j < hi; j++) {
+                SwitchCase& single = sorted[clusters[j].begin];
+
+                InstructionEntry* i = add_if(CompareType::Equal, single.value);
+                i->if_statement.ip = single.ip;
+            }
+
+            add_goto_default();
+            return;
+        }
+
+        // Values are split in half, the lower half is tested first
+        size_t mid = (lo + hi) / 2;
+
+        InstructionEntry* i = add_if(CompareType::GreaterOrEqual, sorted[clusters[mid].begin].value);
+        add_clusters(lo, mid);
+        i->if_statement.ip = NextIp();
+        add_clusters(mid, hi);
+    };
+
+    if (clusters.empty()) {
+        add_goto_default();
+    } else {
+        add_clusters(0, clusters.size());
+    }
+
+    return end_list;
+}
+
+BackpatchList* Compiler::AddStringSwitchToStream(const InstructionOperand& op, SwitchBackpatchList* cases)
+{
+    // The first matching case is used
+    std::vector<SwitchBackpatchList*> unique;
+    std::vector<const char*> values;
+    int32_t default_ip = -1;
+
+    SwitchBackpatchList* current = cases;
+    while (current) {
+        if (current->is_default) {
+            default_ip = current->source_ip;
+        } else {
+            bool is_duplicate = false;
+            for (size_t j = 0; j < values.size(); j++) {
+                if (strcmp(values[j], current->value) == 0) {
+                    is_duplicate = true;
+                    break;
+                }
+            }
+
+            if (!is_duplicate) {
+                unique.push_back(current);
+                values.push_back(current->value);
+            }
+        }
+
+        current = current->next;
+    }
+
+    BackpatchList* end_list = nullptr;
+
+    auto add_goto_default = [&]() {
+        if (default_ip >= 0) {
+            InstructionEntry* i = AddToStream(InstructionType::Goto);
+            i->goto_statement.ip = default_ip;
+        } else {
+            end_list = MergeLists(end_list, AddToStreamWithBackpatch(InstructionType::Goto));
+        }
+    };
+
+    auto add_if = [&](SwitchBackpatchList* c) {
+        InstructionEntry* i = AddToStream(InstructionType::If);
+        i->if_statement.type = CompareType::Equal;
+        i->if_statement.op1 = op;
+        i->if_statement.op2.value = c->value;
+        i->if_statement.op2.type = { BaseSymbolType::String, 0 };
+        i->if_statement.op2.exp_type = ExpressionType::Constant;
+        i->if_statement.ip = c->source_ip;
+    };
+
+    uint16_t multiplier;
+    uint8_t bits;
+    if (op.exp_type != ExpressionType::Variable || values.size() < SwitchStringHashMinCases ||
+        !FindStringHash(values, multiplier, bits)) {
+        // Only a few cases, they are compared one by one
+        for (size_t j = 0; j < unique.size(); j++) {
+            add_if(unique[j]);
+        }
+
+        add_goto_default();
+        return end_list;
+    }
+
+    uint32_t count = (1u << bits);
+
+    InstructionEntry* i = AddToStream(InstructionType::Switch);
+    i->switch_statement.op = op;
+    i->switch_statement.count = count - 1;
+    i->switch_statement.hash_multiplier = multiplier;
+    i->switch_statement.hash_bits = bits;
+
+    std::vector<int32_t> entries(count, -1);
+    for (size_t j = 0; j < values.size(); j++) {
+        entries[GetStringHashIndex(values[j], multiplier, bits)] = (int32_t)j;
+    }
+
+    // Each case is verified by one comparison that follows the table, it continues to default if it doesn't match
+    int32_t verification_ip = NextIp() + (int32_t)count;
+    for (uint32_t j = 0; j < count; j++) {
+        if (entries[j] >= 0) {
+            InstructionEntry* entry = AddToStream(InstructionType::Goto);
+            entry->goto_statement.ip = verification_ip + entries[j] * 2;
+        } else {
+            add_goto_default();
+        }
+    }
+
+    for (size_t j = 0; j < unique.size(); j++) {
+        add_if(unique[j]);
+        add_goto_default();
+    }
+
+    return end_list;
+}
+
+bool Compiler::FindStringHash(const std::vector<const char*>& values, uint16_t& multiplier, uint8_t& bits)
+{
+    uint8_t min_bits = 1;
+    while ((1u << min_bits) < values.size()) {
+        min_bits++;
+    }
+
+    // The smallest table is preferred, then the smallest multiplier, because it has shorter encoding
+    std::vector<bool> used;
+    for (bits = min_bits; bits <= std::min(min_bits + 3, SwitchStringHashMaxBits); bits++) {
+        for (uint32_t m = 3; m <= UINT16_MAX; m += 2) {
+            used.assign(1u << bits, false);
+
+            bool is_perfect = true;
+            for (size_t j = 0; j < values.size(); j++) {
+                uint32_t index = GetStringHashIndex(values[j], (uint16_t)m, bits);
+                if (used[index]) {
+                    is_perfect = false;
+                    break;
+                }
+                used[index] = true;
+            }
+
+            if (is_perfect) {
+                multiplier = (uint16_t)m;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+uint32_t Compiler::GetStringHashIndex(const char* value, uint16_t multiplier, uint8_t bits)
+{
+    uint16_t hash = 0;
+    while (*value) {
+        hash = (uint16_t)((hash + (uint8_t)*value) * multiplier);
+        value++;
+    }
+
+    return (uint32_t)(hash >> (16 - bits));
+}
+
 SymbolTableEntry* Compiler::GetSymbols()
 {
     return symbol_table;
@@ -424,7 +773,7 @@ void Compiler::AddStaticVariable(SymbolType type, int32_t size, const char* name
         ExpressionType::Variable, 0, 0, nullptr, false);
 }
 
-void Compiler::AddFunction(char* name, SymbolType return_type)
+void Compiler::AddFunction(char* name, SymbolType return_type, bool is_inline)
 {
     // Check, if the function is not defined yet
     {
@@ -458,6 +807,9 @@ void Compiler::AddFunction(char* name, SymbolType return_type)
         if (return_type.base != BaseSymbolType::Uint8 || return_type.pointer != 0) {
             throw CompilerException(CompilerExceptionSource::Declaration, "Entry point must return \"uint8\" value", yylineno, -1);
         }
+        if (is_inline) {
+            throw CompilerException(CompilerExceptionSource::Declaration, "Entry point cannot be inline", yylineno, -1);
+        }
 
         // Collect all variables used in the function
         SymbolTableEntry* current = declaration_queue;
@@ -503,6 +855,7 @@ void Compiler::AddFunction(char* name, SymbolType return_type)
         // Promote the prototype to complete function
         prototype->type = { BaseSymbolType::Function, 0 };
         prototype->ip = ip;
+        prototype->is_inline |= is_inline;
 
         // Collect all function parameters
         SymbolTableEntry* current = symbol_table;
@@ -566,14 +919,15 @@ void Compiler::AddFunction(char* name, SymbolType return_type)
             current = current->next;
         }
 
-        AddSymbol(name, { BaseSymbolType::Function, 0 }, 0, return_type,
+        SymbolTableEntry* entry = AddSymbol(name, { BaseSymbolType::Function, 0 }, 0, return_type,
             ExpressionType::None, ip, parameter_count, nullptr, false);
+        entry->is_inline = is_inline;
     }
 
     ReleaseDeclarationQueue();
 }
 
-void Compiler::AddFunctionPrototype(char* name, SymbolType return_type)
+void Compiler::AddFunctionPrototype(char* name, SymbolType return_type, bool is_inline)
 {
     if (strcmp(name, EntryPointName) == 0) {
         throw CompilerException(CompilerExceptionSource::Declaration, "Prototype for entry point is not allowed", yylineno, -1);
@@ -602,8 +956,9 @@ void Compiler::AddFunctionPrototype(char* name, SymbolType return_type)
         }
     }
 
-    AddSymbol(name, { BaseSymbolType::FunctionPrototype, 0 }, 0, return_type,
+    SymbolTableEntry* prototype = AddSymbol(name, { BaseSymbolType::FunctionPrototype, 0 }, 0, return_type,
         ExpressionType::None, 0, parameter_count, nullptr, false);
+    prototype->is_inline = is_inline;
 
     // Collect all function parameters
     {
@@ -762,6 +1117,12 @@ SymbolTableEntry* Compiler::FindSymbolByName(const char* name)
     return current;
 }
 
+int32_t Compiler::GetUnrollCount(InstructionEntry* entry)
+{
+    std::unordered_map<InstructionEntry*, int32_t>::iterator it = unroll_hints.find(entry);
+    return (it != unroll_hints.end() ? it->second : 0);
+}
+
 InstructionEntry* Compiler::FindInstructionByIp(int32_t ip)
 {
     InstructionEntry* current = instruction_stream_head;
@@ -860,41 +1221,107 @@ int32_t Compiler::NextIp()
 
 SymbolTableEntry* Compiler::GetUnusedVariable(SymbolType type)
 {
+    // Reuse temporary variable of the same type, if any is not needed anymore
+    for (size_t i = 0; i < unused_temps.size(); i++) {
+        if (unused_temps[i]->type == type) {
+            SymbolTableEntry* decl = unused_temps[i];
+            unused_temps.erase(unused_temps.begin() + i);
+            used_temps.push_back(decl);
+            return decl;
+        }
+    }
+
     char buffer[20];
+    GetTempVariableName(type, buffer, sizeof(buffer));
 
-    switch (type.base) {
-        case BaseSymbolType::Bool: {
-            var_count_bool++;
-            sprintf_s(buffer, "#b_%d", var_count_bool);
-            break;
-        }
-        case BaseSymbolType::Uint8: {
-            var_count_uint8++;
-            sprintf_s(buffer, "#ui8_%d", var_count_uint8);
-            break;
-        }
-        case BaseSymbolType::Uint16: {
-            var_count_uint16++;
-            sprintf_s(buffer, "#ui16_%d", var_count_uint16);
-            break;
+    SymbolTableEntry* decl = ToDeclarationList(type, 0, buffer, ExpressionType::Variable);
+    decl->is_temp = true;
+    used_temps.push_back(decl);
+    return decl;
+}
+
+SymbolTableEntry* Compiler::AddTempVariable(SymbolType type, const char* parent)
+{
+    char buffer[20];
+    GetTempVariableName(type, buffer, sizeof(buffer));
+
+    return AddSymbol(buffer, type, 0, { BaseSymbolType::Unknown, 0 }, ExpressionType::Variable, 0, 0, parent, true);
+}
+
+SymbolTableEntry* Compiler::AddFunctionCopy(SymbolTableEntry* function, int32_t ip)
+{
+    std::string name;
+    for (int32_t index = 1; ; index++) {
+        name = function->name;
+        name += '#';
+        name += std::to_string(index);
+
+        SymbolTableEntry* current = symbol_table;
+        while (current && (current->parent || strcmp(current->name, name.c_str()) != 0)) {
+            current = current->next;
         }
-        case BaseSymbolType::Uint32: {
-            var_count_uint32++;
-            sprintf_s(buffer, "#ui32_%d", var_count_uint32);
+
+        if (!current) {
             break;
         }
-        case BaseSymbolType::String: {
-            var_count_string++;
-            sprintf_s(buffer, "#s_%d", var_count_uint32);
-            break;
+    }
+
+    std::vector<SymbolTableEntry*> symbols;
+    SymbolTableEntry* current = symbol_table;
+    while (current) {
+        if (current->parent && strcmp(current->parent, function->name) == 0) {
+            symbols.push_back(current);
         }
 
-        default: ThrowOnUnreachableCode();
+        current = current->next;
     }
 
-    SymbolTableEntry* decl = ToDeclarationList(type, 0, buffer, ExpressionType::Variable);
-    decl->is_temp = true;
-    return decl;
+    SymbolTableEntry* copy = AddSymbol(name.c_str(), { BaseSymbolType::Function, 0 }, 0, function->return_type,
+        ExpressionType::None, ip, function->parameter, nullptr, false);
+    copy->is_inline = function->is_inline;
+
+    for (size_t i = 0; i < symbols.size(); i++) {
+        AddSymbol(symbols[i]->name, symbols[i]->type, symbols[i]->size, symbols[i]->return_type,
+            symbols[i]->exp_type, symbols[i]->ip, symbols[i]->parameter, copy->name, symbols[i]->is_temp);
+    }
+
+    return copy;
+}
+
+void Compiler::ReleaseUnusedVariables()
+{
+    size_t pinned = (pinned_temps.empty() ? 0 : pinned_temps.back());
+
+    while (used_temps.size() > pinned) {
+        unused_temps.push_back(used_temps.back());
+        used_temps.pop_back();
+    }
+}
+
+void Compiler::PinUsedVariables()
+{
+    size_t pinned = (pinned_temps.empty() ? 0 : pinned_temps.back());
+
+    // Pinned variables can live across loops, so they cannot be treated as temp. variables anymore
+    for (size_t i = pinned; i < used_temps.size(); i++) {
+        used_temps[i]->is_temp = false;
+    }
+
+    pinned_temps.push_back(used_temps.size());
+}
+
+void Compiler::UnpinUsedVariables()
+{
+    if (pinned_temps.empty()) {
+        ThrowOnUnreachableCode();
+    }
+
+    size_t end = pinned_temps.back();
+    pinned_temps.pop_back();
+    size_t begin = (pinned_temps.empty() ? 0 : pinned_temps.back());
+
+    // Pinned variables are not returned to the pool
+    used_temps.erase(used_temps.begin() + begin, used_temps.begin() + end);
 }
 
 const char* Compiler::BaseSymbolTypeToString(BaseSymbolType type)
@@ -951,6 +1378,39 @@ SymbolTableEntry* Compiler::AddSymbol(const char* name, SymbolType type, int32_t
     return symbol;
 }
 
+void Compiler::GetTempVariableName(SymbolType type, char* buffer, size_t size)
+{
+    switch (type.base) {
+        case BaseSymbolType::Bool: {
+            var_count_bool++;
+            sprintf_s(buffer, size, "#b_%d", var_count_bool);
+            break;
+        }
+        case BaseSymbolType::Uint8: {
+            var_count_uint8++;
+            sprintf_s(buffer, size, "#ui8_%d", var_count_uint8);
+            break;
+        }
+        case BaseSymbolType::Uint16: {
+            var_count_uint16++;
+            sprintf_s(buffer, size, "#ui16_%d", var_count_uint16);
+            break;
+        }
+        case BaseSymbolType::Uint32: {
+            var_count_uint32++;
+            sprintf_s(buffer, size, "#ui32_%d", var_count_uint32);
+            break;
+        }
+        case BaseSymbolType::String: {
+            var_count_string++;
+            sprintf_s(buffer, size, "#s_%d", var_count_string);
+            break;
+        }
+
+        default: ThrowOnUnreachableCode();
+    }
+}
+
 const char* Compiler::ExpressionTypeToString(ExpressionType type)
 {
     switch (type) {
@@ -1109,6 +1569,11 @@ void Compiler::ReleaseDeclarationQueue()
     }
 
     parameter_count = 0;
+
+    // Temp. variables were released with the declaration queue
+    used_temps.clear();
+    unused_temps.clear();
+    pinned_temps.clear();
 }
 
 void Compiler::ReleaseAll()
@@ -1156,13 +1621,24 @@ void Compiler::PostprocessSymbolTable()
         symbol = symbol->next;
     }
 
+    ReferenceFunctions(nullptr);
+}
+
+void Compiler::ReferenceFunctions(std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>>* call_graph)
+{
     // Find entry point and create dependency graph
-    symbol = symbol_table;
+    SymbolTableEntry* symbol = symbol_table;
     SymbolTableEntry* entry_point = nullptr;
     while (symbol) {
+        if (symbol->type.base == BaseSymbolType::Function ||
+            symbol->type.base == BaseSymbolType::EntryPoint ||
+            symbol->type.base == BaseSymbolType::SharedFunction) {
+
+            symbol->ref_count = 0;
+        }
+
         if (!symbol->parent && symbol->type.base == BaseSymbolType::EntryPoint) {
             entry_point = symbol;
-            break;
         }
 
         symbol = symbol->next;
@@ -1172,21 +1648,30 @@ void Compiler::PostprocessSymbolTable()
         ThrowOnUnreachableCode();
     }
 
+    if (call_graph) {
+        call_graph->clear();
+    }
+
     std::stack<SymbolTableEntry*> dependency_stack { };
     dependency_stack.push(entry_point);
 
     do {
-        symbol = dependency_stack.top();
+        SymbolTableEntry* function = dependency_stack.top();
         dependency_stack.pop();
 
-        if (symbol->ref_count > 0) {
+        if (function->ref_count > 0) {
             // Function was already processed
             continue;
         }
 
-        symbol->ref_count++;
+        function->ref_count++;
 
-        int32_t ip_start = symbol->ip;
+        std::vector<SymbolTableEntry*>* callees = nullptr;
+        if (call_graph) {
+            callees = &(*call_graph)[function];
+        }
+
+        int32_t ip_start = function->ip;
         int32_t ip_current = ip_start;
         InstructionEntry* current = FindInstructionByIp(ip_current);
         while (current) {
@@ -1208,6 +1693,10 @@ void Compiler::PostprocessSymbolTable()
                 } else {
                     dependency_stack.push(target);
                 }
+
+                if (callees) {
+                    callees->push_back(target);
+                }
             }
 
             current = current->next;
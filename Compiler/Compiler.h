@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <iostream>
 #include <vector>
+#include <unordered_map>
 #include <functional>
 
 #include "CompilerException.h"
@@ -23,6 +24,31 @@
 /// </summary>
 #define EntryPointName "Main"
 
+/// <summary>
+/// Minimal number of cases of "switch" statement, that are dispatched through jump table
+/// </summary>
+#define SwitchJumpTableMinCases 4
+
+/// <summary>
+/// Maximal number of jump table entries per case, sparser cases are found by binary search
+/// </summary>
+#define SwitchJumpTableMaxEntriesPerCase 2
+
+/// <summary>
+/// Maximal number of cases of "switch" statement, that are compared one by one
+/// </summary>
+#define SwitchLinearSearchMaxCases 3
+
+/// <summary>
+/// Minimal number of string constants compared to the same variable, that are dispatched through perfect hash
+/// </summary>
+#define SwitchStringHashMinCases 4
+
+/// <summary>
+/// Maximal size (log2) of jump table for strings, that is dispatched through perfect hash
+/// </summary>
+#define SwitchStringHashMaxBits 10
+
 // Defines to shorten the code
 #define TypeIsValid(type)                                                           \
     (type.base == BaseSymbolType::Uint8  || type.base == BaseSymbolType::Uint16 ||  \
@@ -136,6 +162,7 @@
         var.value = _decl_index->name;                                          \
         var.type = _decl_index->type;                                           \
         var.exp_type = ExpressionType::Variable;                                \
+        var.index.value = nullptr;                                              \
     }
 
 #define PrepareIndexedVariableIfNeededMarker(var, marker)                       \
@@ -149,6 +176,7 @@
         var.value = _decl_index->name;                                          \
         var.type = _decl_index->type;                                           \
         var.exp_type = ExpressionType::Variable;                                \
+        var.index.value = nullptr;                                              \
                                                                                 \
         marker.ip += 1;                                                         \
     }
@@ -284,6 +312,34 @@ public:
     BackpatchList* AddToStreamWithBackpatch(InstructionType type);
     void BackpatchStream(BackpatchList* list, int32_t new_ip);
 
+    /// <summary>
+    /// Generate dispatch of "switch" statement, dense ranges of cases jump through
+    /// a table, sparse cases are found by binary search
+    /// </summary>
+    /// <param name="op">Switch expression</param>
+    /// <param name="cases">All cases of the statement</param>
+    /// <returns>Jumps to the end of the statement, if it has no default case</returns>
+    BackpatchList* AddSwitchToStream(const InstructionOperand& op, SwitchBackpatchList* cases);
+
+    /// <summary>
+    /// Find perfect hash function for specified strings, so each of them has its own entry
+    /// in the smallest possible table, the hash is computed as "(h + c) * multiplier" for each character
+    /// </summary>
+    /// <param name="values">Distinct strings</param>
+    /// <param name="multiplier">Multiplier of the hash function</param>
+    /// <param name="bits">Size of the table (log2)</param>
+    /// <returns>True if the hash function was found</returns>
+    bool FindStringHash(const std::vector<const char*>& values, uint16_t& multiplier, uint8_t& bits);
+
+    /// <summary>
+    /// Compute index of string in the table of perfect hash, the highest bits of the hash are used
+    /// </summary>
+    /// <param name="value">String</param>
+    /// <param name="multiplier">Multiplier of the hash function</param>
+    /// <param name="bits">Size of the table (log2)</param>
+    /// <returns>Index to the table</returns>
+    uint32_t GetStringHashIndex(const char* value, uint16_t multiplier, uint8_t bits);
+
     SymbolTableEntry* GetSymbols();
 
     SymbolTableEntry* ToDeclarationList(SymbolType type, int32_t size, const char* name, ExpressionType exp_type);
@@ -292,8 +348,8 @@ public:
 
     void AddLabel(const char* name, int32_t ip);
     void AddStaticVariable(SymbolType type, int32_t size, const char* name);
-    void AddFunction(char* name, SymbolType return_type);
-    void AddFunctionPrototype(char* name, SymbolType return_type);
+    void AddFunction(char* name, SymbolType return_type, bool is_inline);
+    void AddFunctionPrototype(char* name, SymbolType return_type, bool is_inline);
 
     void PrepareForCall(const char* name, SymbolTableEntry* call_parameters, int32_t parameter_count);
 
@@ -314,6 +370,21 @@ public:
     /// <returns>Instruction</returns>
     InstructionEntry* FindInstructionByIp(int32_t ip);
 
+    /// <summary>
+    /// Get number of copies of the loop body requested by "#unroll" directive,
+    /// the directive is bound to the first instruction that follows it
+    /// </summary>
+    /// <param name="entry">Instruction</param>
+    /// <returns>Number of copies (1 disables unrolling); or 0 if not specified</returns>
+    int32_t GetUnrollCount(InstructionEntry* entry);
+
+    /// <summary>
+    /// Find all functions reachable from entry point and count references to them,
+    /// all calls of each reachable function are collected to call graph
+    /// </summary>
+    /// <param name="call_graph">Called functions for each function; or nullptr</param>
+    void ReferenceFunctions(std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>>* call_graph);
+
     bool CanImplicitCast(SymbolType to, SymbolType from, ExpressionType type);
     bool CanExplicitCast(SymbolType to, SymbolType from);
     SymbolType GetLargestTypeForArithmetic(SymbolType a, SymbolType b);
@@ -331,6 +402,41 @@ public:
     /// <returns>New symbol</returns>
     SymbolTableEntry* GetUnusedVariable(SymbolType type);
 
+    /// <summary>
+    /// Generate new temporary variable with specified type in already parsed function,
+    /// the variable is added directly to symbol table and it's never reused
+    /// </summary>
+    /// <param name="type">Type of variable</param>
+    /// <param name="parent">Name of parent function</param>
+    /// <returns>New symbol</returns>
+    SymbolTableEntry* AddTempVariable(SymbolType type, const char* parent);
+
+    /// <summary>
+    /// Add copy of already parsed function with all its parameters, variables and labels to symbol table,
+    /// name of the copy is generated, so it cannot collide with user-defined functions
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    /// <param name="ip">Instruction pointer of the copy</param>
+    /// <returns>New function symbol</returns>
+    SymbolTableEntry* AddFunctionCopy(SymbolTableEntry* function, int32_t ip);
+
+    /// <summary>
+    /// Return all temporary variables used by finished statement to the pool,
+    /// so they can be reused by following statements
+    /// </summary>
+    void ReleaseUnusedVariables();
+
+    /// <summary>
+    /// Protect all temporary variables used so far from releasing, they are
+    /// needed until the matching UnpinUsedVariables is called
+    /// </summary>
+    void PinUsedVariables();
+
+    /// <summary>
+    /// Remove variables pinned by the last PinUsedVariables call, they are not reused
+    /// </summary>
+    void UnpinUsedVariables();
+
     /// <summary>
     /// Get size of type in bytes
     /// </summary>
@@ -357,6 +463,11 @@ private:
     SymbolTableEntry* AddSymbol(const char* name, SymbolType type, int32_t size, SymbolType return_type,
         ExpressionType exp_type, int32_t ip, int32_t parameter, const char* parent, bool is_temp);
 
+    /// <summary>
+    /// Generate unique name of temporary variable with specified type
+    /// </summary>
+    void GetTempVariableName(SymbolType type, char* buffer, size_t size);
+
     const char* ExpressionTypeToString(ExpressionType type);
 
     void ReleaseDeclarationQueue();
@@ -374,6 +485,15 @@ private:
 
     bool StringStartsWith(wchar_t* str, const wchar_t* prefix, wchar_t*& result);
 
+    /// <summary>
+    /// Generate dispatch of "switch" statement with string expression, cases are found
+    /// by perfect hash and verified by one comparison, if there are enough of them
+    /// </summary>
+    /// <param name="op">Switch expression</param>
+    /// <param name="cases">All cases of the statement</param>
+    /// <returns>Jumps to the end of the statement, if it has no default case</returns>
+    BackpatchList* AddStringSwitchToStream(const InstructionOperand& op, SwitchBackpatchList* cases);
+
 
     InstructionEntry* instruction_stream_head = nullptr;
     InstructionEntry* instruction_stream_tail = nullptr;
@@ -391,6 +511,11 @@ private:
     uint32_t var_count_uint32 = 0;
     uint32_t var_count_string = 0;
 
+    // Temporary variables of current function, that are in use or ready to be reused
+    std::vector<SymbolTableEntry*> used_temps;
+    std::vector<SymbolTableEntry*> unused_temps;
+    std::vector<size_t> pinned_temps;
+
     std::vector<BackpatchList*> break_list;
     std::vector<BackpatchList*> continue_list;
     int32_t assign_scope = 0;
@@ -398,6 +523,10 @@ private:
     int32_t continue_scope = -1;
 
     uint32_t stack_size = 0;
+
+    // Loops that follow "#unroll" directive
+    int32_t unroll_count = 0;
+    std::unordered_map<InstructionEntry*, int32_t> unroll_hints;
     
 };
 
@@ -1,5 +1,6 @@
 #include "DosExeEmitter.h"
 
+#include <algorithm>
 #include <iostream>
 #include <list>
 #include <memory>
@@ -64,18 +65,45 @@ void DosExeEmitter::EmitInstructions(InstructionEntry* instruction_stream)
     CreateVariableList(symbol_table);
 
     // Find IPs that are targets for "goto" statements,
-    // at these places, compiler must unload all variables from registers
+    // at these places, compiler must merge register states of all predecessors,
+    // targets of backward jumps (loops) need to be reconciled at every jump
     std::unordered_set<uint32_t> discontinuous_ips;
+    std::unordered_set<uint32_t> loop_ips;
     {
         InstructionEntry* current = instruction_stream;
+        int32_t ip = 0;
         while (current) {
             if (current->type == InstructionType::Goto) {
                 discontinuous_ips.insert(current->goto_statement.ip);
+
+                if (current->goto_statement.ip <= ip) {
+                    loop_ips.insert(current->goto_statement.ip);
+                }
             } else if (current->type == InstructionType::If) {
                 discontinuous_ips.insert(current->if_statement.ip);
+
+                if (current->if_statement.ip <= ip) {
+                    loop_ips.insert(current->if_statement.ip);
+                }
+            } else if (current->type == InstructionType::Switch) {
+                // Entries of jump table are reached only by indirect jump
+                for (uint32_t k = 1; k <= current->switch_statement.count + 1; k++) {
+                    discontinuous_ips.insert(ip + k);
+                }
             }
 
             current = current->next;
+            ip++;
+        }
+
+        SymbolTableEntry* symbol = symbol_table;
+        while (symbol) {
+            if (symbol->type.base == BaseSymbolType::Label) {
+                discontinuous_ips.insert(symbol->ip);
+                loop_ips.insert(symbol->ip);
+            }
+
+            symbol = symbol->next;
         }
     }
 
@@ -91,15 +119,12 @@ void DosExeEmitter::EmitInstructions(InstructionEntry* instruction_stream)
 
     while (current_instruction) {
 
-        // Unload all registers before "goto" statement target, so we can
-        // jump to it without any issues
+        // Keep only registers that are the same in all jumps to "goto" statement
+        // target, so we can jump to it without any issues
         if (discontinuous_ips.find(ip_src) != discontinuous_ips.end()) {
-            SaveAndUnloadAllRegisters(SaveReason::Before);
+            MergeRegisterStates(loop_ips.find(ip_src) != loop_ips.end());
         }
 
-        // Used for abstract instruction to real instruction pointer conversion
-        ip_src_to_dst[ip_src] = ip_dst;
-
         // These methods are called before every abstract instruction
         ProcessSymbolLinkage(symbol_table);
 
@@ -108,9 +133,14 @@ void DosExeEmitter::EmitInstructions(InstructionEntry* instruction_stream)
             break;
         }
 
+        // Used for abstract instruction to real instruction pointer conversion,
+        // function prologue must be already emitted at this point
+        ip_src_to_dst[ip_src] = ip_dst;
+
         BackpatchAddresses();
 
         was_return = false;
+        was_jump = false;
 
         switch (current_instruction->type) {
             case InstructionType::Nop:        break;
@@ -118,6 +148,7 @@ void DosExeEmitter::EmitInstructions(InstructionEntry* instruction_stream)
             case InstructionType::Goto:       EmitGoto(current_instruction);                    break;
             case InstructionType::GotoLabel:  EmitGotoLabel(current_instruction);               break;
             case InstructionType::If:         EmitIf(current_instruction);                      break;
+            case InstructionType::Switch:     EmitSwitch(current_instruction);                  break;
             case InstructionType::Push:       EmitPush(current_instruction, call_parameters);   break;
             case InstructionType::Call:       EmitCall(current_instruction, symbol_table, call_parameters); break;
             case InstructionType::Return:     EmitReturn(current_instruction, symbol_table);    break;
@@ -129,6 +160,10 @@ void DosExeEmitter::EmitInstructions(InstructionEntry* instruction_stream)
         ip_src++;
     }
 
+    if (discontinuous_ips.find(ip_src) != discontinuous_ips.end()) {
+        MergeRegisterStates(false);
+    }
+
     EmitFunctionEpilogue();
 
     Log::PopIndent();
@@ -142,11 +177,9 @@ void DosExeEmitter::EmitSharedFunctions()
 
     SymbolTableEntry* symbol_table = compiler->GetSymbols();
 
-    // This buffer is used for (almost) all I/O operations
-    const int32_t io_buffer_size = 0x20; // 32 bytes
-
+    // This buffer is used for (almost) all I/O operations, it's allocated
+    // with static variables, so it doesn't occupy any space in the image
     bool io_buffer_needed = false;
-    uint16_t io_buffer_address = 0;
 
     // Check, if I/O buffer for read/print operations is needed
     {
@@ -168,15 +201,20 @@ void DosExeEmitter::EmitSharedFunctions()
         }
     }
 
-    // Buffer is needed, allocate space for it
     if (io_buffer_needed) {
-        io_buffer_address = ip_dst + 0x0100 /*Program Segment Prefix*/;
-
-        // ToDo: This could be allocated only on runtime
-        uint8_t* buffer = AllocateBufferForInstruction(io_buffer_size);
-        memset(buffer, 0, io_buffer_size);
+        io_buffer_size = 0x20; // 32 bytes
     }
 
+    // Load address of the buffer to DX register
+    auto load_io_buffer_to_dx = [&]() {
+        //   mov dx, buffer
+        uint8_t* a = AllocateBufferForInstruction(1 + 2);
+        a[0] = ToOpR(0xB8, CpuRegister::DX);   // mov r16, imm16
+        BackpatchIoBuffer(a + 1);
+
+        MarkRegisterAsDiscarded(CpuRegister::DX);
+    };
+
     // Emit only referenced functions
     EmitSharedFunction("PrintUint32", [&]() {
         AsmProcEnter();
@@ -195,7 +233,7 @@ void DosExeEmitter::EmitSharedFunctions()
         uint8_t* l5 = AllocateBufferForInstruction(2 + 2 + 1);
         l5[0] = 0xC6;  // mov rm8, imm8
         l5[1] = ToXrm(2, 0, 5);
-        *(uint16_t*)(l5 + 2) = io_buffer_address;
+        BackpatchIoBuffer(l5 + 2);
         l5[4] = 0x24; // '$'
 
         uint32_t loop = ip_dst;
@@ -220,7 +258,7 @@ void DosExeEmitter::EmitSharedFunctions()
         uint8_t* l9 = AllocateBufferForInstruction(2 + 2);
         l9[0] = 0x88;   // mov rm8, r8
         l9[1] = ToXrm(2, CpuRegister::DL, 5);
-        *(uint16_t*)(l9 + 2) = io_buffer_address;
+        BackpatchIoBuffer(l9 + 2);
 
         //   cmp eax, 0
         uint8_t* l10 = AllocateBufferForInstruction(4);
@@ -234,7 +272,7 @@ void DosExeEmitter::EmitSharedFunctions()
         l11[0] = 0x75;   // jnz rel8
         *(int8_t*)(l11 + 1) = (int8_t)(loop - ip_dst);
 
-        LoadConstantToRegister(io_buffer_address, CpuRegister::DX, 2);
+        load_io_buffer_to_dx();
 
         AsmAdd(CpuRegister::DX, CpuRegister::DI, 2);
 
@@ -294,10 +332,10 @@ void DosExeEmitter::EmitSharedFunctions()
         l1[0] = 0x66;   // Operand size prefix
         l1[1] = 0xC7;   // mov rm32, imm32
         l1[2] = ToXrm(0, 0, 6);
-        *(uint16_t*)(l1 + 3) = io_buffer_address;
+        BackpatchIoBuffer(l1 + 3);
         *(uint32_t*)(l1 + 5) = 0x00240A0D;      // '\r\n$\0'
 
-        LoadConstantToRegister(io_buffer_address, CpuRegister::DX, 2);
+        load_io_buffer_to_dx();
 
         AsmInt(0x21 /*DOS Function Dispatcher*/, 0x09 /*Write String To Stdout*/);
 
@@ -309,10 +347,10 @@ void DosExeEmitter::EmitSharedFunctions()
         uint8_t* l1 = AllocateBufferForInstruction(2 + 2 + 2);
         l1[0] = 0xC7;   // mov rm16, imm16
         l1[1] = ToXrm(0, 0, 6);
-        *(uint16_t*)(l1 + 2) = io_buffer_address;
+        BackpatchIoBuffer(l1 + 2);
         *(uint16_t*)(l1 + 4) = io_buffer_size;
 
-        LoadConstantToRegister(io_buffer_address, CpuRegister::DX, 2);
+        load_io_buffer_to_dx();
 
         AsmInt(0x21 /*DOS Function Dispatcher*/, 0x0A /*Buffered Keyboard Input*/);
 
@@ -328,7 +366,7 @@ void DosExeEmitter::EmitSharedFunctions()
         uint8_t* l6 = AllocateBufferForInstruction(2 + 2);
         l6[0] = 0x8A;   // mov r8, rm8
         l6[1] = ToXrm(2, CpuRegister::BL, 4);
-        *(uint16_t*)(l6 + 2) = io_buffer_address;
+        BackpatchIoBuffer(l6 + 2);
 
         //   cmp bl, '9'
         uint8_t* l7 = AllocateBufferForInstruction(2 + 1);
@@ -725,44 +763,58 @@ void DosExeEmitter::EmitSharedFunctions()
 
 void DosExeEmitter::EmitStaticData()
 {
-    // Emit all unique strings, and backpatch their addresses
+    // Emit all unique strings, and backpatch their addresses,
+    // strings that are not referenced by emitted code are skipped
     {
         std::unordered_set<char*>::iterator it = strings.begin();
 
         while (it != strings.end()) {
-            BackpatchLabels({ *it, ip_dst }, DosBackpatchTarget::String);
-
-            uint32_t str_length = (uint32_t)strlen(*it);
-            uint8_t* dst = AllocateBufferForInstruction(str_length + 1);
-            memcpy(dst, *it, str_length);
-            dst[str_length] = '\0';
+            if (BackpatchLabels({ *it, ip_dst }, DosBackpatchTarget::String) > 0) {
+                uint32_t str_length = (uint32_t)strlen(*it);
+                uint8_t* dst = AllocateBufferForInstruction(str_length + 1);
+                memcpy(dst, *it, str_length);
+                dst[str_length] = '\0';
+            }
 
             ++it;
         }
     }
 
-    // Pre-allocate virtual space for all static variables
+    // Pre-allocate virtual space for all static variables that are accessed by emitted code
     {
-        std::list<DosVariableDescriptor>::iterator it = variables.begin();
-
-        while (it != variables.end()) {
-            if (!it->symbol->parent) {
-                int32_t size;
-                if (it->symbol->size > 0) {
-                    SymbolType resolved_type = it->symbol->type;
-                    resolved_type.pointer--;
-                    size = it->symbol->size * compiler->GetSymbolTypeSize(resolved_type);
-                } else {
-                    size = compiler->GetSymbolTypeSize(it->symbol->type);
-                }
+        int32_t removed = 0;
 
-                BackpatchLabels({ it->symbol->name, ip_dst + static_size }, DosBackpatchTarget::Static);
+        DosVariableDescriptor* it = variables.data();
 
+        while (it != static_variables_end) {
+            int32_t size;
+            if (it->symbol->size > 0) {
+                SymbolType resolved_type = it->symbol->type;
+                resolved_type.pointer--;
+                size = it->symbol->size * compiler->GetSymbolTypeSize(resolved_type);
+            } else {
+                size = compiler->GetSymbolTypeSize(it->symbol->type);
+            }
+
+            if (BackpatchLabels({ it->symbol->name, ip_dst + static_size }, DosBackpatchTarget::Static) > 0) {
                 static_size += size;
+            } else {
+                removed++;
             }
 
             ++it;
         }
+
+        if (removed > 0) {
+            Log::Write(LogType::Verbose, "Removed %d unreferenced static variables", removed);
+        }
+    }
+
+    // Shared I/O buffer is uninitialized, so it's allocated with static variables too
+    if (io_buffer_size > 0) {
+        BackpatchLabels({ (char*)IoBufferName, ip_dst + static_size }, DosBackpatchTarget::Static);
+
+        static_size += io_buffer_size;
     }
 }
 
@@ -806,7 +858,7 @@ void DosExeEmitter::FixMzHeader(InstructionEntry* instruction_stream, uint32_t s
 
     // Adjust start IP
     if (instruction_stream && instruction_stream->type == InstructionType::Goto) {
-        header->ip = ip_src_to_dst[instruction_stream->goto_statement.ip];
+        header->ip = entry_point_offset;
     }
 
     Log::Write(LogType::Verbose, "Entry point: 0x%04x", header->ip);
@@ -834,8 +886,23 @@ void DosExeEmitter::Save(FILE* stream)
 
 void DosExeEmitter::CreateVariableList(SymbolTableEntry* symbol_table)
 {
+    // Count all variables first, so the list is allocated only once
+    // and descriptors can be referenced by pointers
+    size_t count = 0;
     SymbolTableEntry* current = symbol_table;
 
+    while (current) {
+        if (TypeIsValid(current->type)) {
+            count++;
+        }
+
+        current = current->next;
+    }
+
+    variables.reserve(count);
+
+    current = symbol_table;
+
     while (current) {
         if (TypeIsValid(current->type)) {
             // Add all variables to the list, so they
@@ -848,49 +915,80 @@ void DosExeEmitter::CreateVariableList(SymbolTableEntry* symbol_table)
 
         current = current->next;
     }
+
+    // Static variables are placed first, function-local variables are grouped by
+    // parent function, so each function uses only its own contiguous range
+    std::stable_sort(variables.begin(), variables.end(), [](const DosVariableDescriptor& a, const DosVariableDescriptor& b) {
+        if (!a.symbol->parent || !b.symbol->parent) {
+            return (!a.symbol->parent && b.symbol->parent);
+        }
+
+        int32_t result = strcmp(a.symbol->parent, b.symbol->parent);
+        if (result != 0) {
+            return (result < 0);
+        }
+
+        return (strcmp(a.symbol->name, b.symbol->name) < 0);
+    });
+
+    // Static variables are sorted by name too, so all lookups can use binary search
+    DosVariableDescriptor* begin = variables.data();
+    DosVariableDescriptor* end = begin + variables.size();
+
+    static_variables_end = std::find_if(begin, end, [](const DosVariableDescriptor& var) {
+        return (var.symbol->parent != nullptr);
+    });
+
+    std::stable_sort(begin, static_variables_end, [](const DosVariableDescriptor& a, const DosVariableDescriptor& b) {
+        return (strcmp(a.symbol->name, b.symbol->name) < 0);
+    });
 }
 
-CpuRegister DosExeEmitter::GetUnusedRegister()
+void DosExeEmitter::SelectParentVariables(SymbolTableEntry* function)
 {
-    // First four 32-bit registers are generally usable
-    DosVariableDescriptor* register_used[4] { };
-
-    std::list<DosVariableDescriptor>::iterator it = variables.begin();
+    DosVariableDescriptor* end = variables.data() + variables.size();
 
-    while (it != variables.end()) {
-        if (it->reg != CpuRegister::None && (!it->symbol->parent || (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0))) {
-            register_used[(int32_t)it->reg] = &(*it);
-        }
+    parent_variables_begin = std::lower_bound(static_variables_end, end, function->name, [](const DosVariableDescriptor& var, const char* name) {
+        return (strcmp(var.symbol->parent, name) < 0);
+    });
+    parent_variables_end = std::upper_bound(parent_variables_begin, end, function->name, [](const char* name, const DosVariableDescriptor& var) {
+        return (strcmp(name, var.symbol->parent) < 0);
+    });
+}
 
-        ++it;
+CpuRegister DosExeEmitter::GetUnusedRegister()
+{
+    // First four 32-bit registers are generally usable
+    uint32_t available = ~(used_registers | suppressed_registers) & 0x0F;
+    if (available) {
+        // Register is empty (it was not used yet in this scope)
+        return LowestRegister(available);
     }
 
     DosVariableDescriptor* last_used = nullptr;
 
     for (int32_t i = 0; i < 4; i++) {
-        if (suppressed_registers.find((CpuRegister)i) != suppressed_registers.end()) {
+        if (suppressed_registers & (1 << i)) {
             // Skip suppressed registers
             continue;
         }
 
-        if (!register_used[i]) {
-            // Register is empty (it was not used yet in this scope)
-            return (CpuRegister)i;
+        if (!last_used || last_used->last_used > register_owners[i]->last_used) {
+            last_used = register_owners[i];
         }
+    }
 
-        if (!last_used || last_used->last_used > register_used[i]->last_used) {
-            last_used = register_used[i];
-        }
+    if (!last_used) {
+        // All registers are suppressed, this should not happen
+        ThrowOnUnreachableCode();
     }
 
     CpuRegister reg = last_used->reg;
 
     // Register was used, save it back to the stack and discard it
-    if (last_used->reg != CpuRegister::None) {
-        SaveVariable(last_used, SaveReason::Inside);
-    }
+    SaveVariable(last_used, SaveReason::Inside);
 
-    last_used->reg = CpuRegister::None;
+    SetVariableRegister(last_used, CpuRegister::None);
     last_used->is_dirty = false;
 
     return reg;
@@ -899,66 +997,97 @@ CpuRegister DosExeEmitter::GetUnusedRegister()
 CpuRegister DosExeEmitter::TryGetUnusedRegister()
 {
     // First four 32-bit registers are generally usable
-    DosVariableDescriptor* register_used[4] { };
+    uint32_t available = ~(used_registers | suppressed_registers) & 0x0F;
+    if (available) {
+        // Register is empty (it was not used yet in this scope)
+        return LowestRegister(available);
+    }
 
-    std::list<DosVariableDescriptor>::iterator it = variables.begin();
+    // No unused register found
+    return CpuRegister::None;
+}
 
-    while (it != variables.end()) {
-        if (it->reg != CpuRegister::None && (!it->symbol->parent || (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0))) {
-            register_used[(int32_t)it->reg] = &(*it);
+CpuRegister DosExeEmitter::LowestRegister(uint32_t mask)
+{
+    for (int32_t i = 0; i < 4; i++) {
+        if (mask & (1 << i)) {
+            return (CpuRegister)i;
         }
+    }
 
-        ++it;
+    return CpuRegister::None;
+}
+
+void DosExeEmitter::SetVariableRegister(DosVariableDescriptor* var, CpuRegister reg)
+{
+    if (var->reg != CpuRegister::None && register_owners[(int32_t)var->reg] == var) {
+        register_owners[(int32_t)var->reg] = nullptr;
+        used_registers &= ~(1 << (int32_t)var->reg);
     }
 
-    for (int32_t i = 0; i < 4; i++) {
-        if (suppressed_registers.find((CpuRegister)i) != suppressed_registers.end()) {
-            // Skip suppressed registers
-            continue;
+    var->reg = reg;
+
+    if (reg != CpuRegister::None) {
+        if ((int32_t)reg >= 4) {
+            // Only first four registers can be owned by variables
+            ThrowOnUnreachableCode();
         }
 
-        if (!register_used[i]) {
-            // Register is empty (it was not used yet in this scope)
-            return (CpuRegister)i;
+        // Previous owner of the register loses it
+        DosVariableDescriptor* owner = register_owners[(int32_t)reg];
+        if (owner && owner != var) {
+            owner->reg = CpuRegister::None;
         }
+
+        register_owners[(int32_t)reg] = var;
+        used_registers |= (1 << (int32_t)reg);
     }
+}
 
-    // No unused register found
-    return CpuRegister::None;
+void DosExeEmitter::ResetRegisterFile()
+{
+    for (int32_t i = 0; i < 4; i++) {
+        if (register_owners[i]) {
+            register_owners[i]->reg = CpuRegister::None;
+            register_owners[i]->is_dirty = false;
+            register_owners[i] = nullptr;
+        }
+    }
+
+    used_registers = 0;
 }
 
 DosVariableDescriptor* DosExeEmitter::FindVariableByName(char* name)
 {
     // Search in function-local variables
-    {
-        std::list<DosVariableDescriptor>::iterator it = variables.begin();
-
-        while (it != variables.end()) {
-            if (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0 && strcmp(it->symbol->name, name) == 0) {
-                return &(*it);
-            }
-
-            ++it;
-        }
+    DosVariableDescriptor* var = FindVariableInRange(parent_variables_begin, parent_variables_end, name);
+    if (var) {
+        return var;
     }
 
     // Search in static (global) variables
-    {
-        std::list<DosVariableDescriptor>::iterator it = variables.begin();
-
-        while (it != variables.end()) {
-            if (!it->symbol->parent && strcmp(it->symbol->name, name) == 0) {
-                return &(*it);
-            }
-
-            ++it;
-        }
+    var = FindVariableInRange(variables.data(), static_variables_end, name);
+    if (var) {
+        return var;
     }
 
     // Variable cannot be found
     ThrowOnUnreachableCode();
 }
 
+DosVariableDescriptor* DosExeEmitter::FindVariableInRange(DosVariableDescriptor* begin, DosVariableDescriptor* end, const char* name)
+{
+    DosVariableDescriptor* it = std::lower_bound(begin, end, name, [](const DosVariableDescriptor& var, const char* name) {
+        return (strcmp(var.symbol->name, name) < 0);
+    });
+
+    if (it == end || strcmp(it->symbol->name, name) != 0) {
+        return nullptr;
+    }
+
+    return it;
+}
+
 InstructionEntry* DosExeEmitter::FindNextVariableReference(DosVariableDescriptor* var, SaveReason reason)
 {
     InstructionEntry* current = current_instruction;
@@ -992,6 +1121,12 @@ InstructionEntry* DosExeEmitter::FindNextVariableReference(DosVariableDescriptor
 
                     return current;
                 }
+
+                if (var->symbol->is_temp && !current->assignment.dst_index.value &&
+                    strcmp(var->symbol->name, current->assignment.dst_value) == 0) {
+                    // Temp. variable is reused, previous value is not needed anymore
+                    return nullptr;
+                }
                 break;
             }
             case InstructionType::If: {
@@ -1016,6 +1151,15 @@ InstructionEntry* DosExeEmitter::FindNextVariableReference(DosVariableDescriptor
                 }
                 break;
             }
+            case InstructionType::Switch: {
+                if (current->switch_statement.op.exp_type == ExpressionType::Variable &&
+                    current->switch_statement.op.value &&
+                    strcmp(var->symbol->name, current->switch_statement.op.value) == 0) {
+
+                    return current;
+                }
+                break;
+            }
             case InstructionType::Goto: {
                 if (current->goto_statement.ip < ip_src) {
                     // Program wants to jump backwards, it's unpredictible
@@ -1055,6 +1199,14 @@ InstructionEntry* DosExeEmitter::FindNextVariableReference(DosVariableDescriptor
                 }
                 break;
             }
+            case InstructionType::Call: {
+                if (var->symbol->is_temp && current->call_statement.return_symbol &&
+                    strcmp(var->symbol->name, current->call_statement.return_symbol) == 0) {
+                    // Temp. variable is reused, previous value is not needed anymore
+                    return nullptr;
+                }
+                break;
+            }
             case InstructionType::Return: {
                 if (current->return_statement.op.exp_type == ExpressionType::Variable &&
                     current->return_statement.op.value &&
@@ -1073,6 +1225,119 @@ InstructionEntry* DosExeEmitter::FindNextVariableReference(DosVariableDescriptor
     return nullptr;
 }
 
+bool DosExeEmitter::IsVariableOverwritten(DosVariableDescriptor* var, SaveReason reason)
+{
+    if (reason == SaveReason::Force) {
+        return false;
+    }
+
+    // Static variables are visible to called functions and to the caller
+    bool is_static = !var->symbol->parent;
+
+    auto is_read = [&](const char* value, ExpressionType exp_type) {
+        return (value && exp_type == ExpressionType::Variable && strcmp(var->symbol->name, value) == 0);
+    };
+
+    InstructionEntry* current = current_instruction;
+    int32_t ip = ip_src;
+
+    while (current && ip <= parent_end_ip) {
+        bool is_current = (ip == ip_src);
+
+        switch (current->type) {
+            case InstructionType::Nop: {
+                break;
+            }
+            case InstructionType::Assign: {
+                if (is_current && reason == SaveReason::Inside) {
+                    break;
+                }
+
+                auto& assignment = current->assignment;
+                if (is_read(assignment.op1.value, assignment.op1.exp_type) ||
+                    is_read(assignment.op1.index.value, assignment.op1.index.exp_type) ||
+                    is_read(assignment.op2.value, assignment.op2.exp_type) ||
+                    is_read(assignment.op2.index.value, assignment.op2.index.exp_type) ||
+                    is_read(assignment.dst_index.value, assignment.dst_index.exp_type)) {
+                    return false;
+                }
+
+                if (assignment.dst_index.value || assignment.op1.index.value || assignment.op2.index.value) {
+                    if (is_static || strcmp(var->symbol->name, assignment.dst_value) == 0) {
+                        // Static variable can be accessed indirectly through pointer
+                        return false;
+                    }
+                    break;
+                }
+
+                if (strcmp(var->symbol->name, assignment.dst_value) == 0) {
+                    return true;
+                }
+                break;
+            }
+            case InstructionType::Push: {
+                if (is_current && reason == SaveReason::Inside) {
+                    break;
+                }
+
+                if (is_read(current->push_statement.symbol->name, current->push_statement.symbol->exp_type)) {
+                    return false;
+                }
+                break;
+            }
+            case InstructionType::Call: {
+                if (is_static) {
+                    return false;
+                }
+                break;
+            }
+            case InstructionType::Return: {
+                if (is_static || (!(is_current && reason == SaveReason::Inside) &&
+                    is_read(current->return_statement.op.value, current->return_statement.op.exp_type))) {
+                    return false;
+                }
+
+                // Local variables go out of scope
+                return true;
+            }
+
+            default: {
+                // Value can be read on the other path of the jump
+                return false;
+            }
+        }
+
+        current = current->next;
+        ip++;
+    }
+
+    return false;
+}
+
+void DosExeEmitter::MarkReferencedVariables()
+{
+    InstructionEntry* current = current_instruction;
+    int32_t ip = ip_src;
+
+    // The whole function has to be checked before the first jump target is reached,
+    // reference can be taken after the loop header was already emitted
+    while (current && ip <= parent_end_ip) {
+        if (current->type == InstructionType::Assign && current->assignment.type == AssignType::None &&
+            !current->assignment.dst_index.value && current->assignment.op1.exp_type == ExpressionType::Variable &&
+            !current->assignment.op1.index.value) {
+
+            DosVariableDescriptor* dst = FindVariableByName(current->assignment.dst_value);
+            DosVariableDescriptor* op1 = FindVariableByName(current->assignment.op1.value);
+            if (dst && op1 && dst->symbol->type.pointer > op1->symbol->type.pointer) {
+                op1->force_save = true;
+            }
+        }
+
+        current = current->next;
+        ip++;
+    }
+}
+
 void DosExeEmitter::RefreshParentEndIp(SymbolTableEntry* symbol_table)
 {
     InstructionEntry* current = current_instruction->next;
@@ -1097,6 +1362,306 @@ void DosExeEmitter::RefreshParentEndIp(SymbolTableEntry* symbol_table)
     parent_end_ip = ip;
 }
 
+void DosExeEmitter::ComputeVariableLifetimes(std::vector<DosVariableLifetime>& lifetimes)
+{
+    int32_t count = (int32_t)(parent_variables_end - parent_variables_begin);
+    int32_t length = parent_end_ip - parent_start_ip + 1;
+
+    std::vector<DosVariableLifetime> all(count);
+    for (int32_t j = 0; j < count; j++) {
+        all[j].var = parent_variables_begin + j;
+        all[j].first_ip = INT32_MAX;
+        all[j].last_ip = -1;
+    }
+
+    // Registers are flushed to stack at jumps, calls and jump targets,
+    // dirty variable cannot be saved after the next flush
+    std::vector<bool> is_flush(length + 1);
+    is_flush[length] = true;
+
+    // Pairs of target IP and source IP of backward jumps
+    std::list<std::pair<int32_t, int32_t>> back_jumps;
+
+    auto mark_jump = [&](int32_t target, int32_t ip) {
+        is_flush[ip - parent_start_ip] = true;
+
+        if (target >= parent_start_ip && target <= parent_end_ip + 1) {
+            is_flush[target - parent_start_ip] = true;
+        }
+        if (target <= ip) {
+            back_jumps.push_back({ target, ip });
+        }
+    };
+
+    auto touch = [&](const char* name, int32_t ip) {
+        if (!name) {
+            return;
+        }
+
+        DosVariableDescriptor* var = FindVariableInRange(parent_variables_begin, parent_variables_end, name);
+        if (!var || var->symbol->parameter) {
+            return;
+        }
+
+        DosVariableLifetime& lifetime = all[var - parent_variables_begin];
+        if (lifetime.first_ip > ip) {
+            lifetime.first_ip = ip;
+        }
+        if (lifetime.last_ip < ip) {
+            lifetime.last_ip = ip;
+        }
+    };
+
+    auto touch_operand = [&](InstructionOperand& op, int32_t ip) {
+        if (op.exp_type == ExpressionType::Variable && op.value) {
+            touch(op.value, ip);
+        }
+        if (op.index.exp_type == ExpressionType::Variable && op.index.value) {
+            touch(op.index.value, ip);
+        }
+    };
+
+    // Parameters are pushed to stack by "call" instruction
+    std::list<char*> pushed;
+
+    InstructionEntry* current = parent_first_instruction;
+    int32_t ip = parent_start_ip;
+
+    while (current && ip <= parent_end_ip) {
+        switch (current->type) {
+            case InstructionType::Assign: {
+                touch(current->assignment.dst_value, ip);
+                if (current->assignment.dst_index.exp_type == ExpressionType::Variable && current->assignment.dst_index.value) {
+                    touch(current->assignment.dst_index.value, ip);
+                }
+
+                touch_operand(current->assignment.op1, ip);
+                touch_operand(current->assignment.op2, ip);
+                break;
+            }
+            case InstructionType::Goto: {
+                mark_jump(current->goto_statement.ip, ip);
+                break;
+            }
+            case InstructionType::GotoLabel: {
+                SymbolTableEntry* symbol = compiler->GetSymbols();
+                while (symbol) {
+                    if (symbol->type.base == BaseSymbolType::Label && symbol->parent && strcmp(symbol->parent, parent->name) == 0 &&
+                        strcmp(symbol->name, current->goto_label_statement.label) == 0) {
+
+                        mark_jump(symbol->ip, ip);
+                        break;
+                    }
+
+                    symbol = symbol->next;
+                }
+                break;
+            }
+            case InstructionType::If: {
+                touch_operand(current->if_statement.op1, ip);
+                touch_operand(current->if_statement.op2, ip);
+
+                mark_jump(current->if_statement.ip, ip);
+                break;
+            }
+            case InstructionType::Switch: {
+                touch_operand(current->switch_statement.op, ip);
+
+                is_flush[ip - parent_start_ip] = true;
+                break;
+            }
+            case InstructionType::Push: {
+                if (current->push_statement.symbol->exp_type == ExpressionType::Variable) {
+                    touch(current->push_statement.symbol->name, ip);
+
+                    pushed.push_back(current->push_statement.symbol->name);
+                }
+                break;
+            }
+            case InstructionType::Call: {
+                // Parameters are loaded in "call" instruction
+                std::list<char*>::iterator it = pushed.begin();
+
+                while (it != pushed.end()) {
+                    touch(*it, ip);
+
+                    ++it;
+                }
+
+                pushed.clear();
+
+                if (current->call_statement.return_symbol) {
+                    touch(current->call_statement.return_symbol, ip);
+                }
+
+                is_flush[ip - parent_start_ip] = true;
+                break;
+            }
+            case InstructionType::Return: {
+                touch_operand(current->return_statement.op, ip);
+
+                is_flush[ip - parent_start_ip] = true;
+                break;
+            }
+        }
+
+        current = current->next;
+        ip++;
+    }
+
+    // Labels are targets of jumps too
+    {
+        SymbolTableEntry* symbol = compiler->GetSymbols();
+        while (symbol) {
+            if (symbol->type.base == BaseSymbolType::Label && symbol->parent && strcmp(symbol->parent, parent->name) == 0 &&
+                symbol->ip >= parent_start_ip && symbol->ip <= parent_end_ip) {
+
+                is_flush[symbol->ip - parent_start_ip] = true;
+            }
+
+            symbol = symbol->next;
+        }
+    }
+
+    for (int32_t j = 0; j < count; j++) {
+        DosVariableLifetime& lifetime = all[j];
+        if (lifetime.var->symbol->parameter || lifetime.var->symbol->ref_count == 0) {
+            continue;
+        }
+
+        if (lifetime.var->symbol->size > 0 || lifetime.var->force_save || lifetime.last_ip < 0) {
+            // Arrays and variables with taken address can be accessed anywhere in the function
+            lifetime.first_ip = parent_start_ip;
+            lifetime.last_ip = parent_end_ip;
+        } else if (!lifetime.var->symbol->is_temp) {
+            // Variable can be kept dirty in register after its last reference,
+            // it's saved on the next flush, if any backward jump follows
+            while (!is_flush[lifetime.last_ip - parent_start_ip]) {
+                lifetime.last_ip++;
+            }
+
+            // Variable that is referenced inside of a loop must survive the whole loop,
+            // temp. variables go out of scope at backward jumps
+            bool changed;
+            do {
+                changed = false;
+
+                std::list<std::pair<int32_t, int32_t>>::iterator it = back_jumps.begin();
+
+                while (it != back_jumps.end()) {
+                    if (lifetime.first_ip <= it->second && lifetime.last_ip >= it->first) {
+                        if (lifetime.first_ip > it->first) {
+                            lifetime.first_ip = it->first;
+                            changed = true;
+                        }
+                        if (lifetime.last_ip < it->second) {
+                            lifetime.last_ip = it->second;
+                            changed = true;
+                        }
+                    }
+
+                    ++it;
+                }
+            } while (changed);
+        }
+
+        lifetimes.push_back(lifetime);
+    }
+}
+
+int32_t DosExeEmitter::AssignStackSlots(int32_t& saved_size)
+{
+    std::vector<DosVariableLifetime> lifetimes;
+    ComputeVariableLifetimes(lifetimes);
+
+    auto get_size = [&](SymbolTableEntry* symbol) {
+        if (symbol->size > 0) {
+            SymbolType resolved_type = symbol->type;
+            resolved_type.pointer--;
+            return symbol->size * compiler->GetSymbolTypeSize(resolved_type);
+        } else {
+            return compiler->GetSymbolTypeSize(symbol->type);
+        }
+    };
+
+    saved_size = 0;
+
+    // Unreferenced variables are not allocated at all
+    {
+        DosVariableDescriptor* it = parent_variables_begin;
+
+        while (it != parent_variables_end) {
+            if (!it->symbol->parameter && it->symbol->ref_count == 0) {
+                saved_size += get_size(it->symbol);
+            }
+
+            ++it;
+        }
+    }
+
+    // Linear scan in order of the first reference, a slot can be reused
+    // if it has the same size and the previous lifetime has already ended
+    std::stable_sort(lifetimes.begin(), lifetimes.end(), [](const DosVariableLifetime& a, const DosVariableLifetime& b) {
+        return (a.first_ip < b.first_ip);
+    });
+
+    std::vector<DosStackSlot> slots;
+    std::vector<int32_t> slot_of(lifetimes.size());
+
+    for (size_t j = 0; j < lifetimes.size(); j++) {
+        SymbolTableEntry* symbol = lifetimes[j].var->symbol;
+
+        int32_t size = get_size(symbol);
+        int32_t align;
+        if (symbol->size > 0) {
+            SymbolType resolved_type = symbol->type;
+            resolved_type.pointer--;
+            align = compiler->GetSymbolTypeSize(resolved_type);
+        } else {
+            align = size;
+        }
+
+        int32_t found = -1;
+        for (size_t k = 0; k < slots.size(); k++) {
+            if (slots[k].size == size && slots[k].align == align && slots[k].last_ip < lifetimes[j].first_ip) {
+                found = (int32_t)k;
+                break;
+            }
+        }
+
+        if (found >= 0) {
+            slots[found].last_ip = lifetimes[j].last_ip;
+            saved_size += size;
+        } else {
+            found = (int32_t)slots.size();
+            slots.push_back({ size, align, lifetimes[j].last_ip, 0 });
+        }
+
+        slot_of[j] = found;
+    }
+
+    // Slots with the largest alignment are placed first, so no padding is needed
+    int32_t stack_var_size = 0;
+
+    for (int32_t align = 4; align > 0; align >>= 1) {
+        for (size_t k = 0; k < slots.size(); k++) {
+            if (slots[k].align == align) {
+                stack_var_size += slots[k].size;
+                slots[k].location = -stack_var_size;
+            }
+        }
+    }
+
+    for (size_t j = 0; j < lifetimes.size(); j++) {
+        DosVariableDescriptor* var = lifetimes[j].var;
+        var->location = slots[slot_of[j]].location;
+
+        BackpatchLabels({ var->symbol->name, var->location }, DosBackpatchTarget::Local);
+    }
+
+    return stack_var_size;
+}
+
 void DosExeEmitter::SaveVariable(DosVariableDescriptor* var, SaveReason reason)
 {
     if (var->symbol->size > 0) {
@@ -1108,6 +1673,14 @@ void DosExeEmitter::SaveVariable(DosVariableDescriptor* var, SaveReason reason)
         return;
     }
 
+    if (!var->force_save && IsVariableOverwritten(var, reason)) {
+        // Value is overwritten before it's read again, so it doesn't have to be saved
+#if _DEBUG
+        Log::Write(LogType::Info, "Store to variable \"%s\" was optimized out", var->symbol->name);
+#endif
+        return;
+    }
+
     int32_t var_size = compiler->GetSymbolTypeSize(var->symbol->type);
 
     if (var->symbol->parent) {
@@ -1200,10 +1773,15 @@ void DosExeEmitter::SaveIndexedVariable(DosVariableDescriptor* var, InstructionO
     resolved_type.pointer--;
     int32_t resolved_size = compiler->GetSymbolTypeSize(resolved_type);
 
+    // Pointer with zero offset can be copied directly to the register
+    bool is_pointer_only = (var->symbol->size == 0 && index.exp_type == ExpressionType::Constant && atoi(index.value) == 0);
+
     switch (index.exp_type) {
         case ExpressionType::Constant: {
-            int32_t value = atoi(index.value) * resolved_size;
-            LoadConstantToRegister(value, CpuRegister::DI, 2);
+            if (!is_pointer_only) {
+                int32_t value = atoi(index.value) * resolved_size;
+                LoadConstantToRegister(value, CpuRegister::DI, 2);
+            }
             break;
         }
         case ExpressionType::Variable: {
@@ -1229,19 +1807,19 @@ void DosExeEmitter::SaveIndexedVariable(DosVariableDescriptor* var, InstructionO
         if (var->reg != CpuRegister::None) {
             // Pointer is already loaded in register
             uint8_t* a = AllocateBufferForInstruction(2);
-            a[0] = 0x03;    // add r16, rm16
+            a[0] = (is_pointer_only ? 0x8B : 0x03);    // mov r16, rm16 / add r16, rm16
             a[1] = ToXrm(3, CpuRegister::DI, var->reg);
         } else if (!var->symbol->parent) {
             // Pointer is in static (16-bit range)
             uint8_t* a = AllocateBufferForInstruction(2 + 2);
-            a[0] = 0x03;   // add r16, rm16
+            a[0] = (is_pointer_only ? 0x8B : 0x03);   // mov r16, rm16 / add r16, rm16
             a[1] = ToXrm(0, CpuRegister::DI, 6);
 
             BackpatchStatic(a + 2, var);
         } else {
             // Pointer is in stack (8-bit range)
             uint8_t* a = AllocateBufferForInstruction(2 + 1);
-            a[0] = 0x03;   // add r16, rm16
+            a[0] = (is_pointer_only ? 0x8B : 0x03);   // mov r16, rm16 / add r16, rm16
             a[1] = ToXrm(1, CpuRegister::DI, 6);
 
             BackpatchLocal(a + 2, var);
@@ -1317,65 +1895,211 @@ void DosExeEmitter::SaveIndexedVariable(DosVariableDescriptor* var, InstructionO
                 a[1] = 0x89;   // mov rm32, r32
                 a[2] = ToXrm(1, reg_dst, 3);
 
-                BackpatchLocal(a + 3, var);
-            }
-            break;
+                BackpatchLocal(a + 3, var);
+            }
+            break;
+        }
+
+        default: ThrowOnUnreachableCode();
+    }
+}
+
+void DosExeEmitter::SaveAndUnloadRegister(CpuRegister reg, SaveReason reason)
+{
+    if ((int32_t)reg >= 4) {
+        return;
+    }
+
+    DosVariableDescriptor* owner = register_owners[(int32_t)reg];
+    if (owner) {
+        SaveVariable(owner, reason);
+        SetVariableRegister(owner, CpuRegister::None);
+    }
+}
+
+void DosExeEmitter::SaveAndUnloadAllRegisters(SaveReason reason)
+{
+    for (int32_t i = 0; i < 4; i++) {
+        DosVariableDescriptor* owner = register_owners[i];
+        if (owner) {
+            SaveVariable(owner, reason);
+            SetVariableRegister(owner, CpuRegister::None);
         }
+    }
+}
 
-        default: ThrowOnUnreachableCode();
+void DosExeEmitter::SaveAllRegisters(SaveReason reason)
+{
+    for (int32_t i = 0; i < 4; i++) {
+        DosVariableDescriptor* owner = register_owners[i];
+        if (owner) {
+            SaveVariable(owner, reason);
+
+            if (owner->is_dirty) {
+                // Variable was optimized out, its value cannot be kept in register
+                SetVariableRegister(owner, CpuRegister::None);
+                owner->is_dirty = false;
+            }
+        }
     }
 }
 
-void DosExeEmitter::SaveAndUnloadRegister(CpuRegister reg, SaveReason reason)
+DosRegisterState DosExeEmitter::GetRegisterState()
 {
-    std::list<DosVariableDescriptor>::iterator it = variables.begin();
+    DosRegisterState state { };
 
-    while (it != variables.end()) {
-        if (it->reg == reg && (!it->symbol->parent || (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0))) {
-            SaveVariable(&(*it), reason);
-            it->reg = CpuRegister::None;
-            break;
-        }
+    for (int32_t i = 0; i < 4; i++) {
+        DosVariableDescriptor* owner = register_owners[i];
 
-        ++it;
+        // Variables with reference can be changed indirectly, so they are always reloaded
+        if (owner && !owner->force_save && !owner->is_dirty) {
+            state.vars[i] = owner;
+        }
     }
+
+    return state;
 }
 
-void DosExeEmitter::SaveAndUnloadAllRegisters(SaveReason reason)
+void DosExeEmitter::PrepareRegistersForJump(int32_t target_ip)
 {
-    std::list<DosVariableDescriptor>::iterator it = variables.begin();
+    if (target_ip > ip_src) {
+        // Target was not emitted yet, keep only registers
+        // that are the same as in all previous jumps
+        DosRegisterState state = GetRegisterState();
+
+        std::map<int32_t, DosRegisterState>::iterator it = ip_register_states.find(target_ip);
+        if (it == ip_register_states.end()) {
+            ip_register_states[target_ip] = state;
+        } else {
+            for (int32_t i = 0; i < 4; i++) {
+                if (it->second.vars[i] != state.vars[i]) {
+                    it->second.vars[i] = nullptr;
+                }
+            }
+        }
+        return;
+    }
+
+    std::map<int32_t, DosRegisterState>::iterator it = ip_register_states.find(target_ip);
+    if (it == ip_register_states.end()) {
+        // Target doesn't expect anything in registers
+        return;
+    }
+
+    // Target was already emitted, so registers have to be reconciled with its state,
+    // all variables are already saved, so registers can be reloaded without any issues
+    bool is_blocked = false;
+    for (int32_t pass = 0; pass < 2; pass++) {
+        for (int32_t i = 0; i < 4; i++) {
+            DosVariableDescriptor* var = it->second.vars[i];
+            if (!var || var->reg == (CpuRegister)i) {
+                continue;
+            }
 
-    while (it != variables.end()) {
-        if (it->reg != CpuRegister::None && (!it->symbol->parent || (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0))) {
-            SaveVariable(&(*it), reason);
-            it->reg = CpuRegister::None;
+            DosVariableDescriptor* owner = register_owners[i];
+            if (pass == 0 && owner) {
+                // Register is occupied by another variable, try to move it first,
+                // so the value doesn't have to be loaded from memory again
+                bool is_needed = false;
+                for (int32_t j = 0; j < 4; j++) {
+                    if (j != i && it->second.vars[j] == owner) {
+                        is_needed = true;
+                        break;
+                    }
+                }
+
+                if (is_needed) {
+                    is_blocked = true;
+                    continue;
+                }
+            }
+
+            int32_t var_size = compiler->GetSymbolTypeSize(var->symbol->type);
+            CopyVariableToRegister(var, (CpuRegister)i, var_size);
+
+            SetVariableRegister(var, (CpuRegister)i);
+            var->is_dirty = false;
         }
 
-        ++it;
+        if (!is_blocked) {
+            break;
+        }
     }
 }
 
-void DosExeEmitter::MarkRegisterAsDiscarded(CpuRegister reg)
+void DosExeEmitter::MergeRegisterStates(bool is_loop)
 {
     if (!parent) {
         return;
     }
 
-    std::list<DosVariableDescriptor>::iterator it = variables.begin();
+    // Previous instruction can continue to the current one
+    bool is_reachable = (!was_return && !was_jump);
 
-    while (it != variables.end()) {
-        if (it->reg == reg && (!it->symbol->parent || (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0))) {
-            if (it->is_dirty) {
-                // This should not happen, register owned by variable is discarded,
-                // but variable was not written back to stack yet
-                ThrowOnUnreachableCode();
+    if (is_reachable) {
+        SaveAllRegisters(SaveReason::Before);
+    }
+
+    DosRegisterState state { };
+
+    std::map<int32_t, DosRegisterState>::iterator entry = ip_register_states.find(ip_src);
+    if (is_reachable) {
+        state = GetRegisterState();
+
+        if (entry != ip_register_states.end()) {
+            for (int32_t i = 0; i < 4; i++) {
+                if (entry->second.vars[i] != state.vars[i]) {
+                    state.vars[i] = nullptr;
+                }
             }
+        }
+    } else if (entry != ip_register_states.end()) {
+        state = entry->second;
+    }
 
-            it->reg = CpuRegister::None;
-            break;
+    for (int32_t i = 0; i < 4; i++) {
+        if (!state.vars[i]) {
+            continue;
         }
 
-        ++it;
+        InstructionEntry* next = FindNextVariableReference(state.vars[i], SaveReason::Before);
+        if (!next) {
+            // Variable is not needed anymore, don't keep it in register
+            state.vars[i] = nullptr;
+        } else if (is_loop && next != current_instruction) {
+            // Every backward jump has to reload all registers of the loop,
+            // so keep only variables that are used immediately (e.g. in condition)
+            state.vars[i] = nullptr;
+        }
+    }
+
+    // Unreference all registers that don't match the merged state
+    ResetRegisterFile();
+
+    for (int32_t i = 0; i < 4; i++) {
+        if (state.vars[i]) {
+            SetVariableRegister(state.vars[i], (CpuRegister)i);
+        }
+    }
+
+    ip_register_states[ip_src] = state;
+}
+
+void DosExeEmitter::MarkRegisterAsDiscarded(CpuRegister reg)
+{
+    if (!parent || (int32_t)reg >= 4) {
+        return;
+    }
+
+    DosVariableDescriptor* owner = register_owners[(int32_t)reg];
+    if (owner) {
+        if (owner->is_dirty) {
+            // This should not happen, register owned by variable is discarded,
+            // but variable was not written back to stack yet
+            ThrowOnUnreachableCode();
+        }
+
+        SetVariableRegister(owner, CpuRegister::None);
     }
 }
 
@@ -1572,10 +2296,15 @@ CpuRegister DosExeEmitter::LoadIndexedVariable(DosVariableDescriptor* var, Instr
     resolved_type.pointer--;
     int32_t resolved_size = compiler->GetSymbolTypeSize(resolved_type);
 
+    // Pointer with zero offset can be copied directly to the register
+    bool is_pointer_only = (var->symbol->size == 0 && index.exp_type == ExpressionType::Constant && atoi(index.value) == 0);
+
     switch (index.exp_type) {
         case ExpressionType::Constant: {
-            int32_t value = atoi(index.value) * resolved_size;
-            LoadConstantToRegister(value, CpuRegister::SI, 2);
+            if (!is_pointer_only) {
+                int32_t value = atoi(index.value) * resolved_size;
+                LoadConstantToRegister(value, CpuRegister::SI, 2);
+            }
             break;
         }
         case ExpressionType::Variable: {
@@ -1600,19 +2329,19 @@ CpuRegister DosExeEmitter::LoadIndexedVariable(DosVariableDescriptor* var, Instr
         if (var->reg != CpuRegister::None) {
             // Pointer is already loaded in register
             uint8_t* a = AllocateBufferForInstruction(2);
-            a[0] = 0x03;    // add r16, rm16
+            a[0] = (is_pointer_only ? 0x8B : 0x03);    // mov r16, rm16 / add r16, rm16
             a[1] = ToXrm(3, CpuRegister::SI, var->reg);
         } else if (!var->symbol->parent) {
             // Pointer is in static (16-bit range)
             uint8_t* a = AllocateBufferForInstruction(2 + 2);
-            a[0] = 0x03;   // add r16, rm16
+            a[0] = (is_pointer_only ? 0x8B : 0x03);   // mov r16, rm16 / add r16, rm16
             a[1] = ToXrm(0, CpuRegister::SI, 6);
 
             BackpatchStatic(a + 2, var);
         } else {
             // Pointer is in stack (8-bit range)
             uint8_t* a = AllocateBufferForInstruction(2 + 1);
-            a[0] = 0x03;   // add r16, rm16
+            a[0] = (is_pointer_only ? 0x8B : 0x03);   // mov r16, rm16 / add r16, rm16
             a[1] = ToXrm(1, CpuRegister::SI, 6);
 
             BackpatchLocal(a + 2, var);
@@ -1792,7 +2521,7 @@ void DosExeEmitter::CopyVariableToRegister(DosVariableDescriptor* var, CpuRegist
         if (var->reg == reg_dst && var_size >= desired_size) {
             // Variable is already in desired register with desired size
             SaveVariable(var, SaveReason::Inside);
-            var->reg = CpuRegister::None;
+            SetVariableRegister(var, CpuRegister::None);
             return;
         }
 
@@ -1801,7 +2530,7 @@ void DosExeEmitter::CopyVariableToRegister(DosVariableDescriptor* var, CpuRegist
         if (var->reg == reg_dst) {
             // Variable is in desired register, remove ownership
             SaveVariable(var, SaveReason::Inside);
-            var->reg = CpuRegister::None;
+            SetVariableRegister(var, CpuRegister::None);
         } else {
             // Variable is in another register
             SaveAndUnloadRegister(reg_dst, SaveReason::Inside);
@@ -2067,6 +2796,92 @@ void DosExeEmitter::ZeroRegister(CpuRegister reg, int32_t desired_size)
     }
 }
 
+void DosExeEmitter::MultiplyRegisterByConstant(CpuRegister reg, uint32_t value, int32_t size)
+{
+    // "lea" and "imul" have no 8-bit form, lower part of 16-bit result is the same
+    int32_t op_size = (size == 1 ? 2 : size);
+
+    if (size < 4) {
+        value &= (1u << (size * 8)) - 1;
+    }
+
+    if (value == 0) {
+        AsmSub(reg, reg, op_size);
+        return;
+    }
+
+    uint8_t shift = 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        shift++;
+    }
+
+    // Odd factors that can be computed by one "lea" with scaled index
+    auto GetLeaShift = [](uint32_t factor) -> uint8_t {
+        switch (factor) {
+            case 3: return 1;
+            case 5: return 2;
+            case 9: return 3;
+            default: return 0;
+        }
+    };
+
+    if (value > 1) {
+        uint8_t lea_shift = GetLeaShift(value);
+        if (lea_shift) {
+            AsmLea(reg, reg, reg, lea_shift, op_size);
+        } else {
+            uint8_t lea_shift1 = 0, lea_shift2 = 0;
+            for (uint32_t factor = 3; factor <= 9; factor += 2) {
+                if (GetLeaShift(factor) && (value % factor) == 0 && GetLeaShift(value / factor)) {
+                    lea_shift1 = GetLeaShift(factor);
+                    lea_shift2 = GetLeaShift(value / factor);
+                    break;
+                }
+            }
+
+            if (lea_shift1) {
+                AsmLea(reg, reg, reg, lea_shift1, op_size);
+                AsmLea(reg, reg, reg, lea_shift2, op_size);
+            } else {
+                // Factors (2^n + 1) and (2^n - 1) need one temporary register
+                bool is_add = ((value - 1) & (value - 2)) == 0;
+                bool is_sub = ((value + 1) & value) == 0;
+
+                CpuRegister reg_temp = CpuRegister::None;
+                if (is_add || is_sub) {
+                    uint32_t available = ~(used_registers | suppressed_registers | (1 << (int32_t)reg)) & 0x0F;
+                    reg_temp = LowestRegister(available);
+                }
+
+                if (reg_temp == CpuRegister::None) {
+                    // Generic multiplication, but it still doesn't need AX and DX
+                    AsmImul(reg, reg, (int32_t)(value << shift), op_size);
+                    return;
+                }
+
+                uint8_t n = 0;
+                while ((1ull << n) < value) {
+                    n++;
+                }
+
+                AsmMov(reg_temp, reg, op_size);
+                if (is_add) {
+                    AsmShl(reg, n - 1, op_size);
+                    AsmAdd(reg, reg_temp, op_size);
+                } else {
+                    AsmShl(reg, n, op_size);
+                    AsmSub(reg, reg_temp, op_size);
+                }
+            }
+        }
+    }
+
+    if (shift > 0) {
+        AsmShl(reg, shift, op_size);
+    }
+}
+
 void DosExeEmitter::BackpatchAddresses()
 {
     std::list<DosBackpatchInstruction>::iterator it = backpatch.begin();
@@ -2089,6 +2904,10 @@ void DosExeEmitter::BackpatchAddresses()
                     *(int16_t*)(buffer + it->backpatch_offset) = rel16;
                     break;
                 }
+                case DosBackpatchType::ToAbs16: {
+                    *(uint16_t*)(buffer + it->backpatch_offset) = (uint16_t)ip_src_to_dst[ip_src];
+                    break;
+                }
 
                 default: ThrowOnUnreachableCode();
             }
@@ -2100,8 +2919,10 @@ void DosExeEmitter::BackpatchAddresses()
     }
 }
 
-void DosExeEmitter::BackpatchLabels(const DosLabel& label, DosBackpatchTarget target)
+int32_t DosExeEmitter::BackpatchLabels(const DosLabel& label, DosBackpatchTarget target)
 {
+    int32_t count = 0;
+
     std::list<DosBackpatchInstruction>::iterator it = backpatch.begin();
 
     while (it != backpatch.end()) {
@@ -2137,10 +2958,13 @@ void DosExeEmitter::BackpatchLabels(const DosLabel& label, DosBackpatchTarget ta
             }
 
             it = backpatch.erase(it);
+            count++;
         } else {
             ++it;
         }
     }
+
+    return count;
 }
 
 void DosExeEmitter::CheckBackpatchListIsEmpty(DosBackpatchTarget target)
@@ -2172,10 +2996,13 @@ void DosExeEmitter::CheckReturnStatementPresent()
 {
     if (parent && !was_return) {
         if (parent->return_type.base == BaseSymbolType::Void && parent->return_type.pointer == 0) {
-            EmitReturn(nullptr, compiler->GetSymbols());
-
-            // Adjust "ip_src_to_dst" mapping, because of unloaded registers
+            // Jumps to the end of function have to point to the implicit return,
+            // not to the following function
             ip_src_to_dst[ip_src] = ip_dst;
+
+            BackpatchAddresses();
+
+            EmitReturn(nullptr, compiler->GetSymbols());
         } else {
             std::string message = "Function \"";
             message += parent->name;
@@ -2185,6 +3012,91 @@ void DosExeEmitter::CheckReturnStatementPresent()
     }
 }
 
+uint16_t DosExeEmitter::GetParameterStackSize(SymbolTableEntry* function, SymbolTableEntry* symbol_table)
+{
+    uint16_t stack_param_size = 0;
+
+    SymbolTableEntry* param_decl = symbol_table;
+    while (param_decl) {
+        if (param_decl->parameter != 0 && param_decl->parent && strcmp(param_decl->parent, function->name) == 0) {
+            int32_t size = compiler->GetSymbolTypeSize(param_decl->type);
+            if (size < 2) {
+                size = 2;
+            }
+            stack_param_size += size;
+        }
+
+        param_decl = param_decl->next;
+    }
+
+    return stack_param_size;
+}
+
+bool DosExeEmitter::IsTailCall(InstructionEntry* i, SymbolTableEntry* symbol_table)
+{
+    SymbolTableEntry* target = i->call_statement.target;
+
+    if (!parent || parent->type.base != BaseSymbolType::Function || target->type.base != BaseSymbolType::Function) {
+        return false;
+    }
+
+    // Called function has to return value of the same type and release the same stack region
+    if (target->return_type != parent->return_type ||
+        GetParameterStackSize(target, symbol_table) != GetParameterStackSize(parent, symbol_table)) {
+        return false;
+    }
+
+    // Call frame is destroyed, so no pointer to local variable can be passed to called function
+    for (DosVariableDescriptor* var = parent_variables_begin; var != parent_variables_end; var++) {
+        if (var->symbol->size > 0) {
+            return false;
+        }
+    }
+
+    InstructionEntry* current = parent_first_instruction;
+    int32_t current_ip = parent_start_ip;
+    while (current && current_ip <= parent_end_ip) {
+        if (current->type == InstructionType::Assign && current->assignment.type == AssignType::None &&
+            !current->assignment.dst_index.value && current->assignment.op1.exp_type == ExpressionType::Variable &&
+            !current->assignment.op1.index.value) {
+
+            DosVariableDescriptor* op1 = FindVariableInRange(parent_variables_begin, parent_variables_end, current->assignment.op1.value);
+            if (op1 && FindVariableByName(current->assignment.dst_value)->symbol->type.pointer > op1->symbol->type.pointer) {
+                return false;
+            }
+        }
+
+        current = current->next;
+        current_ip++;
+    }
+
+    bool is_void = (target->return_type.base == BaseSymbolType::Void && target->return_type.pointer == 0);
+
+    InstructionEntry* next = i->next;
+    int32_t ip = ip_src + 1;
+    while (next && ip <= parent_end_ip && next->type == InstructionType::Nop) {
+        next = next->next;
+        ip++;
+    }
+
+    if (!next || ip > parent_end_ip) {
+        // Void function can end without "return" statement
+        return is_void;
+    }
+
+    if (next->type != InstructionType::Return) {
+        return false;
+    }
+
+    InstructionOperand& op = next->return_statement.op;
+    if (op.exp_type == ExpressionType::None) {
+        return is_void;
+    }
+
+    return (!is_void && i->call_statement.return_symbol && op.exp_type == ExpressionType::Variable &&
+        !op.index.value && strcmp(op.value, i->call_statement.return_symbol) == 0);
+}
+
 void DosExeEmitter::ProcessSymbolLinkage(SymbolTableEntry* symbol_table)
 {
 Retry:
@@ -2201,6 +3113,8 @@ Retry:
 
                 RefreshParentEndIp(symbol_table);
 
+                MarkReferencedVariables();
+
                 Log::PopIndent();
                 Log::Write(LogType::Info, "Compiling entry point...");
                 Log::PushIndent();
@@ -2244,20 +3158,16 @@ Retry:
 
                 RefreshParentEndIp(symbol_table);
 
+                MarkReferencedVariables();
+
                 Log::PopIndent();
                 Log::Write(LogType::Info, "Compiling function \"%s\"...", parent->name);
                 Log::PushIndent();
             } else if (symbol->type.base == BaseSymbolType::Label) {
-                // Label
-
-                // Unload all registers before label, so we can
-                // jump to it without any issues
-                SaveAndUnloadAllRegisters(SaveReason::Before);
-
-                // Adjust "ip_src_to_dst" mapping, because of unloaded registers
-                ip_src_to_dst[ip_src] = ip_dst;
-
+                // Label, registers were already merged in EmitInstructions
                 BackpatchLabels({ symbol->name, ip_dst }, DosBackpatchTarget::Label);
+
+                labels.push_back({ symbol->name, ip_dst });
             }
         }
 
@@ -2269,6 +3179,13 @@ void DosExeEmitter::EmitEntryPointPrologue(SymbolTableEntry* function)
 {
     parent = function;
 
+    SelectParentVariables(function);
+
+    parent_start_ip = ip_src;
+    parent_first_instruction = current_instruction;
+
+    entry_point_offset = ip_dst;
+
     // Prepare for startup
     AsmMov(CpuRegister::AX, CpuSegment::DS);
     AsmMov(CpuSegment::SS, CpuRegister::AX);
@@ -2295,6 +3212,11 @@ void DosExeEmitter::EmitFunctionPrologue(SymbolTableEntry* function, SymbolTable
 {
     parent = function;
 
+    SelectParentVariables(function);
+
+    parent_start_ip = ip_src;
+    parent_first_instruction = current_instruction;
+
     // Create backpatch information
     BackpatchLabels({ function->name, ip_dst }, DosBackpatchTarget::Function);
 
@@ -2306,24 +3228,25 @@ void DosExeEmitter::EmitFunctionPrologue(SymbolTableEntry* function, SymbolTable
     // Allocate space for local variables in stack
     int32_t stack_param_size = 0;
 
-    std::list<DosVariableDescriptor>::iterator it = variables.begin();
+    SymbolTableEntry* param_decl = symbol_table;
 
-    while (it != variables.end()) {
-        if (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0) {
-            if (it->symbol->parameter) { // Parameter
-                int32_t size = compiler->GetSymbolTypeSize(it->symbol->type);
-                if (size < 2) { // Min. push size is 2 bytes
-                    size = 2;
-                }
+    while (param_decl) {
+        if (param_decl->parameter && param_decl->parent && strcmp(param_decl->parent, parent->name) == 0) {
+            // Parameters must be processed in declaration order
+            DosVariableDescriptor* var = FindVariableInRange(parent_variables_begin, parent_variables_end, param_decl->name);
 
-                // 4 bytes are used by ebp, 2 bytes are used for return address
-                it->location = stack_param_size + 6;
-
-                stack_param_size += size;
+            int32_t size = compiler->GetSymbolTypeSize(var->symbol->type);
+            if (size < 2) { // Min. push size is 2 bytes
+                size = 2;
             }
+
+            // 4 bytes are used by ebp, 2 bytes are used for return address
+            var->location = stack_param_size + 6;
+
+            stack_param_size += size;
         }
 
-        ++it;
+        param_decl = param_decl->next;
     }
 
     uint8_t* a = AllocateBufferForInstruction(2 + 2);
@@ -2345,36 +3268,8 @@ void DosExeEmitter::EmitFunctionEpilogue()
     CheckReturnStatementPresent();
 
     // Adjust stack for function-local variables
-    int32_t stack_var_size = 0;
-    int32_t stack_saved_size = 0;
-    std::list<DosVariableDescriptor>::iterator it = variables.begin();
-
-    while (it != variables.end()) {
-        if (it->symbol->parent && strcmp(it->symbol->parent, parent->name) == 0) {
-            if (!it->symbol->parameter) { // Local variable
-                int32_t size;
-                if (it->symbol->size > 0) {
-                    SymbolType resolved_type = it->symbol->type;
-                    resolved_type.pointer--;
-                    size = it->symbol->size * compiler->GetSymbolTypeSize(resolved_type);
-                } else {
-                    size = compiler->GetSymbolTypeSize(it->symbol->type);
-                }
-
-                if (it->symbol->ref_count == 0) {
-                    stack_saved_size += size;
-                } else {
-                    stack_var_size += size;
-
-                    it->location = -stack_var_size;
-
-                    BackpatchLabels({ it->symbol->name, it->location }, DosBackpatchTarget::Local);
-                }
-            }
-        }
-
-        ++it;
-    }
+    int32_t stack_saved_size;
+    int32_t stack_var_size = AssignStackSlots(stack_saved_size);
 
     if (!parent_stack_offset) {
         ThrowOnUnreachableCode();
@@ -2394,7 +3289,15 @@ void DosExeEmitter::EmitFunctionEpilogue()
     // Labels are function-local too, so they must be resolved at this point
     CheckBackpatchListIsEmpty(DosBackpatchTarget::Label);
 
+    // Registers are not preserved across function boundaries,
+    // all variables were already saved by the return statement
+    ResetRegisterFile();
+
+    ip_register_states.clear();
+
     parent = nullptr;
+    parent_variables_begin = nullptr;
+    parent_variables_end = nullptr;
 }
 
 void DosExeEmitter::EmitAssign(InstructionEntry* i)
@@ -2436,6 +3339,13 @@ void DosExeEmitter::EmitAssignNone(InstructionEntry* i)
 {
     DosVariableDescriptor* dst = FindVariableByName(i->assignment.dst_value);
 
+    // Array item has to be loaded with size of the item, not with size of the pointer
+    SymbolType dst_type = dst->symbol->type;
+    if (i->assignment.dst_index.value) {
+        dst_type.pointer--;
+    }
+    int32_t dst_size = compiler->GetSymbolTypeSize(dst_type);
+
     switch (i->assignment.op1.exp_type) {
         case ExpressionType::Constant: {
             CpuRegister reg_dst;
@@ -2456,8 +3366,6 @@ void DosExeEmitter::EmitAssignNone(InstructionEntry* i)
                 reg_dst = GetUnusedRegister();
 
                 int32_t value = atoi(i->assignment.op1.value);
-
-                int32_t dst_size = compiler->GetSymbolTypeSize(dst->symbol->type);
                 LoadConstantToRegister(value, reg_dst, dst_size);
             }
 
@@ -2465,7 +3373,7 @@ void DosExeEmitter::EmitAssignNone(InstructionEntry* i)
                 // Array values are not cached
                 SaveIndexedVariable(dst, i->assignment.dst_index, reg_dst);
             } else {
-                dst->reg = reg_dst;
+                SetVariableRegister(dst, reg_dst);
                 dst->is_dirty = true;
             }
             dst->last_used = ip_src;
@@ -2475,7 +3383,6 @@ void DosExeEmitter::EmitAssignNone(InstructionEntry* i)
             DosVariableDescriptor* op1 = FindVariableByName(i->assignment.op1.value);
 
             int32_t op1_size = compiler->GetSymbolTypeSize(op1->symbol->type);
-            int32_t dst_size = compiler->GetSymbolTypeSize(dst->symbol->type);
 
             CpuRegister reg_dst;
             if (op1->symbol->exp_type == ExpressionType::Constant) {
@@ -2522,7 +3429,7 @@ void DosExeEmitter::EmitAssignNone(InstructionEntry* i)
                 // Array values are not cached
                 SaveIndexedVariable(dst, i->assignment.dst_index, reg_dst);
             } else {
-                dst->reg = reg_dst;
+                SetVariableRegister(dst, reg_dst);
                 dst->is_dirty = true;
             }
             dst->last_used = ip_src;
@@ -2594,14 +3501,14 @@ void DosExeEmitter::EmitAssignNegation(InstructionEntry* i)
             uint8_t* a = AllocateBufferForInstruction(3);
             a[0] = 0x66;   // Operand size prefix
             a[1] = 0xF7;   // neg rm32
-            a[2] = ToXrm(1, 3, reg_dst);
+            a[2] = ToXrm(3, 3, reg_dst);
             break;
         }
 
         default: ThrowOnUnreachableCode();
     }
 
-    dst->reg = reg_dst;
+    SetVariableRegister(dst, reg_dst);
     dst->is_dirty = true;
     dst->last_used = ip_src;
 }
@@ -2626,7 +3533,7 @@ void DosExeEmitter::EmitAssignAddSubtract(InstructionEntry* i)
             //dst->symbol->exp_type = ExpressionType::Constant;
 
             // Load string address to register
-            dst->reg = GetUnusedRegister();
+            SetVariableRegister(dst, GetUnusedRegister());
 
             uint8_t* a = AllocateBufferForInstruction(1 + 2);
             a[0] = ToOpR(0xB8, dst->reg);   // mov r16, imm16
@@ -2668,7 +3575,7 @@ void DosExeEmitter::EmitAssignAddSubtract(InstructionEntry* i)
 
         LoadConstantToRegister(value1, reg_dst, dst_size);
 
-        dst->reg = reg_dst;
+        SetVariableRegister(dst, reg_dst);
         dst->is_dirty = true;
         dst->last_used = ip_src;
         return;
@@ -2742,19 +3649,27 @@ void DosExeEmitter::EmitAssignAddSubtract(InstructionEntry* i)
             DosVariableDescriptor* op2 = FindVariableByName(i->assignment.op2.value);
             int32_t op2_size = compiler->GetSymbolTypeSize(op2->symbol->type);
 
-            if (op2_size < dst_size) {
-                SuppressRegister _(this, reg_dst);
-                op2->reg = LoadVariableUnreferenced(op2, dst_size);
+            CpuRegister op2_reg;
+            if (op2 == op1) {
+                // Both operands are the same variable, it's already loaded in destination register
+                op2_reg = reg_dst;
+            } else {
+                if (op2_size < dst_size) {
+                    SuppressRegister _(this, reg_dst);
+                    SetVariableRegister(op2, LoadVariableUnreferenced(op2, dst_size));
+                }
+
+                op2_reg = op2->reg;
             }
 
             switch (dst_size) {
                 case 1: {
                     uint8_t opcode = (i->assignment.type == AssignType::Add ? 0x02 : 0x2A);
-                    if (op2->reg != CpuRegister::None) {
+                    if (op2_reg != CpuRegister::None) {
                         // Register to register copy
                         uint8_t* a = AllocateBufferForInstruction(2);
                         a[0] = opcode; // add/sub r8, rm8
-                        a[1] = ToXrm(3, reg_dst, op2->reg);
+                        a[1] = ToXrm(3, reg_dst, op2_reg);
                     } else if (!op2->symbol->parent) {
                         // Static to register copy (16-bit range)
                         uint8_t* a = AllocateBufferForInstruction(2 + 2);
@@ -2774,11 +3689,11 @@ void DosExeEmitter::EmitAssignAddSubtract(InstructionEntry* i)
                 }
                 case 2: {
                     uint8_t opcode = (i->assignment.type == AssignType::Add ? 0x03 : 0x2B);
-                    if (op2->reg != CpuRegister::None) {
+                    if (op2_reg != CpuRegister::None) {
                         // Register to register copy
                         uint8_t* a = AllocateBufferForInstruction(2);
                         a[0] = opcode; // add/sub r16, rm16
-                        a[1] = ToXrm(3, reg_dst, op2->reg);
+                        a[1] = ToXrm(3, reg_dst, op2_reg);
                     } else if (!op2->symbol->parent) {
                         // Static to register copy (16-bit range)
                         uint8_t* a = AllocateBufferForInstruction(2 + 2);
@@ -2798,12 +3713,12 @@ void DosExeEmitter::EmitAssignAddSubtract(InstructionEntry* i)
                 }
                 case 4: {
                     uint8_t opcode = (i->assignment.type == AssignType::Add ? 0x03 : 0x2B);
-                    if (op2->reg != CpuRegister::None) {
+                    if (op2_reg != CpuRegister::None) {
                         // Register to register copy
                         uint8_t* a = AllocateBufferForInstruction(3);
                         a[0] = 0x66;   // Operand size prefix
                         a[1] = opcode; // add/sub r32, rm32
-                        a[2] = ToXrm(3, reg_dst, op2->reg);
+                        a[2] = ToXrm(3, reg_dst, op2_reg);
                     } else if (!op2->symbol->parent) {
                         // Static to register copy (16-bit range)
                         uint8_t* a = AllocateBufferForInstruction(3 + 2);
@@ -2832,7 +3747,7 @@ void DosExeEmitter::EmitAssignAddSubtract(InstructionEntry* i)
         default: ThrowOnUnreachableCode();
     }
 
-    dst->reg = reg_dst;
+    SetVariableRegister(dst, reg_dst);
     dst->is_dirty = true;
     dst->last_used = ip_src;
 }
@@ -2857,106 +3772,35 @@ void DosExeEmitter::EmitAssignMultiply(InstructionEntry* i)
 
         CpuRegister reg_dst = GetUnusedRegister();
 
-        LoadConstantToRegister(value1, reg_dst, dst_size);
-
-        dst->reg = reg_dst;
-        dst->is_dirty = true;
-        dst->last_used = ip_src;
-        return;
-    }
-
-    DosVariableDescriptor* op1 = FindVariableByName(i->assignment.op1.value);
-
-    switch (i->assignment.op2.exp_type) {
-        case ExpressionType::Constant: {
-            int32_t value = atoi(i->assignment.op2.value);
-
-            SaveAndUnloadRegister(CpuRegister::AX, SaveReason::Inside);
-            LoadConstantToRegister(value, CpuRegister::AX, dst_size);
-
-            switch (dst_size) {
-                case 1: {
-                    if (op1->reg != CpuRegister::None) {
-                        // Register to register copy
-                        uint8_t* a = AllocateBufferForInstruction(2);
-                        a[0] = 0xF6;   // mul r8, rm8
-                        a[1] = ToXrm(3, 4, op1->reg);
-                    } else if (!op1->symbol->parent) {
-                        // Static to register copy (16-bit range)
-                        uint8_t* a = AllocateBufferForInstruction(2 + 2);
-                        a[0] = 0xF6;   // mul r8, rm8
-                        a[1] = ToXrm(0, 4, 6);
-
-                        BackpatchStatic(a + 2, op1);
-                    } else {
-                        // Stack to register copy (8-bit range)
-                        uint8_t* a = AllocateBufferForInstruction(2 + 1);
-                        a[0] = 0xF6;   // mul r8, rm8
-                        a[1] = ToXrm(1, 4, 6);
-
-                        BackpatchLocal(a + 2, op1);
-                    }
-                    break;
-                }
-                case 2: {
-                    // DX register will be discarted after multiply
-                    SaveAndUnloadRegister(CpuRegister::DX, SaveReason::Inside);
-
-                    if (op1->reg != CpuRegister::None) {
-                        // Register to register copy
-                        uint8_t* a = AllocateBufferForInstruction(2);
-                        a[0] = 0xF7;   // mul r16, rm16
-                        a[1] = ToXrm(3, 4, op1->reg);
-                    } else if (!op1->symbol->parent) {
-                        // Static to register copy (16-bit range)
-                        uint8_t* a = AllocateBufferForInstruction(2 + 2);
-                        a[0] = 0xF7;   // mul r16, rm16
-                        a[1] = ToXrm(0, 4, 6);
-
-                        BackpatchStatic(a + 2, op1);
-                    } else {
-                        // Stack to register copy (8-bit range)
-                        uint8_t* a = AllocateBufferForInstruction(2 + 1);
-                        a[0] = 0xF7;   // mul r16, rm16
-                        a[1] = ToXrm(1, 4, 6);
-
-                        BackpatchLocal(a + 2, op1);
-                    }
-                    break;
-                }
-                case 4: {
-                    // DX register will be discarted after multiply
-                    SaveAndUnloadRegister(CpuRegister::DX, SaveReason::Inside);
-
-                    if (op1->reg != CpuRegister::None) {
-                        // Register to register copy
-                        uint8_t* a = AllocateBufferForInstruction(3);
-                        a[0] = 0x66;   // Operand size prefix
-                        a[1] = 0xF7;   // mul r32, rm32
-                        a[2] = ToXrm(3, 4, op1->reg);
-                    } else if (!op1->symbol->parent) {
-                        // Static to register copy (16-bit range)
-                        uint8_t* a = AllocateBufferForInstruction(3 + 2);
-                        a[0] = 0x66;   // Operand size prefix
-                        a[1] = 0xF7;   // mul r32, rm32
-                        a[2] = ToXrm(0, 4, 6);
+        LoadConstantToRegister(value1, reg_dst, dst_size);
 
-                        BackpatchStatic(a + 3, op1);
-                    } else {
-                        // Stack to register copy (8-bit range)
-                        uint8_t* a = AllocateBufferForInstruction(3 + 1);
-                        a[0] = 0x66;   // Operand size prefix
-                        a[1] = 0xF7;   // mul r32, rm32
-                        a[2] = ToXrm(1, 4, 6);
+        SetVariableRegister(dst, reg_dst);
+        dst->is_dirty = true;
+        dst->last_used = ip_src;
+        return;
+    }
 
-                        BackpatchLocal(a + 3, op1);
-                    }
-                    break;
-                }
+    DosVariableDescriptor* op1 = FindVariableByName(i->assignment.op1.value);
 
-                default: ThrowOnUnreachableCode();
+    switch (i->assignment.op2.exp_type) {
+        case ExpressionType::Constant: {
+            uint32_t value = (uint32_t)atoi(i->assignment.op2.value);
+
+            // Multiplication by constant is lowered to shifts, additions or "imul",
+            // so AX and DX don't have to be unloaded
+            CpuRegister reg_dst;
+            if (dst == op1 && op1->reg != CpuRegister::None) {
+                reg_dst = op1->reg;
+            } else {
+                reg_dst = LoadVariableUnreferenced(op1, dst_size);
             }
-            break;
+
+            MultiplyRegisterByConstant(reg_dst, value, dst_size);
+
+            SetVariableRegister(dst, reg_dst);
+            dst->is_dirty = true;
+            dst->last_used = ip_src;
+            return;
         }
         case ExpressionType::Variable: {
             DosVariableDescriptor* op2 = FindVariableByName(i->assignment.op2.value);
@@ -2967,24 +3811,39 @@ void DosExeEmitter::EmitAssignMultiply(InstructionEntry* i)
                 std::swap(op1, op2);
             }
 
+            if (op2 != op1 && op2->reg == CpuRegister::DX) {
+                // Operand is still needed after DX is overwritten,
+                // so it has to be saved (with current instruction as reference)
+                SaveVariable(op2, SaveReason::Before);
+                SetVariableRegister(op2, CpuRegister::None);
+            }
+
             CopyVariableToRegister(op1, CpuRegister::AX, dst_size);
 
             // One operand is already in AX
             SuppressRegister _(this, CpuRegister::AX);
 
-            int32_t op2_size = compiler->GetSymbolTypeSize(op2->symbol->type);
-            if (op2_size < dst_size) {
-                // Required size is higher than provided, unreference and expand it
-                op2->reg = LoadVariableUnreferenced(op2, dst_size);
+            CpuRegister op2_reg;
+            if (op2 == op1) {
+                // Both operands are the same variable, it's already loaded in AX
+                op2_reg = CpuRegister::AX;
+            } else {
+                int32_t op2_size = compiler->GetSymbolTypeSize(op2->symbol->type);
+                if (op2_size < dst_size) {
+                    // Required size is higher than provided, unreference and expand it
+                    SetVariableRegister(op2, LoadVariableUnreferenced(op2, dst_size));
+                }
+
+                op2_reg = op2->reg;
             }
 
             switch (dst_size) {
                 case 1: {
-                    if (op2->reg != CpuRegister::None) {
+                    if (op2_reg != CpuRegister::None) {
                         // Register to register copy
                         uint8_t* a = AllocateBufferForInstruction(2);
                         a[0] = 0xF6;   // mul r8, rm8
-                        a[1] = ToXrm(3, 4, op2->reg);
+                        a[1] = ToXrm(3, 4, op2_reg);
                     } else if (!op2->symbol->parent) {
                         // Static to register copy (16-bit range)
                         uint8_t* a = AllocateBufferForInstruction(2 + 2);
@@ -3006,11 +3865,11 @@ void DosExeEmitter::EmitAssignMultiply(InstructionEntry* i)
                     // DX register will be discarted after multiply
                     SaveAndUnloadRegister(CpuRegister::DX, SaveReason::Inside);
 
-                    if (op2->reg != CpuRegister::None) {
+                    if (op2_reg != CpuRegister::None) {
                         // Register to register copy
                         uint8_t* a = AllocateBufferForInstruction(2);
                         a[0] = 0xF7;   // mul r16, rm16
-                        a[1] = ToXrm(3, 4, op2->reg);
+                        a[1] = ToXrm(3, 4, op2_reg);
                     } else if (!op2->symbol->parent) {
                         // Static to register copy (16-bit range)
                         uint8_t* a = AllocateBufferForInstruction(2 + 2);
@@ -3032,12 +3891,12 @@ void DosExeEmitter::EmitAssignMultiply(InstructionEntry* i)
                     // DX register will be discarted after multiply
                     SaveAndUnloadRegister(CpuRegister::DX, SaveReason::Inside);
 
-                    if (op2->reg != CpuRegister::None) {
+                    if (op2_reg != CpuRegister::None) {
                         // Register to register copy
                         uint8_t* a = AllocateBufferForInstruction(3);
                         a[0] = 0x66;   // Operand size prefix
                         a[1] = 0xF7;   // mul r32, rm32
-                        a[2] = ToXrm(3, 4, op2->reg);
+                        a[2] = ToXrm(3, 4, op2_reg);
                     } else if (!op2->symbol->parent) {
                         // Static to register copy (16-bit range)
                         uint8_t* a = AllocateBufferForInstruction(3 + 2);
@@ -3066,7 +3925,7 @@ void DosExeEmitter::EmitAssignMultiply(InstructionEntry* i)
         default: ThrowOnUnreachableCode();
     }
 
-    dst->reg = CpuRegister::AX;
+    SetVariableRegister(dst, CpuRegister::AX);
     dst->is_dirty = true;
     dst->last_used = ip_src;
 }
@@ -3077,6 +3936,29 @@ void DosExeEmitter::EmitAssignDivide(InstructionEntry* i)
 
     int32_t dst_size = compiler->GetSymbolTypeSize(dst->symbol->type);
 
+    if (i->assignment.op1.exp_type == ExpressionType::Variable && i->assignment.op2.exp_type == ExpressionType::Constant) {
+        // Divisor is loaded with size of destination
+        uint32_t divisor = (uint32_t)atoi(i->assignment.op2.value);
+        if (dst_size < 4) {
+            divisor &= (1u << (dst_size * 8)) - 1;
+        }
+
+        if (divisor != 0) {
+            EmitAssignDivideByConstant(i, divisor);
+            return;
+        }
+    }
+
+    if (i->assignment.op2.exp_type == ExpressionType::Variable) {
+        // Divisor is still needed after AX and DX are overwritten,
+        // so it has to be saved (with current instruction as reference)
+        DosVariableDescriptor* op2 = FindVariableByName(i->assignment.op2.value);
+        if (op2->reg == CpuRegister::AX || op2->reg == CpuRegister::DX) {
+            SaveVariable(op2, SaveReason::Before);
+            SetVariableRegister(op2, CpuRegister::None);
+        }
+    }
+
     switch (i->assignment.op1.exp_type) {
         case ExpressionType::Constant: {
             int32_t value = atoi(i->assignment.op1.value);
@@ -3154,7 +4036,7 @@ void DosExeEmitter::EmitAssignDivide(InstructionEntry* i)
 
             ZeroRegister(CpuRegister::AH, 1);
 
-            dst->reg = CpuRegister::AX;
+            SetVariableRegister(dst, CpuRegister::AX);
             break;
         }
         case 2: {
@@ -3184,7 +4066,7 @@ void DosExeEmitter::EmitAssignDivide(InstructionEntry* i)
                 BackpatchLocal(a + 2, op2);
             }
 
-            dst->reg = (i->assignment.type == AssignType::Remainder ? CpuRegister::DX : CpuRegister::AX);
+            SetVariableRegister(dst, (i->assignment.type == AssignType::Remainder ? CpuRegister::DX : CpuRegister::AX));
             break;
         }
         case 4: {
@@ -3217,7 +4099,7 @@ void DosExeEmitter::EmitAssignDivide(InstructionEntry* i)
                 BackpatchLocal(a + 3, op2);
             }
 
-            dst->reg = (i->assignment.type == AssignType::Remainder ? CpuRegister::DX : CpuRegister::AX);
+            SetVariableRegister(dst, (i->assignment.type == AssignType::Remainder ? CpuRegister::DX : CpuRegister::AX));
             break;
         }
 
@@ -3228,12 +4110,182 @@ void DosExeEmitter::EmitAssignDivide(InstructionEntry* i)
     dst->last_used = ip_src;
 }
 
+void DosExeEmitter::EmitAssignDivideByConstant(InstructionEntry* i, uint32_t divisor)
+{
+    DosVariableDescriptor* dst = FindVariableByName(i->assignment.dst_value);
+    DosVariableDescriptor* op1 = FindVariableByName(i->assignment.op1.value);
+
+    int32_t dst_size = compiler->GetSymbolTypeSize(dst->symbol->type);
+    int32_t op1_size = compiler->GetSymbolTypeSize(op1->symbol->type);
+
+    bool is_remainder = (i->assignment.type == AssignType::Remainder);
+
+    if ((divisor & (divisor - 1)) == 0) {
+        // Power of two, only shift or mask is needed
+        CpuRegister reg_dst;
+        if (dst == op1 && op1->reg != CpuRegister::None) {
+            reg_dst = op1->reg;
+        } else {
+            reg_dst = LoadVariableUnreferenced(op1, dst_size);
+        }
+
+        if (is_remainder) {
+            AsmAnd(reg_dst, (int32_t)(divisor - 1), dst_size);
+        } else {
+            uint8_t shift = 0;
+            while ((1u << shift) < divisor) {
+                shift++;
+            }
+
+            if (shift > 0) {
+                AsmShr(reg_dst, shift, dst_size);
+            }
+        }
+
+        SetVariableRegister(dst, reg_dst);
+        dst->is_dirty = true;
+        dst->last_used = ip_src;
+        return;
+    }
+
+    // Division is replaced by multiplication with reciprocal value,
+    // find the smallest (m, s) so that (x / d) == ((x * m) >> s) for all x < 2^bits
+    // (see Granlund, Montgomery: Division by Invariant Integers using Multiplication)
+    int32_t bits = dst_size * 8;
+
+    uint8_t log2 = 0;
+    while ((1ull << log2) < divisor) {
+        log2++;
+    }
+
+    uint64_t multiplier = 0;
+    uint8_t shift = 0;
+    for (uint8_t s = bits; s <= bits + log2 && s < 64; s++) {
+        uint64_t m = ((1ull << s) + divisor - 1) / divisor;
+        if (m * divisor - (1ull << s) <= (1ull << (s - bits)) && (bits < 32 || m <= UINT32_MAX)) {
+            multiplier = m;
+            shift = s;
+            break;
+        }
+    }
+
+    // Dividend is needed in 32-bit register with cleared upper part
+    auto LoadDividend = [&]() -> CpuRegister {
+        if (op1_size <= dst_size) {
+            return LoadVariableUnreferenced(op1, 4);
+        }
+
+        CpuRegister reg = LoadVariableUnreferenced(op1, dst_size);
+        if (dst_size < 4) {
+            AsmMovzx(reg, reg, dst_size);
+        }
+        return reg;
+    };
+
+    CpuRegister reg_dividend;
+    CpuRegister reg_quotient;
+
+    if (bits < 32 && multiplier && (multiplier * ((1ull << bits) - 1)) <= UINT32_MAX) {
+        // Product fits into 32-bit register, "imul" can be used for 8-bit and most of 16-bit divisors
+        reg_dividend = LoadDividend();
+
+        if (is_remainder) {
+            SuppressRegister _(this, reg_dividend);
+            reg_quotient = GetUnusedRegister();
+        } else {
+            reg_quotient = reg_dividend;
+        }
+
+        AsmImul(reg_quotient, reg_dividend, (int32_t)multiplier, 4);
+        AsmShr(reg_quotient, shift, 4);
+    } else {
+        // Upper part of 64-bit product is used, it's still much faster than "div"
+        if (op1->reg == CpuRegister::AX || op1->reg == CpuRegister::DX) {
+            // Operand is still needed after AX and DX are overwritten,
+            // so it has to be saved (with current instruction as reference)
+            SaveVariable(op1, SaveReason::Before);
+            SetVariableRegister(op1, CpuRegister::None);
+        }
+
+        {
+            SuppressRegister _1(this, CpuRegister::AX);
+            SuppressRegister _2(this, CpuRegister::DX);
+
+            reg_dividend = LoadDividend();
+        }
+
+        SuppressRegister _(this, reg_dividend);
+
+        SaveAndUnloadRegister(CpuRegister::AX, SaveReason::Inside);
+        SaveAndUnloadRegister(CpuRegister::DX, SaveReason::Inside);
+
+        bool needs_fixup = false;
+        if (bits < 32) {
+            // Scale multiplier, so the quotient is directly in EDX
+            multiplier <<= (32 - shift);
+            shift = 32;
+        } else if (!multiplier) {
+            // Multiplier needs 33 bits, only lower 32 bits are used and the result is fixed up
+            multiplier = (((1ull << log2) - divisor) << 32) / divisor + 1;
+            needs_fixup = true;
+        }
+
+        LoadConstantToRegister((int32_t)multiplier, CpuRegister::AX, 4);
+        AsmMul(reg_dividend, 4);
+
+        if (needs_fixup) {
+            // q = (t + ((x - t) >> 1)) >> (log2 - 1)
+            AsmMov(CpuRegister::AX, reg_dividend, 4);
+            AsmSub(CpuRegister::AX, CpuRegister::DX, 4);
+            AsmShr(CpuRegister::AX, 1, 4);
+            AsmAdd(CpuRegister::AX, CpuRegister::DX, 4);
+            if (log2 > 1) {
+                AsmShr(CpuRegister::AX, log2 - 1, 4);
+            }
+
+            reg_quotient = CpuRegister::AX;
+        } else {
+            if (shift > 32) {
+                AsmShr(CpuRegister::DX, shift - 32, 4);
+            }
+
+            reg_quotient = CpuRegister::DX;
+        }
+    }
+
+    CpuRegister reg_dst = reg_quotient;
+
+    if (is_remainder) {
+        // r = x - q * d
+        SuppressRegister _(this, reg_dividend);
+
+        MultiplyRegisterByConstant(reg_quotient, divisor, dst_size);
+        AsmSub(reg_dividend, reg_quotient, dst_size);
+
+        reg_dst = reg_dividend;
+    }
+
+    SetVariableRegister(dst, reg_dst);
+    dst->is_dirty = true;
+    dst->last_used = ip_src;
+}
+
 void DosExeEmitter::EmitAssignShift(InstructionEntry* i)
 {
     DosVariableDescriptor* dst = FindVariableByName(i->assignment.dst_value);
 
     int32_t dst_size = compiler->GetSymbolTypeSize(dst->symbol->type);
 
+    if (i->assignment.op1.exp_type == ExpressionType::Variable) {
+        // Shifted operand is still needed after CL is overwritten,
+        // so it has to be saved (with current instruction as reference)
+        DosVariableDescriptor* op1 = FindVariableByName(i->assignment.op1.value);
+        if (op1->reg == CpuRegister::CX) {
+            SaveVariable(op1, SaveReason::Before);
+            SetVariableRegister(op1, CpuRegister::None);
+        }
+    }
+
     switch (i->assignment.op2.exp_type) {
         case ExpressionType::Constant: {
             int32_t shift = atoi(i->assignment.op2.value);
@@ -3251,7 +4303,7 @@ void DosExeEmitter::EmitAssignShift(InstructionEntry* i)
                 CpuRegister reg_dst = GetUnusedRegister();
                 LoadConstantToRegister(value, reg_dst, dst_size);
 
-                dst->reg = reg_dst;
+                SetVariableRegister(dst, reg_dst);
                 dst->is_dirty = true;
                 dst->last_used = ip_src;
                 return;
@@ -3324,7 +4376,7 @@ void DosExeEmitter::EmitAssignShift(InstructionEntry* i)
         default: ThrowOnUnreachableCode();
     }
 
-    dst->reg = reg_dst;
+    SetVariableRegister(dst, reg_dst);
     dst->is_dirty = true;
     dst->last_used = ip_src;
 }
@@ -3337,13 +4389,46 @@ void DosExeEmitter::EmitGoto(InstructionEntry* i)
         ThrowOnUnreachableCode();
     }
 
-    // Jumps to the next instruction are removed automatically as optimization
-    if (i->goto_statement.ip == ip_src + 1) {
-        return;
-    }
+    if (jump_table_entries > 0) {
+        // Entry of jump table is reached only by indirect jump from "switch" instruction,
+        // it jumps directly to the target, if no register has to be reloaded
+        uint32_t entry_offset = jump_table_offset;
+        jump_table_offset += 2;
+        jump_table_entries--;
 
-    // Unload all registers before jump
-    SaveAndUnloadAllRegisters(SaveReason::Before);
+        int32_t entry_ip_dst = ip_dst;
+
+        SaveAllRegisters(SaveReason::Before);
+        PrepareRegistersForJump(i->goto_statement.ip);
+
+        was_jump = true;
+
+        if (ip_dst != entry_ip_dst) {
+            *(uint16_t*)(buffer + entry_offset) = (uint16_t)entry_ip_dst;
+        } else if (i->goto_statement.ip < ip_src) {
+            *(uint16_t*)(buffer + entry_offset) = (uint16_t)ip_src_to_dst[i->goto_statement.ip];
+            return;
+        } else {
+            DosBackpatchInstruction b { };
+            b.type = DosBackpatchType::ToAbs16;
+            b.backpatch_offset = entry_offset;
+            b.target = DosBackpatchTarget::IP;
+            b.ip_src = i->goto_statement.ip;
+            backpatch.push_back(b);
+            return;
+        }
+    } else {
+        // Jumps to the next instruction are removed automatically as optimization
+        if (i->goto_statement.ip == ip_src + 1) {
+            return;
+        }
+
+        // Save all registers before jump and keep them in sync with the target
+        SaveAllRegisters(SaveReason::Before);
+        PrepareRegistersForJump(i->goto_statement.ip);
+
+        was_jump = true;
+    }
 
     uint8_t* goto_ptr = nullptr;
 
@@ -3410,8 +4495,22 @@ void DosExeEmitter::EmitGotoLabel(InstructionEntry* i)
         ++it;
     }
 
-    // Unload all registers before jump
-    SaveAndUnloadAllRegisters(SaveReason::Before);
+    // Save all registers before jump and keep them in sync with the target
+    SaveAllRegisters(SaveReason::Before);
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->type.base == BaseSymbolType::Label && symbol->parent && strcmp(symbol->parent, parent->name) == 0 &&
+            strcmp(symbol->name, i->goto_label_statement.label) == 0) {
+
+            PrepareRegistersForJump(symbol->ip);
+            break;
+        }
+
+        symbol = symbol->next;
+    }
+
+    was_jump = true;
 
     uint8_t* goto_ptr = nullptr;
 
@@ -3480,15 +4579,32 @@ void DosExeEmitter::EmitIf(InstructionEntry* i)
         return;
     }
 
-    // Unload all registers before jump
-    SaveAndUnloadAllRegisters(SaveReason::Before);
+    // Save all registers before jump, they are kept in sync with the target later
+    SaveAllRegisters(SaveReason::Before);
 
     uint8_t* goto_ptr = nullptr;
 
     bool goto_near;
     if (i->if_statement.ip < ip_src) {
-        // Jump target was already emitted, check if we can use 8-bit address
-        int32_t rel = (int32_t)(ip_src_to_dst[i->if_statement.ip] - (ip_dst + NearJumpThreshold));
+        // Jump target was already emitted, check if we can use 8-bit address,
+        // registers may need to be reloaded before the jump (max. 5 bytes each)
+        int32_t reload_size = 0;
+
+        std::map<int32_t, DosRegisterState>::iterator it = ip_register_states.find(i->if_statement.ip);
+        if (it != ip_register_states.end()) {
+            for (int32_t j = 0; j < 4; j++) {
+                if (it->second.vars[j]) {
+                    reload_size += 5;
+                }
+            }
+        }
+
+        // Strings are compared by shared function, that is called before the jump
+        if (i->if_statement.op1.type.base == BaseSymbolType::String || i->if_statement.op2.type.base == BaseSymbolType::String) {
+            reload_size += StringsEqualCallSize;
+        }
+
+        int32_t rel = (int32_t)(ip_src_to_dst[i->if_statement.ip] - (ip_dst + NearJumpThreshold + reload_size));
         goto_near = (rel > INT8_MIN && rel < INT8_MAX);
     } else {
         // Not emitted yet, use estimation
@@ -3565,6 +4681,8 @@ void DosExeEmitter::EmitIfOrAnd(InstructionEntry* i, uint8_t*& goto_ptr, bool& g
                     int32_t value2 = atoi(i->if_statement.op2.value);
 
                     if (IfConstexpr(i->if_statement.type, value1, value2)) {
+                        PrepareRegistersForJump(i->if_statement.ip);
+
                         if (goto_near) {
                             uint8_t* a = AllocateBufferForInstruction(1 + 1);
                             a[0] = 0xEB;   // jmp rel8
@@ -3725,6 +4843,8 @@ void DosExeEmitter::EmitIfOrAnd(InstructionEntry* i, uint8_t*& goto_ptr, bool& g
         default: ThrowOnUnreachableCode();
     }
 
+    PrepareRegistersForJump(i->if_statement.ip);
+
     if (goto_near) {
         uint8_t* a = AllocateBufferForInstruction(1 + 1);
         a[0] = 0x75; // jnz rel8
@@ -3749,6 +4869,8 @@ void DosExeEmitter::EmitIfArithmetic(InstructionEntry* i, uint8_t*& goto_ptr, bo
                     int32_t value2 = atoi(i->if_statement.op2.value);
 
                     if (IfConstexpr(i->if_statement.type, value1, value2)) {
+                        PrepareRegistersForJump(i->if_statement.ip);
+
                         if (goto_near) {
                             uint8_t* a = AllocateBufferForInstruction(1 + 1);
                             a[0] = 0xEB;   // jmp rel8
@@ -3798,6 +4920,12 @@ void DosExeEmitter::EmitIfArithmetic(InstructionEntry* i, uint8_t*& goto_ptr, bo
 
                         default: ThrowOnUnreachableCode();
                     }
+
+                    // Compare doesn't change the register, so it still holds the value
+                    if (op1->reg == CpuRegister::None && op1->symbol->size == 0) {
+                        SetVariableRegister(op1, reg_dst);
+                        op1->last_used = ip_src;
+                    }
                     break;
                 }
 
@@ -3899,6 +5027,12 @@ void DosExeEmitter::EmitIfArithmetic(InstructionEntry* i, uint8_t*& goto_ptr, bo
 
                 default: ThrowOnUnreachableCode();
             }
+
+            // Compare doesn't change the register, so it still holds the value
+            if (op1->reg == CpuRegister::None && op1->symbol->size == 0) {
+                SetVariableRegister(op1, reg_dst);
+                op1->last_used = ip_src;
+            }
             break;
         }
 
@@ -3922,6 +5056,8 @@ void DosExeEmitter::EmitIfArithmetic(InstructionEntry* i, uint8_t*& goto_ptr, bo
         default: ThrowOnUnreachableCode();
     }
 
+    PrepareRegistersForJump(i->if_statement.ip);
+
     if (goto_near) {
         uint8_t* a = AllocateBufferForInstruction(1 + 1);
         a[0] = opcode;
@@ -3952,6 +5088,8 @@ void DosExeEmitter::EmitIfStrings(InstructionEntry* i, uint8_t*& goto_ptr, bool&
         }
 
         if (result) {
+            PrepareRegistersForJump(i->if_statement.ip);
+
             if (goto_near) {
                 uint8_t* a = AllocateBufferForInstruction(1 + 1);
                 a[0] = 0xEB;   // jmp rel8
@@ -3983,6 +5121,9 @@ void DosExeEmitter::EmitIfStrings(InstructionEntry* i, uint8_t*& goto_ptr, bool&
     DosVariableDescriptor* op1 = FindVariableByName(i->if_statement.op1.value);
     PushVariableToStack(op1, compiler->GetSymbolTypeSize({ BaseSymbolType::String, 0 }));
 
+    // Shared function doesn't preserve registers
+    SaveAndUnloadAllRegisters(SaveReason::Inside);
+
     // IP of shared function means reference count
     SymbolTableEntry* symbol = compiler->GetSymbols();
     while (symbol) {
@@ -4025,6 +5166,8 @@ void DosExeEmitter::EmitIfStrings(InstructionEntry* i, uint8_t*& goto_ptr, bool&
         ThrowOnUnreachableCode();
     }
 
+    PrepareRegistersForJump(i->if_statement.ip);
+
     if (goto_near) {
         uint8_t* l2 = AllocateBufferForInstruction(1 + 1);
         l2[0] = opcode;
@@ -4039,6 +5182,157 @@ void DosExeEmitter::EmitIfStrings(InstructionEntry* i, uint8_t*& goto_ptr, bool&
     }
 }
 
+void DosExeEmitter::EmitSwitch(InstructionEntry* i)
+{
+    InstructionOperand& op = i->switch_statement.op;
+
+    // Constant expressions are always resolved by compiler
+    if (op.exp_type != ExpressionType::Variable || op.index.value) {
+        ThrowOnUnreachableCode();
+    }
+
+    // Save all registers before jump, entries of the table are kept in sync with their targets
+    SaveAllRegisters(SaveReason::Before);
+
+    DosVariableDescriptor* var = FindVariableByName(op.value);
+    uint32_t count = i->switch_statement.count;
+
+    if (var->symbol->type.base == BaseSymbolType::String) {
+        EmitSwitchStringHash(var, i->switch_statement.hash_multiplier, i->switch_statement.hash_bits);
+    } else {
+        EmitSwitchIndex(var, i->switch_statement.min_value, count);
+    }
+
+    //   shl bx, 1
+    //   jmp [table + bx]
+    uint8_t* a = AllocateBufferForInstruction(2 + 4);
+    a[0] = 0xD1;    // shl rm16, 1
+    a[1] = ToXrm(3, 4, CpuRegister::BX);
+    a[2] = 0xFF;    // jmp rm16
+    a[3] = ToXrm(2, 4, 7);
+    *(uint16_t*)(a + 4) = (uint16_t)(ip_dst + 0x0100 /*Program Segment Prefix*/);
+
+    // Table is placed right after the jump and it's filled by the following entries
+    jump_table_offset = (uint32_t)(a + 4 - buffer) + 2;
+    jump_table_entries = count + 1;
+
+    AllocateBufferForInstruction(jump_table_entries * 2);
+
+    was_jump = true;
+
+    // All entries start with the same register state
+    for (uint32_t k = 1; k <= jump_table_entries; k++) {
+        PrepareRegistersForJump(ip_src + k);
+    }
+}
+
+void DosExeEmitter::EmitSwitchIndex(DosVariableDescriptor* var, uint32_t min_value, uint32_t count)
+{
+    bool is_32bit = (compiler->GetSymbolTypeSize(var->symbol->type) == 4);
+
+    CopyVariableToRegister(var, CpuRegister::BX, is_32bit ? 4 : 2);
+
+    if (min_value != 0) {
+        if (is_32bit) {
+            uint8_t* a = AllocateBufferForInstruction(1);
+            a[0] = 0x66;    // Operand size prefix
+        }
+
+        if (min_value <= INT8_MAX) {
+            uint8_t* a = AllocateBufferForInstruction(2 + 1);
+            a[0] = 0x83;    // sub rm16, imm8
+            a[1] = ToXrm(3, 5, CpuRegister::BX);
+            a[2] = (uint8_t)min_value;
+        } else if (is_32bit) {
+            uint8_t* a = AllocateBufferForInstruction(2 + 4);
+            a[0] = 0x81;    // sub rm32, imm32
+            a[1] = ToXrm(3, 5, CpuRegister::BX);
+            *(uint32_t*)(a + 2) = min_value;
+        } else {
+            uint8_t* a = AllocateBufferForInstruction(2 + 2);
+            a[0] = 0x81;    // sub rm16, imm16
+            a[1] = ToXrm(3, 5, CpuRegister::BX);
+            *(uint16_t*)(a + 2) = (uint16_t)min_value;
+        }
+    }
+
+    // Values out of range use the last entry of the table
+    if (is_32bit) {
+        uint8_t* a = AllocateBufferForInstruction(1);
+        a[0] = 0x66;    // Operand size prefix
+    }
+
+    if (count <= INT8_MAX) {
+        uint8_t* a = AllocateBufferForInstruction(2 + 1);
+        a[0] = 0x83;    // cmp rm16, imm8
+        a[1] = ToXrm(3, 7, CpuRegister::BX);
+        a[2] = (uint8_t)count;
+    } else if (is_32bit) {
+        uint8_t* a = AllocateBufferForInstruction(2 + 4);
+        a[0] = 0x81;    // cmp rm32, imm32
+        a[1] = ToXrm(3, 7, CpuRegister::BX);
+        *(uint32_t*)(a + 2) = count;
+    } else {
+        uint8_t* a = AllocateBufferForInstruction(2 + 2);
+        a[0] = 0x81;    // cmp rm16, imm16
+        a[1] = ToXrm(3, 7, CpuRegister::BX);
+        *(uint16_t*)(a + 2) = (uint16_t)count;
+    }
+
+    //   jb [index_ok]
+    //   mov bx, count
+    // index_ok:
+    uint8_t* a = AllocateBufferForInstruction(2 + 3);
+    a[0] = 0x72;    // jb rel8
+    a[1] = 3;
+    a[2] = ToOpR(0xB8, CpuRegister::BX);   // mov r16, imm16
+    *(uint16_t*)(a + 3) = (uint16_t)count;
+}
+
+void DosExeEmitter::EmitSwitchStringHash(DosVariableDescriptor* var, uint16_t multiplier, uint8_t bits)
+{
+    // String pointer is moved to SI, AX holds the current character and BX holds the hash
+    CopyVariableToRegister(var, CpuRegister::BX, 2);
+
+    AsmMov(CpuRegister::SI, CpuRegister::BX, 2);
+    ZeroRegister(CpuRegister::BX, 2);
+    ZeroRegister(CpuRegister::AX, 2);
+
+    // loop:
+    //   lodsb
+    //   or al, al
+    //   jz [end]
+    //   add bx, ax
+    //   imul bx, bx, multiplier
+    //   jmp [loop]
+    // end:
+    uint32_t loop = ip_dst;
+
+    uint8_t* l1 = AllocateBufferForInstruction(1);
+    l1[0] = 0xAC;   // lodsb
+
+    AsmOr(CpuRegister::AL, CpuRegister::AL, 1);
+
+    uint8_t* l3 = AllocateBufferForInstruction(1 + 1);
+    l3[0] = 0x74;   // jz rel8
+
+    uint32_t l3_ip = ip_dst;
+    uint32_t l3_offset = (uint32_t)((l3 + 1) - buffer);
+
+    AsmAdd(CpuRegister::BX, CpuRegister::AX, 2);
+    AsmImul(CpuRegister::BX, CpuRegister::BX, multiplier, 2);
+
+    uint8_t* l6 = AllocateBufferForInstruction(1 + 1);
+    l6[0] = 0xEB;   // jmp rel8
+    l6[1] = (int8_t)(loop - ip_dst);
+
+    // Backpatch "end" jump, offset is known now
+    *(buffer + l3_offset) = (int8_t)(ip_dst - l3_ip);
+
+    // The highest bits of the hash are used as index to the table
+    AsmShr(CpuRegister::BX, 16 - bits, 2);
+}
+
 void DosExeEmitter::EmitPush(InstructionEntry* i, std::stack<InstructionEntry*>& call_parameters)
 {
     call_parameters.push(i);
@@ -4052,6 +5346,8 @@ void DosExeEmitter::EmitCall(InstructionEntry* i, SymbolTableEntry* symbol_table
         ThrowOnUnreachableCode();
     }
 
+    bool is_tail_call = IsTailCall(i, symbol_table);
+
     // Emit "push" instructions (evaluated right to left)
     {
         for (int32_t param = i->call_statement.target->parameter; param > 0; param--) {
@@ -4138,10 +5434,51 @@ void DosExeEmitter::EmitCall(InstructionEntry* i, SymbolTableEntry* symbol_table
 
     SaveAndUnloadAllRegisters(SaveReason::Inside);
 
-    // Emit "call" instruction
+    if (is_tail_call) {
+        // Move parameters to the call frame of current function and destroy it,
+        // so the called function returns directly to the caller of current function
+        int32_t offset = 6;
+
+        SymbolTableEntry* param_decl = symbol_table;
+        while (param_decl) {
+            if (param_decl->parameter != 0 && param_decl->parent && strcmp(param_decl->parent, i->call_statement.target->name) == 0) {
+                int32_t size = compiler->GetSymbolTypeSize(param_decl->type);
+                if (size == 4) {
+                    uint8_t* a = AllocateBufferForInstruction(2 + 1 + 1);
+                    a[0] = 0x66;    // Operand size prefix
+                    a[1] = 0x8F;    // pop rm32
+                    a[2] = ToXrm(1, 0, 6);
+                    a[3] = (uint8_t)offset;
+                } else {
+                    uint8_t* a = AllocateBufferForInstruction(1 + 1 + 1);
+                    a[0] = 0x8F;    // pop rm16
+                    a[1] = ToXrm(1, 0, 6);
+                    a[2] = (uint8_t)offset;
+
+                    // Min. push size is 2 bytes
+                    size = 2;
+                }
+
+                offset += size;
+            }
+
+            param_decl = param_decl->next;
+        }
+
+        uint8_t* a = AllocateBufferForInstruction(3 + 2);
+        a[0] = 0x66;                            // Operand size prefix
+        a[1] = 0x8B;                            // mov r32 (esp), rm32 (ebp)
+        a[2] = ToXrm(3, CpuRegister::SP, CpuRegister::BP);
+        a[3] = 0x66;                            // Operand size prefix
+        a[4] = ToOpR(0x58, CpuRegister::BP);    // pop ebp
+
+        was_jump = true;
+    }
+
+    // Emit "call" or "jmp" instruction
     {
         uint8_t* call = AllocateBufferForInstruction(1 + 2);
-        call[0] = 0xE8; // call rel16
+        call[0] = (is_tail_call ? 0xE9 : 0xE8); // jmp rel16 / call rel16
 
         std::list<DosLabel>::iterator it = functions.begin();
 
@@ -4172,7 +5509,7 @@ void DosExeEmitter::EmitCall(InstructionEntry* i, SymbolTableEntry* symbol_table
     if (i->call_statement.target->return_type.base != BaseSymbolType::Void || i->call_statement.target->return_type.pointer != 0) {
         // Set register of return variable to AX
         DosVariableDescriptor* ret = FindVariableByName(i->call_statement.return_symbol);
-        ret->reg = CpuRegister::AX;
+        SetVariableRegister(ret, CpuRegister::AX);
         ret->is_dirty = true;
         ret->last_used = ip_src;
     }
@@ -4246,6 +5583,13 @@ void DosExeEmitter::EmitReturn(InstructionEntry* i, SymbolTableEntry* symbol_tab
 
         AsmInt(0x21 /*DOS Function Dispatcher*/, 0x4C /*Terminate Process With Return Code*/);
     } else {
+        // Static variables have to be saved before leaving the function
+        for (int32_t j = 0; j < 4; j++) {
+            if (register_owners[j] && !register_owners[j]->symbol->parent) {
+                SaveVariable(register_owners[j], SaveReason::Force);
+            }
+        }
+
         // Standard function with "stdcall" calling convention,
         // return value (if any) is saved in AX register
         if (parent->return_type.base != BaseSymbolType::Void || parent->return_type.pointer != 0) {
@@ -4254,6 +5598,9 @@ void DosExeEmitter::EmitReturn(InstructionEntry* i, SymbolTableEntry* symbol_tab
             switch (i->return_statement.op.exp_type) {
                 case ExpressionType::Constant: {
                     int32_t value = atoi(i->return_statement.op.value);
+
+                    // Register can still hold a value that is not needed anymore
+                    SaveAndUnloadRegister(CpuRegister::AX, SaveReason::Inside);
                     LoadConstantToRegister(value, CpuRegister::AX, dst_size);
                     break;
                 }
@@ -4267,29 +5614,9 @@ void DosExeEmitter::EmitReturn(InstructionEntry* i, SymbolTableEntry* symbol_tab
             }
         }
 
-        // Destroy current call frame
-        if (parent->parameter > 0) {
-            // Compute needed space in stack for parameters, 
-            // so stack region with parameters can be released
-            uint16_t stack_param_size = 0;
-
-            SymbolTableEntry* param_decl = symbol_table;
-            while (param_decl) {
-                if (param_decl->parameter != 0 && param_decl->parent && strcmp(param_decl->parent, parent->name) == 0) {
-                    int32_t size = compiler->GetSymbolTypeSize(param_decl->type);
-                    if (size < 2) {
-                        size = 2;
-                    }
-                    stack_param_size += size;
-                }
-
-                param_decl = param_decl->next;
-            }
-
-            AsmProcLeave(stack_param_size, true);
-        } else {
-            AsmProcLeave(0);
-        }
+        // Destroy current call frame, stack region with parameters is released too,
+        // stack space for local variables is allocated even without parameters
+        AsmProcLeave(GetParameterStackSize(parent, symbol_table), true);
     }
 }
 
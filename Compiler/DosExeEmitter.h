@@ -5,6 +5,7 @@
 #include <malloc.h>
 #include <string>
 #include <list>
+#include <vector>
 #include <map>
 #include <stack>
 #include <unordered_set>
@@ -20,6 +21,7 @@ enum struct DosBackpatchType {
 
     ToRel8,     // Relative address (signed 8-bit)
     ToRel16,    // Relative address (16-bit)
+    ToAbs16,    // Absolute address (16-bit)
     ToDsAbs16,  // Absolute address to DS segment (16-bit)
     ToStack8    // Relative address (signed 8-bit)
 };
@@ -60,11 +62,38 @@ struct DosVariableDescriptor {
     bool force_save;
 };
 
+/// <summary>
+/// Contents of general-purpose registers at the edge of jump,
+/// each register is mapped to variable whose saved value it holds
+/// </summary>
+struct DosRegisterState {
+    DosVariableDescriptor* vars[4];
+};
+
 struct DosLabel {
     char* name;
     int32_t ip_dst;
 };
 
+/// <summary>
+/// Range of abstract instructions, where stack slot of variable must be preserved
+/// </summary>
+struct DosVariableLifetime {
+    DosVariableDescriptor* var;
+    int32_t first_ip;
+    int32_t last_ip;
+};
+
+/// <summary>
+/// Stack slot that can be shared by variables with disjoint lifetimes
+/// </summary>
+struct DosStackSlot {
+    int32_t size;
+    int32_t align;
+    int32_t last_ip;
+    int32_t location;
+};
+
 enum struct SaveReason {
     Before,     // Variable will be saved if it's referenced in current or one of the following instructions
     Inside,     // Variable will be saved if it's referenced in one of the following instructions
@@ -139,6 +168,22 @@ struct MzRelocEntry {
         });                                                         \
     }
 
+/// <summary>
+/// Name of shared I/O buffer, it's allocated with static variables
+/// </summary>
+#define IoBufferName "#IoBuffer"
+
+/// <summary>
+/// Register reference to shared I/O buffer for backpatching
+/// </summary>
+#define BackpatchIoBuffer(ptr)                                      \
+    {                                                               \
+        backpatch.push_back({                                       \
+            DosBackpatchType::ToDsAbs16, DosBackpatchTarget::Static,\
+            (uint32_t)((ptr) - buffer), 0, 0, (char*)IoBufferName   \
+        });                                                         \
+    }
+
 /// <summary>
 /// Class that emits 16-bit EXE executable for DOS (i386)
 /// </summary>
@@ -160,11 +205,18 @@ public:
 
 private:
     /// <summary>
-    /// Add all variables from symbol table to internal list
+    /// Add all variables from symbol table to internal list,
+    /// variables are grouped by parent function and sorted by name
     /// </summary>
     /// <param name="symbol_table">Symbol table</param>
     void CreateVariableList(SymbolTableEntry* symbol_table);
 
+    /// <summary>
+    /// Select variables of specified function for lookup and stack allocation
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    void SelectParentVariables(SymbolTableEntry* function);
+
     /// <summary>
     /// Return unused/free register, if all registers are referenced,
     /// save and unreference least used register
@@ -178,6 +230,25 @@ private:
     /// </summary>
     /// <returns>Unused register; or None</returns>
     i386::CpuRegister TryGetUnusedRegister();
+
+    /// <summary>
+    /// Return the first register from specified bitmask
+    /// </summary>
+    /// <param name="mask">Bitmask of registers</param>
+    /// <returns>Register; or None</returns>
+    i386::CpuRegister LowestRegister(uint32_t mask);
+
+    /// <summary>
+    /// Change register owned by variable, previous owner of the register is unreferenced
+    /// </summary>
+    /// <param name="var">Variable descriptor</param>
+    /// <param name="reg">New register; or None</param>
+    void SetVariableRegister(DosVariableDescriptor* var, i386::CpuRegister reg);
+
+    /// <summary>
+    /// Unreference all registers without saving them
+    /// </summary>
+    void ResetRegisterFile();
     
     /// <summary>
     /// Find variable specified by name in variable list
@@ -186,6 +257,15 @@ private:
     /// <returns>Variable descriptor</returns>
     DosVariableDescriptor* FindVariableByName(char* name);
 
+    /// <summary>
+    /// Find variable specified by name in sorted range of variable list
+    /// </summary>
+    /// <param name="begin">First variable of range</param>
+    /// <param name="end">End of range</param>
+    /// <param name="name">Name of variable</param>
+    /// <returns>Variable descriptor; or nullptr</returns>
+    DosVariableDescriptor* FindVariableInRange(DosVariableDescriptor* begin, DosVariableDescriptor* end, const char* name);
+
     /// <summary>
     /// Find next reference to variable
     /// </summary>
@@ -194,12 +274,42 @@ private:
     /// <param name="reason">Save reason</param>
     InstructionEntry* FindNextVariableReference(DosVariableDescriptor* var, SaveReason reason);
 
+    /// <summary>
+    /// Check if variable is overwritten before it's read again, the instructions
+    /// are checked only until the next jump, so the value is dead on every path
+    /// </summary>
+    /// <param name="var">Variable descriptor</param>
+    /// <param name="reason">Save reason</param>
+    /// <returns>True if the value doesn't have to be saved</returns>
+    bool IsVariableOverwritten(DosVariableDescriptor* var, SaveReason reason);
+
     /// <summary>
     /// Find the end of current function
     /// </summary>
     /// <param name="symbol_table">Symbol table</param>
     void RefreshParentEndIp(SymbolTableEntry* symbol_table);
 
+    /// <summary>
+    /// Mark variables, whose address is taken in current function, so they are always
+    /// saved and never kept in register across jumps, because they can be changed indirectly
+    /// </summary>
+    void MarkReferencedVariables();
+
+    /// <summary>
+    /// Compute lifetimes of all local variables of current function,
+    /// lifetime covers all instructions, where the variable can be loaded or saved
+    /// </summary>
+    /// <param name="lifetimes">Lifetimes of referenced local variables</param>
+    void ComputeVariableLifetimes(std::vector<DosVariableLifetime>& lifetimes);
+
+    /// <summary>
+    /// Assign stack locations to local variables of current function,
+    /// variables with disjoint lifetimes share the same stack slot
+    /// </summary>
+    /// <param name="saved_size">Number of bytes saved by sharing and unreferenced variables</param>
+    /// <returns>Size of all stack slots</returns>
+    int32_t AssignStackSlots(int32_t& saved_size);
+
     /// <summary>
     /// Save specified variable to stack, but keep it in register
     /// </summary>
@@ -229,6 +339,33 @@ private:
     /// <param name="reason">Save reason</param>
     void SaveAndUnloadAllRegisters(SaveReason reason);
 
+    /// <summary>
+    /// Save all unsaved variables to stack, but keep their values in registers,
+    /// variables that are not needed anymore are unreferenced
+    /// </summary>
+    /// <param name="reason">Save reason</param>
+    void SaveAllRegisters(SaveReason reason);
+
+    /// <summary>
+    /// Return current contents of registers that can be kept across jump
+    /// </summary>
+    /// <returns>Register state</returns>
+    DosRegisterState GetRegisterState();
+
+    /// <summary>
+    /// Merge current register state to the state expected by jump target,
+    /// if the target was already emitted, registers are reconciled with its state
+    /// </summary>
+    /// <param name="target_ip">Target abstract instruction</param>
+    void PrepareRegistersForJump(int32_t target_ip);
+
+    /// <summary>
+    /// Merge register states of all jumps to current instruction,
+    /// only registers that hold the same variable in all predecessors are kept
+    /// </summary>
+    /// <param name="is_loop">Current instruction is target of backward jump</param>
+    void MergeRegisterStates(bool is_loop);
+
     /// <summary>
     /// Destroy connection of variable with register
     /// If the variable is unsaved, compiler exception is thrown
@@ -299,6 +436,15 @@ private:
     /// <param name="desired_size">Size of register</param>
     void ZeroRegister(i386::CpuRegister reg, int32_t desired_size);
 
+    /// <summary>
+    /// Multiply value in unreferenced register by constant,
+    /// shifts, additions and "lea" are used instead of "imul" if possible
+    /// </summary>
+    /// <param name="reg">Register with value</param>
+    /// <param name="value">Constant multiplier</param>
+    /// <param name="size">Size of register</param>
+    void MultiplyRegisterByConstant(i386::CpuRegister reg, uint32_t value, int32_t size);
+
     // Backpatching
     /// <summary>
     /// Backpatch all entries in list with address of current line
@@ -310,7 +456,8 @@ private:
     /// </summary>
     /// <param name="label">New label</param>
     /// <param name="target">Type of entries</param>
-    void BackpatchLabels(const DosLabel& label, DosBackpatchTarget target);
+    /// <returns>Number of backpatched entries</returns>
+    int32_t BackpatchLabels(const DosLabel& label, DosBackpatchTarget target);
 
     /// <summary>
     /// Check if there is no unresolved entries in backpatch list
@@ -325,6 +472,24 @@ private:
     /// </summary>
     void CheckReturnStatementPresent();
 
+    /// <summary>
+    /// Compute size of stack region with parameters of specified function,
+    /// the region is released by the function on return
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    /// <param name="symbol_table">Symbol table</param>
+    /// <returns>Size in bytes</returns>
+    uint16_t GetParameterStackSize(SymbolTableEntry* function, SymbolTableEntry* symbol_table);
+
+    /// <summary>
+    /// Check if the call is followed only by return of its result,
+    /// so the called function can reuse call frame of current function
+    /// </summary>
+    /// <param name="i">Call instruction</param>
+    /// <param name="symbol_table">Symbol table</param>
+    /// <returns>True if the call can be replaced by jump</returns>
+    bool IsTailCall(InstructionEntry* i, SymbolTableEntry* symbol_table);
+
     /// <summary>
     /// Process all events that are connected to symbol table entries
     /// </summary>
@@ -344,6 +509,7 @@ private:
     inline void EmitAssignAddSubtract(InstructionEntry* i);
     inline void EmitAssignMultiply(InstructionEntry* i);
     inline void EmitAssignDivide(InstructionEntry* i);
+    inline void EmitAssignDivideByConstant(InstructionEntry* i, uint32_t divisor);
     inline void EmitAssignShift(InstructionEntry* i);
 
     void EmitGoto(InstructionEntry* i);
@@ -354,6 +520,28 @@ private:
     inline void EmitIfArithmetic(InstructionEntry* i, uint8_t*& goto_ptr, bool& goto_near);
     inline void EmitIfStrings(InstructionEntry* i, uint8_t*& goto_ptr, bool& goto_near);
 
+    /// <summary>
+    /// Emit indirect jump through table, that is filled by the following "goto" instructions
+    /// </summary>
+    /// <param name="i">Switch instruction</param>
+    void EmitSwitch(InstructionEntry* i);
+
+    /// <summary>
+    /// Load index to the table to BX, values out of range are replaced by the last entry
+    /// </summary>
+    /// <param name="var">Switch variable</param>
+    /// <param name="min_value">Value of the first entry</param>
+    /// <param name="count">Number of entries (without the last one)</param>
+    void EmitSwitchIndex(DosVariableDescriptor* var, uint32_t min_value, uint32_t count);
+
+    /// <summary>
+    /// Compute perfect hash of string to BX, it's used as index to the table
+    /// </summary>
+    /// <param name="var">Switch variable</param>
+    /// <param name="multiplier">Multiplier of the hash function</param>
+    /// <param name="bits">Size of the table (log2)</param>
+    void EmitSwitchStringHash(DosVariableDescriptor* var, uint16_t multiplier, uint8_t bits);
+
     void EmitPush(InstructionEntry* i, std::stack<InstructionEntry*>& call_parameters);
     void EmitCall(InstructionEntry* i, SymbolTableEntry* symbol_table, std::stack<InstructionEntry*>& call_parameters);
     void EmitReturn(InstructionEntry* i, SymbolTableEntry* symbol_table);
@@ -387,25 +575,48 @@ private:
     /// </summary>
     const int32_t NearJumpThreshold = 10;
 
+    /// <summary>
+    /// Max. size of instructions that call "#StringsEqual" before conditional jump
+    /// </summary>
+    const int32_t StringsEqualCallSize = 12;
+
 
     Compiler* compiler;
 
     int32_t ip_src = 0;
 
     int32_t static_size = 0;
+    int32_t io_buffer_size = 0;
 
     std::map<uint32_t, uint32_t> ip_src_to_dst;
     std::list<DosBackpatchInstruction> backpatch;
-    std::list<DosVariableDescriptor> variables;
+    std::vector<DosVariableDescriptor> variables;
     std::list<DosLabel> functions;
     std::list<DosLabel> labels;
     std::unordered_set<char*> strings;
+    std::map<int32_t, DosRegisterState> ip_register_states;
 
-    std::unordered_set<i386::CpuRegister> suppressed_registers;
+    // Register file of current function, register is mapped to variable that owns it
+    DosVariableDescriptor* register_owners[4] { };
+    uint32_t used_registers = 0;
+    uint32_t suppressed_registers = 0;
     
+    // Variable list is allocated only once, so these pointers remain valid
+    DosVariableDescriptor* static_variables_end = nullptr;
+    DosVariableDescriptor* parent_variables_begin = nullptr;
+    DosVariableDescriptor* parent_variables_end = nullptr;
+
     SymbolTableEntry* parent = nullptr;
+    int32_t parent_start_ip = 0;
     int32_t parent_end_ip = 0;
+    InstructionEntry* parent_first_instruction = nullptr;
     uint32_t parent_stack_offset = 0;
+    uint32_t entry_point_offset = 0;
     InstructionEntry* current_instruction = nullptr;
     bool was_return = false;
+    bool was_jump = false;
+
+    // Jump table that is being filled by "goto" instructions following "switch" instruction
+    uint32_t jump_table_offset = 0;
+    uint32_t jump_table_entries = 0;
 };
\ No newline at end of file
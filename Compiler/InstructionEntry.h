@@ -12,6 +12,7 @@ enum struct InstructionType {
     Goto,
     GotoLabel,
     If,
+    Switch,
     Push,
     Call,
     Return,
@@ -89,6 +90,19 @@ struct InstructionEntry {
             InstructionOperand op1;
             InstructionOperand op2;
         } if_statement;
+
+        struct {
+            InstructionOperand op;
+
+            // Followed by "count + 1" goto instructions, the last one is used for out of range values
+            uint32_t min_value;
+            uint32_t count;
+
+            // Strings are dispatched by perfect hash, "hash_bits" is size of the table (log2),
+            // all values are in range, so the last entry is used for a string too
+            uint16_t hash_multiplier;
+            uint8_t hash_bits;
+        } switch_statement;
         
         struct {
             SymbolTableEntry* symbol;
@@ -121,5 +135,8 @@ struct SwitchBackpatchList {
 
     uint32_t line;
 
+    // Jumps at the end of the case, that fall through to the following case
+    BackpatchList* next_list;
+
     SwitchBackpatchList* next;
 };
\ No newline at end of file
@@ -0,0 +1,5566 @@
+#include "Optimizer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <set>
+#include <stack>
+
+#include "Log.h"
+#include "Compiler.h"
+#include "CompilerException.h"
+
+const char* Optimizer::PassNames[(int32_t)OptimizerPass::Count] = {
+    "tailcall", "inline", "argprop", "promote", "unroll", "sccp", "unreachable", "coalesce",
+    "cse", "copyprop", "licm", "ivr", "strhash", "stackalloc", "jumpthread", "dce"
+};
+
+Optimizer::Optimizer(Compiler* compiler, uint32_t passes)
+    : compiler(compiler),
+      passes(passes)
+{
+}
+
+Optimizer::~Optimizer()
+{
+}
+
+void Optimizer::OptimizeInstructions(InstructionEntry* instruction_stream)
+{
+    if (!passes) {
+        Log::Write(LogType::Info, "Optimizations are disabled");
+        return;
+    }
+
+    Log::Write(LogType::Info, "Optimizing intermediate code...");
+    Log::PushIndent();
+
+    instructions.clear();
+
+    InstructionEntry* current = instruction_stream;
+    while (current) {
+        instructions.push_back(current);
+        current = current->next;
+    }
+
+    std::vector<SymbolTableEntry*> functions;
+    FindFunctions(functions);
+
+    // Self tail calls are converted to loops first, so such functions are not recursive anymore
+    if (IsPassEnabled(OptimizerPass::EliminateTailCalls)) {
+        for (size_t j = 0; j < functions.size(); j++) {
+            int32_t end_ip = (j + 1 < functions.size() ? functions[j + 1]->ip : (int32_t)instructions.size());
+
+            if (functions[j]->ref_count == 0 || functions[j]->ip >= end_ip) {
+                continue;
+            }
+
+            SelectFunction(functions[j], end_ip);
+            CreateControlFlowGraph();
+
+            int32_t converted = RunPass(OptimizerPass::EliminateTailCalls, [&]() { return EliminateTailCalls(); });
+            if (converted > 0) {
+                Log::Write(LogType::Verbose, "Converted %d tail calls to loop in \"%s\"", converted, function->name);
+            }
+        }
+    }
+
+    int32_t inlined = RunPass(OptimizerPass::InlineFunctions, [&]() { return InlineFunctions(); });
+    if (inlined > 0) {
+        Log::Write(LogType::Verbose, "Inlined %d function calls", inlined);
+    }
+
+    int32_t replaced = RunPass(OptimizerPass::PropagateArguments, [&]() { return PropagateArguments(); });
+    if (replaced > 0) {
+        Log::Write(LogType::Verbose, "Replaced %d parameters by constant arguments", replaced);
+    }
+
+    FindFunctions(functions);
+
+    if (IsPassEnabled(OptimizerPass::PromoteStatics)) {
+        FindStaticAccesses(functions);
+    }
+
+    for (size_t j = 0; j < functions.size(); j++) {
+        int32_t end_ip = (j + 1 < functions.size() ? functions[j + 1]->ip : (int32_t)instructions.size());
+
+        // Unreferenced functions are not emitted at all
+        if (functions[j]->ref_count == 0 || functions[j]->ip >= end_ip) {
+            continue;
+        }
+
+        SelectFunction(functions[j], end_ip);
+        CreateControlFlowGraph();
+
+        int32_t promoted = RunPass(OptimizerPass::PromoteStatics, [&]() { return PromoteStatics(); });
+        if (promoted > 0) {
+            Log::Write(LogType::Verbose, "Promoted %d static variables to local variables in \"%s\"", promoted, function->name);
+        }
+
+        int32_t unrolled = RunPass(OptimizerPass::UnrollLoops, [&]() { return UnrollLoops(); });
+        if (unrolled > 0) {
+            Log::Write(LogType::Verbose, "Unrolled %d loops in \"%s\"", unrolled, function->name);
+        }
+
+        int32_t folded = RunPass(OptimizerPass::PropagateConstants, [&]() { return PropagateConstants(); });
+        if (folded > 0) {
+            Log::Write(LogType::Verbose, "Folded %d instructions in \"%s\"", folded, function->name);
+
+            // Folded conditions changed the edges of the graph
+            CreateControlFlowGraph();
+        }
+
+        int32_t removed = RunPass(OptimizerPass::RemoveUnreachableBlocks, [&]() { return RemoveUnreachableBlocks(); });
+
+        int32_t propagated = RunPass(OptimizerPass::CoalesceTemporaryMoves, [&]() { return CoalesceTemporaryMoves(); });
+
+        int32_t eliminated = RunPass(OptimizerPass::EliminateSubexpressions, [&]() { return EliminateCommonSubexpressions(); });
+        if (eliminated > 0) {
+            Log::Write(LogType::Verbose, "Eliminated %d common subexpressions in \"%s\"", eliminated, function->name);
+        }
+
+        propagated += RunPass(OptimizerPass::PropagateCopies, [&]() { return PropagateCopies(); });
+        if (propagated > 0) {
+            Log::Write(LogType::Verbose, "Propagated %d copies in \"%s\"", propagated, function->name);
+        }
+
+        int32_t hoisted = RunPass(OptimizerPass::HoistLoopInvariants, [&]() { return HoistLoopInvariants(); });
+        if (hoisted > 0) {
+            Log::Write(LogType::Verbose, "Hoisted %d instructions out of loops in \"%s\"", hoisted, function->name);
+        }
+
+        int32_t reduced = RunPass(OptimizerPass::ReduceInductionVariables, [&]() { return ReduceInductionVariables(); });
+        if (reduced > 0) {
+            Log::Write(LogType::Verbose, "Reduced %d array accesses to pointers in \"%s\"", reduced, function->name);
+        }
+
+        int32_t hashed = RunPass(OptimizerPass::HashStringComparisons, [&]() { return HashStringComparisons(); });
+        if (hashed > 0) {
+            Log::Write(LogType::Verbose, "Dispatched %d chains of string comparisons through perfect hash in \"%s\"", hashed, function->name);
+        }
+
+        int32_t allocated = RunPass(OptimizerPass::AllocateOnStack, [&]() { return AllocateOnStack(); });
+        if (allocated > 0) {
+            Log::Write(LogType::Verbose, "Placed %d allocations on the stack in \"%s\"", allocated, function->name);
+        }
+
+        int32_t threaded = RunPass(OptimizerPass::ThreadJumps, [&]() {
+            int32_t count = ThreadConditions();
+            count += ThreadJumps();
+            return count;
+        });
+        if (threaded > 0) {
+            Log::Write(LogType::Verbose, "Threaded %d jumps in \"%s\"", threaded, function->name);
+
+            // Jumps that were bypassed are not reachable anymore
+            removed += RunPass(OptimizerPass::RemoveUnreachableBlocks, [&]() { return RemoveUnreachableBlocks(); });
+        }
+
+        removed += RunPass(OptimizerPass::RemoveDeadCode, [&]() {
+            int32_t count = RemoveDeadAssignments();
+            count += RemoveDeadStores();
+            return count;
+        });
+        if (removed > 0) {
+            Log::Write(LogType::Verbose, "Removed %d instructions in \"%s\"", removed, function->name);
+        }
+    }
+
+    function = nullptr;
+
+    // Calls could be removed together with unreachable blocks, so only functions
+    // that are still reachable from entry point will be emitted with their data
+    compiler->ReferenceFunctions(nullptr);
+
+    LogPassStats();
+
+    Log::PopIndent();
+}
+
+uint32_t Optimizer::GetPassesForLevel(OptimizationLevel level)
+{
+    const uint32_t all = (1u << (int32_t)OptimizerPass::Count) - 1;
+
+    switch (level) {
+        case OptimizationLevel::None: return 0;
+        case OptimizationLevel::Basic: {
+            return (1u << (int32_t)OptimizerPass::EliminateTailCalls) |
+                   (1u << (int32_t)OptimizerPass::PropagateConstants) |
+                   (1u << (int32_t)OptimizerPass::RemoveUnreachableBlocks) |
+                   (1u << (int32_t)OptimizerPass::CoalesceTemporaryMoves) |
+                   (1u << (int32_t)OptimizerPass::EliminateSubexpressions) |
+                   (1u << (int32_t)OptimizerPass::PropagateCopies) |
+                   (1u << (int32_t)OptimizerPass::AllocateOnStack) |
+                   (1u << (int32_t)OptimizerPass::ThreadJumps) |
+                   (1u << (int32_t)OptimizerPass::RemoveDeadCode);
+        }
+        case OptimizationLevel::Full: return all;
+        case OptimizationLevel::Size: {
+            // Inlining, specialization and unrolling duplicate instructions
+            return all & ~((1u << (int32_t)OptimizerPass::InlineFunctions) |
+                           (1u << (int32_t)OptimizerPass::PropagateArguments) |
+                           (1u << (int32_t)OptimizerPass::UnrollLoops));
+        }
+
+        default: ThrowOnUnreachableCode();
+    }
+}
+
+bool Optimizer::ParsePassList(const wchar_t* list, uint32_t& passes)
+{
+    while (*list) {
+        bool enable = true;
+        if (*list == L'+') {
+            list++;
+        } else if (*list == L'-') {
+            enable = false;
+            list++;
+        }
+
+        const wchar_t* end = list;
+        while (*end && *end != L',') {
+            end++;
+        }
+
+        int32_t found = -1;
+        for (int32_t j = 0; j < (int32_t)OptimizerPass::Count; j++) {
+            const char* name = PassNames[j];
+            const wchar_t* c = list;
+            while (c != end && *name && *c == (wchar_t)*name) {
+                c++;
+                name++;
+            }
+
+            if (c == end && !*name) {
+                found = j;
+                break;
+            }
+        }
+
+        if (found < 0) {
+            return false;
+        }
+
+        if (enable) {
+            passes |= (1u << found);
+        } else {
+            passes &= ~(1u << found);
+        }
+
+        list = (*end ? end + 1 : end);
+    }
+
+    return true;
+}
+
+int32_t Optimizer::RunPass(OptimizerPass pass, const std::function<int32_t()>& run)
+{
+    if (!IsPassEnabled(pass)) {
+        return 0;
+    }
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    int32_t changes = run();
+
+    OptimizerPassStats& stats = pass_stats[(int32_t)pass];
+    stats.time += std::chrono::high_resolution_clock::now() - start;
+    stats.runs++;
+    stats.changes += changes;
+
+    return changes;
+}
+
+bool Optimizer::IsPassEnabled(OptimizerPass pass)
+{
+    return (passes & (1u << (int32_t)pass)) != 0;
+}
+
+void Optimizer::LogPassStats()
+{
+    for (int32_t j = 0; j < (int32_t)OptimizerPass::Count; j++) {
+        const OptimizerPassStats& stats = pass_stats[j];
+        if (stats.runs == 0) {
+            continue;
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(stats.time).count();
+        Log::Write(LogType::Verbose, "Pass \"%s\" took %.2f ms in %d runs, %d changes", PassNames[j], ms, stats.runs, stats.changes);
+    }
+}
+
+void Optimizer::FindFunctions(std::vector<SymbolTableEntry*>& functions)
+{
+    functions.clear();
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (!symbol->parent &&
+            (symbol->type.base == BaseSymbolType::Function ||
+             symbol->type.base == BaseSymbolType::EntryPoint)) {
+
+            functions.push_back(symbol);
+        }
+
+        symbol = symbol->next;
+    }
+
+    std::sort(functions.begin(), functions.end(), [](SymbolTableEntry* a, SymbolTableEntry* b) {
+        return a->ip < b->ip;
+    });
+}
+
+int32_t Optimizer::GetFrameSize(SymbolTableEntry* function, bool include_parameters)
+{
+    int32_t frame_size = 0;
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, function->name) == 0 &&
+            (include_parameters || !symbol->parameter) && symbol->type.base != BaseSymbolType::Label) {
+
+            if (symbol->size > 0) {
+                SymbolType resolved_type = symbol->type;
+                resolved_type.pointer--;
+                frame_size += symbol->size * compiler->GetSymbolTypeSize(resolved_type);
+            } else {
+                frame_size += compiler->GetSymbolTypeSize(symbol->type);
+            }
+        }
+
+        symbol = symbol->next;
+    }
+
+    return frame_size;
+}
+
+int32_t Optimizer::InlineFunctions()
+{
+    std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>> call_graph;
+    compiler->ReferenceFunctions(&call_graph);
+
+    std::vector<SymbolTableEntry*> functions;
+    FindFunctions(functions);
+
+    std::set<SymbolTableEntry*> inlinable;
+    SymbolTableEntry* entry_point = nullptr;
+    for (size_t j = 0; j < functions.size(); j++) {
+        int32_t end_ip = (j + 1 < functions.size() ? functions[j + 1]->ip : (int32_t)instructions.size());
+
+        if (functions[j]->type.base == BaseSymbolType::EntryPoint) {
+            entry_point = functions[j];
+        } else if (CanInlineFunction(functions[j], end_ip, call_graph)) {
+            inlinable.insert(functions[j]);
+        }
+    }
+
+    if (inlinable.empty() || !entry_point) {
+        return 0;
+    }
+
+    // Callees are processed before their callers, so the copied instructions are already expanded
+    std::vector<SymbolTableEntry*> order;
+    std::set<SymbolTableEntry*> visited;
+    std::stack<std::pair<SymbolTableEntry*, size_t>> pending;
+    pending.push({ entry_point, 0 });
+    visited.insert(entry_point);
+
+    while (!pending.empty()) {
+        std::pair<SymbolTableEntry*, size_t>& current = pending.top();
+        std::vector<SymbolTableEntry*>& callees = call_graph[current.first];
+
+        if (current.second < callees.size()) {
+            SymbolTableEntry* callee = callees[current.second];
+            current.second++;
+
+            if (callee->type.base == BaseSymbolType::Function && visited.insert(callee).second) {
+                pending.push({ callee, 0 });
+            }
+        } else {
+            order.push_back(current.first);
+            pending.pop();
+        }
+    }
+
+    int32_t inlined = 0;
+    for (size_t j = 0; j < order.size(); j++) {
+        // IPs are shifted by every expanded function
+        FindFunctions(functions);
+
+        for (size_t k = 0; k < functions.size(); k++) {
+            if (functions[k] != order[j]) {
+                continue;
+            }
+
+            int32_t end_ip = (k + 1 < functions.size() ? functions[k + 1]->ip : (int32_t)instructions.size());
+            if (functions[k]->ip < end_ip) {
+                inlined += InlineCallSites(functions[k], functions[k]->ip, end_ip, inlinable);
+            }
+            break;
+        }
+    }
+
+    // Functions, whose all calls were inlined, are not referenced anymore
+    compiler->ReferenceFunctions(nullptr);
+
+    return inlined;
+}
+
+bool Optimizer::CanInlineFunction(SymbolTableEntry* function, int32_t end_ip,
+    std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>>& call_graph)
+{
+    if (function->type.base != BaseSymbolType::Function || function->ref_count == 0 || function->ip >= end_ip) {
+        return false;
+    }
+
+    // Labels and arrays cannot be copied to the caller
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, function->name) == 0 &&
+            (symbol->type.base == BaseSymbolType::Label || symbol->size > 0)) {
+            return false;
+        }
+
+        symbol = symbol->next;
+    }
+
+    int32_t size = 0;
+    bool is_leaf = true;
+    for (int32_t ip = function->ip; ip < end_ip; ip++) {
+        switch (instructions[ip]->type) {
+            case InstructionType::Nop: continue;
+            case InstructionType::GotoLabel: return false;
+            case InstructionType::Call: is_leaf = false; break;
+        }
+
+        size++;
+    }
+
+    // Recursive function would be expanded indefinitely
+    std::set<SymbolTableEntry*> visited;
+    std::stack<SymbolTableEntry*> pending;
+    pending.push(function);
+
+    while (!pending.empty()) {
+        std::vector<SymbolTableEntry*>& callees = call_graph[pending.top()];
+        pending.pop();
+
+        for (size_t j = 0; j < callees.size(); j++) {
+            if (callees[j] == function) {
+                if (function->is_inline) {
+                    Log::Write(LogType::Warning, "Recursive function \"%s\" cannot be inlined", function->name);
+                }
+                return false;
+            }
+
+            if (visited.insert(callees[j]).second) {
+                pending.push(callees[j]);
+            }
+        }
+    }
+
+    return (function->is_inline || (is_leaf && size <= InlineLeafFunctionSize));
+}
+
+int32_t Optimizer::InlineCallSites(SymbolTableEntry* caller, int32_t begin_ip, int32_t end_ip, const std::set<SymbolTableEntry*>& inlinable)
+{
+    std::unordered_map<std::string, SymbolTableEntry*> caller_symbols;
+    std::vector<int32_t> function_ips;
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (!symbol->parent) {
+            if (symbol->type.base == BaseSymbolType::Function || symbol->type.base == BaseSymbolType::EntryPoint) {
+                function_ips.push_back(symbol->ip);
+            }
+        } else if (strcmp(symbol->parent, caller->name) == 0 && symbol->type.base != BaseSymbolType::Label) {
+            caller_symbols[symbol->name] = symbol;
+        }
+
+        symbol = symbol->next;
+    }
+
+    // Each inlined copy adds its variables to the stack frame of the caller,
+    // which is addressed by 8-bit displacement
+    int32_t frame_size = GetFrameSize(caller, false);
+
+    std::vector<OptimizerCallSite> sites;
+    for (int32_t ip = begin_ip; ip < end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type != InstructionType::Call) {
+            continue;
+        }
+
+        SymbolTableEntry* callee = i->call_statement.target;
+        if (callee == caller || inlinable.find(callee) == inlinable.end()) {
+            continue;
+        }
+
+        // All parameters must be pushed right before the call
+        int32_t push_ip = ip - callee->parameter;
+        bool is_valid = (push_ip >= begin_ip);
+        for (int32_t k = push_ip; is_valid && k < ip; k++) {
+            if (instructions[k]->type != InstructionType::Push) {
+                is_valid = false;
+            }
+        }
+
+        int32_t callee_end_ip = (int32_t)instructions.size();
+        for (size_t k = 0; k < function_ips.size(); k++) {
+            if (function_ips[k] > callee->ip && function_ips[k] < callee_end_ip) {
+                callee_end_ip = function_ips[k];
+            }
+        }
+
+        // Local variables of the caller would hide static variables used by the callee
+        std::set<std::string> callee_symbols;
+        symbol = compiler->GetSymbols();
+        while (symbol) {
+            if (symbol->parent && strcmp(symbol->parent, callee->name) == 0) {
+                callee_symbols.insert(symbol->name);
+            }
+
+            symbol = symbol->next;
+        }
+
+        for (int32_t k = callee->ip; is_valid && k < callee_end_ip; k++) {
+            ForEachVariable(instructions[k], [&](char*& value) {
+                if (callee_symbols.find(value) == callee_symbols.end() &&
+                    caller_symbols.find(value) != caller_symbols.end()) {
+                    is_valid = false;
+                }
+            });
+        }
+
+        int32_t callee_frame_size = GetFrameSize(callee, true);
+        if (is_valid && frame_size + callee_frame_size > StackAllocMaxFrameSize) {
+            is_valid = false;
+        }
+
+        if (is_valid) {
+            sites.push_back({ push_ip, ip, callee, callee_end_ip });
+            frame_size += callee_frame_size;
+        }
+    }
+
+    if (sites.empty()) {
+        return 0;
+    }
+
+    // Create new instruction stream with copied instructions instead of the calls
+    std::vector<InstructionEntry*> result;
+    std::vector<int32_t> ip_map(instructions.size() + 1);
+
+    size_t site_index = 0;
+    for (int32_t ip = 0; ip < (int32_t)instructions.size(); ip++) {
+        if (site_index >= sites.size() || ip != sites[site_index].push_ip) {
+            ip_map[ip] = (int32_t)result.size();
+            result.push_back(instructions[ip]);
+            continue;
+        }
+
+        const OptimizerCallSite& site = sites[site_index];
+        site_index++;
+
+        // Jumps to "push" instructions lead to assignments of corresponding parameters
+        for (int32_t k = site.push_ip; k <= site.call_ip; k++) {
+            ip_map[k] = (int32_t)result.size() + (k - site.push_ip);
+        }
+
+        bool has_backward_jump = CopyInlinedInstructions(site, caller, result);
+        if (has_backward_jump) {
+            // Temporary variables go out of scope on backward jumps,
+            // so values computed before the call have to be preserved
+            std::set<std::string> used_before;
+            for (int32_t k = begin_ip; k < site.push_ip; k++) {
+                ForEachVariable(instructions[k], [&](char*& value) {
+                    used_before.insert(value);
+                });
+            }
+
+            for (int32_t k = site.call_ip + 1; k < end_ip; k++) {
+                ForEachVariable(instructions[k], [&](char*& value) {
+                    std::unordered_map<std::string, SymbolTableEntry*>::iterator it = caller_symbols.find(value);
+                    if (it != caller_symbols.end() && it->second->is_temp && used_before.find(value) != used_before.end()) {
+                        it->second->is_temp = false;
+                    }
+                });
+            }
+        }
+
+        ip = site.call_ip;
+    }
+
+    ip_map[instructions.size()] = (int32_t)result.size();
+
+    // Copied instructions already jump to the new IPs, so only the original instructions are updated
+    for (size_t k = 0; k < instructions.size(); k++) {
+        InstructionEntry* i = instructions[k];
+
+        switch (i->type) {
+            case InstructionType::Goto: i->goto_statement.ip = ip_map[i->goto_statement.ip]; break;
+            case InstructionType::If: i->if_statement.ip = ip_map[i->if_statement.ip]; break;
+        }
+    }
+
+    symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->ip > 0 && symbol->ip <= (int32_t)instructions.size()) {
+            symbol->ip = ip_map[symbol->ip];
+        }
+
+        symbol = symbol->next;
+    }
+
+    for (size_t j = 0; j < sites.size(); j++) {
+        for (int32_t k = sites[j].push_ip; k <= sites[j].call_ip; k++) {
+            delete instructions[k];
+        }
+    }
+
+    for (size_t k = 0; k + 1 < result.size(); k++) {
+        result[k]->next = result[k + 1];
+    }
+    result.back()->next = nullptr;
+
+    instructions.swap(result);
+
+    return (int32_t)sites.size();
+}
+
+bool Optimizer::CopyInlinedInstructions(const OptimizerCallSite& site, SymbolTableEntry* caller, std::vector<InstructionEntry*>& result)
+{
+    SymbolTableEntry* callee = site.callee;
+    InstructionEntry* call = instructions[site.call_ip];
+
+    std::unordered_map<std::string, SymbolTableEntry*> callee_symbols;
+    std::vector<SymbolTableEntry*> parameters(callee->parameter);
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, callee->name) == 0) {
+            callee_symbols[symbol->name] = symbol;
+
+            if (symbol->parameter > 0 && symbol->parameter <= callee->parameter) {
+                parameters[symbol->parameter - 1] = symbol;
+            }
+        }
+
+        symbol = symbol->next;
+    }
+
+    // Each inlined call gets its own copy of all variables of the callee
+    std::unordered_map<std::string, SymbolTableEntry*> renamed;
+    auto rename = [&](char*& value) {
+        std::unordered_map<std::string, SymbolTableEntry*>::iterator it = callee_symbols.find(value);
+        if (it == callee_symbols.end()) {
+            // Static variable
+            return;
+        }
+
+        SymbolTableEntry*& decl = renamed[value];
+        if (!decl) {
+            decl = compiler->AddTempVariable(it->second->type, caller->name);
+            decl->is_temp = it->second->is_temp;
+        }
+
+        value = decl->name;
+    };
+
+    auto create_assign = [&](char* dst, const InstructionOperand& op1) {
+        InstructionEntry* i = new InstructionEntry();
+        i->type = InstructionType::Assign;
+        i->assignment.type = AssignType::None;
+        i->assignment.dst_value = dst;
+        i->assignment.op1 = op1;
+        return i;
+    };
+
+    // Parameters are assigned in the same order as they were pushed
+    for (int32_t k = site.push_ip; k < site.call_ip; k++) {
+        SymbolTableEntry* param = parameters[k - site.push_ip];
+        SymbolTableEntry* value = instructions[k]->push_statement.symbol;
+        if (!param) {
+            ThrowOnUnreachableCode();
+        }
+
+        InstructionOperand op1 { };
+        op1.value = value->name;
+        op1.type = value->type;
+        op1.exp_type = value->exp_type;
+
+        char* dst = param->name;
+        rename(dst);
+        result.push_back(create_assign(dst, op1));
+    }
+
+    // Compute new positions of the instructions, "nop" instructions are not copied
+    int32_t base_ip = (int32_t)result.size();
+    std::vector<int32_t> positions(site.callee_end_ip - callee->ip + 1);
+
+    int32_t count = 0;
+    for (int32_t ip = callee->ip; ip < site.callee_end_ip; ip++) {
+        positions[ip - callee->ip] = count;
+
+        InstructionEntry* i = instructions[ip];
+        switch (i->type) {
+            case InstructionType::Nop: break;
+            case InstructionType::Return: {
+                if (call->call_statement.return_symbol && i->return_statement.op.exp_type != ExpressionType::None) {
+                    count++;
+                }
+                if (ip + 1 < site.callee_end_ip) {
+                    count++;
+                }
+                break;
+            }
+
+            default: count++; break;
+        }
+    }
+    positions[site.callee_end_ip - callee->ip] = count;
+
+    // Jumps to the end of the callee continue after the copied instructions
+    auto map_ip = [&](int32_t ip) {
+        if (ip < callee->ip || ip > site.callee_end_ip) {
+            ip = site.callee_end_ip;
+        }
+        return base_ip + positions[ip - callee->ip];
+    };
+
+    bool has_backward_jump = false;
+    int32_t return_count = 0;
+    for (int32_t ip = callee->ip; ip < site.callee_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        switch (i->type) {
+            case InstructionType::Nop: break;
+
+            case InstructionType::Return: {
+                // Returned value is assigned directly to the variable that received it from the call
+                if (call->call_statement.return_symbol && i->return_statement.op.exp_type != ExpressionType::None) {
+                    InstructionOperand op1 = i->return_statement.op;
+                    if (op1.exp_type == ExpressionType::Variable) {
+                        rename(op1.value);
+                    }
+                    if (op1.index.value && op1.index.exp_type == ExpressionType::Variable) {
+                        rename(op1.index.value);
+                    }
+
+                    result.push_back(create_assign(call->call_statement.return_symbol, op1));
+                    return_count++;
+                }
+
+                if (ip + 1 < site.callee_end_ip) {
+                    InstructionEntry* entry = new InstructionEntry();
+                    entry->type = InstructionType::Goto;
+                    entry->goto_statement.ip = base_ip + count;
+                    result.push_back(entry);
+                }
+                break;
+            }
+
+            default: {
+                InstructionEntry* entry = new InstructionEntry(*i);
+                if (entry->type == InstructionType::Push) {
+                    entry->push_statement.symbol = new SymbolTableEntry(*i->push_statement.symbol);
+                }
+
+                ForEachVariable(entry, rename);
+
+                int32_t* target_ip = nullptr;
+                switch (entry->type) {
+                    case InstructionType::Goto: target_ip = &entry->goto_statement.ip; break;
+                    case InstructionType::If: target_ip = &entry->if_statement.ip; break;
+                }
+
+                if (target_ip) {
+                    *target_ip = map_ip(*target_ip);
+                    if (*target_ip <= (int32_t)result.size()) {
+                        has_backward_jump = true;
+                    }
+                }
+
+                result.push_back(entry);
+                break;
+            }
+        }
+    }
+
+    if (return_count > 1) {
+        // Temporary variable would be discarded, if it's assigned on more paths
+        symbol = compiler->GetSymbols();
+        while (symbol) {
+            if (symbol->parent && strcmp(symbol->parent, caller->name) == 0 &&
+                strcmp(symbol->name, call->call_statement.return_symbol) == 0) {
+                symbol->is_temp = false;
+                break;
+            }
+
+            symbol = symbol->next;
+        }
+    }
+
+    return has_backward_jump;
+}
+
+int32_t Optimizer::PropagateArguments()
+{
+    std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>> call_graph;
+    compiler->ReferenceFunctions(&call_graph);
+
+    std::vector<SymbolTableEntry*> functions;
+    FindFunctions(functions);
+
+    SymbolTableEntry* entry_point = nullptr;
+    for (size_t j = 0; j < functions.size(); j++) {
+        if (functions[j]->type.base == BaseSymbolType::EntryPoint) {
+            entry_point = functions[j];
+            break;
+        }
+    }
+
+    if (!entry_point) {
+        return 0;
+    }
+
+    // Callers are processed before their callees, so constants passed through multiple calls are already folded
+    std::vector<SymbolTableEntry*> order;
+    std::set<SymbolTableEntry*> visited;
+    std::stack<std::pair<SymbolTableEntry*, size_t>> pending;
+    pending.push({ entry_point, 0 });
+    visited.insert(entry_point);
+
+    while (!pending.empty()) {
+        std::pair<SymbolTableEntry*, size_t>& current = pending.top();
+        std::vector<SymbolTableEntry*>& callees = call_graph[current.first];
+
+        if (current.second < callees.size()) {
+            SymbolTableEntry* callee = callees[current.second];
+            current.second++;
+
+            if (callee->type.base == BaseSymbolType::Function && visited.insert(callee).second) {
+                pending.push({ callee, 0 });
+            }
+        } else {
+            order.push_back(current.first);
+            pending.pop();
+        }
+    }
+
+    std::reverse(order.begin(), order.end());
+
+    int32_t replaced = 0;
+    for (size_t j = 0; j < order.size(); j++) {
+        std::vector<SymbolTableEntry*> changed;
+        if (order[j]->type.base == BaseSymbolType::Function) {
+            replaced += PropagateArguments(order[j], call_graph, changed);
+
+            // Calls in the copies have to be found by the following callees
+            if (!changed.empty()) {
+                compiler->ReferenceFunctions(nullptr);
+            }
+        }
+        changed.push_back(order[j]);
+
+        // Constants are folded in the function, so they can be passed to its callees
+        FindFunctions(functions);
+
+        for (size_t k = 0; k < functions.size(); k++) {
+            if (std::find(changed.begin(), changed.end(), functions[k]) == changed.end()) {
+                continue;
+            }
+
+            int32_t end_ip = (k + 1 < functions.size() ? functions[k + 1]->ip : (int32_t)instructions.size());
+            if (functions[k]->ip >= end_ip) {
+                continue;
+            }
+
+            SelectFunction(functions[k], end_ip);
+            CreateControlFlowGraph();
+
+            if (PropagateConstants() > 0) {
+                CreateControlFlowGraph();
+            }
+
+            // Calls in unreachable blocks don't prevent propagation to their callees
+            RemoveUnreachableBlocks();
+        }
+    }
+
+    // Functions, whose all calls were redirected to specialized copies, are not referenced anymore
+    compiler->ReferenceFunctions(nullptr);
+
+    return replaced;
+}
+
+int32_t Optimizer::PropagateArguments(SymbolTableEntry* callee,
+    std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>>& call_graph, std::vector<SymbolTableEntry*>& specialized)
+{
+    std::vector<SymbolTableEntry*> functions;
+    FindFunctions(functions);
+
+    int32_t end_ip = (int32_t)instructions.size();
+    for (size_t j = 0; j < functions.size(); j++) {
+        if (functions[j] == callee) {
+            if (j + 1 < functions.size()) {
+                end_ip = functions[j + 1]->ip;
+            }
+            break;
+        }
+    }
+
+    if (callee->ref_count == 0 || callee->parameter == 0 || callee->ip >= end_ip) {
+        return 0;
+    }
+
+    // All parameters must be pushed right before each call, otherwise they cannot be removed
+    std::vector<OptimizerCallSite> sites;
+    for (size_t j = 0; j < functions.size(); j++) {
+        int32_t begin_ip = functions[j]->ip;
+        int32_t caller_end_ip = (j + 1 < functions.size() ? functions[j + 1]->ip : (int32_t)instructions.size());
+        if (functions[j]->ref_count == 0) {
+            continue;
+        }
+
+        for (int32_t ip = begin_ip; ip < caller_end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+            if (i->type != InstructionType::Call || i->call_statement.target != callee) {
+                continue;
+            }
+
+            int32_t push_ip = ip - callee->parameter;
+            if (push_ip < begin_ip) {
+                return 0;
+            }
+
+            for (int32_t k = push_ip; k < ip; k++) {
+                if (instructions[k]->type != InstructionType::Push) {
+                    return 0;
+                }
+            }
+
+            sites.push_back({ push_ip, ip, callee, end_ip });
+        }
+    }
+
+    if (sites.empty()) {
+        return 0;
+    }
+
+    SelectFunction(callee, end_ip);
+
+    // Parameters passed unchanged to recursive calls keep the value from the outer call
+    std::set<std::string> assigned = referenced_symbols;
+    for (int32_t ip = callee->ip; ip < end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type == InstructionType::Assign) {
+            assigned.insert(i->assignment.dst_value);
+        } else if (i->type == InstructionType::Call && i->call_statement.return_symbol) {
+            assigned.insert(i->call_statement.return_symbol);
+        }
+    }
+
+    std::vector<SymbolTableEntry*> parameters(callee->parameter);
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, callee->name) == 0 &&
+            symbol->parameter > 0 && symbol->parameter <= callee->parameter) {
+            parameters[symbol->parameter - 1] = symbol;
+        }
+
+        symbol = symbol->next;
+    }
+
+    std::vector<std::vector<OptimizerValue>> arguments(sites.size());
+    std::vector<OptimizerValue> values(callee->parameter, { OptimizerValueState::Undefined, 0 });
+
+    for (size_t j = 0; j < sites.size(); j++) {
+        bool is_recursive = (sites[j].call_ip >= callee->ip && sites[j].call_ip < end_ip);
+
+        for (int32_t k = 0; k < callee->parameter; k++) {
+            SymbolTableEntry* param = parameters[k];
+            SymbolTableEntry* value = instructions[sites[j].push_ip + k]->push_statement.symbol;
+            if (!param) {
+                ThrowOnUnreachableCode();
+            }
+
+            OptimizerValue argument;
+            if (!IsScalarType(param->type)) {
+                argument = { OptimizerValueState::Overdefined, 0 };
+            } else if (value->exp_type == ExpressionType::Constant) {
+                argument = { OptimizerValueState::Constant, TruncateValue((uint32_t)atoi(value->name), compiler->GetSymbolTypeSize(param->type)) };
+            } else if (is_recursive && value->exp_type == ExpressionType::Variable &&
+                       strcmp(value->name, param->name) == 0 && assigned.find(param->name) == assigned.end()) {
+                argument = { OptimizerValueState::Undefined, 0 };
+            } else {
+                argument = { OptimizerValueState::Overdefined, 0 };
+            }
+
+            arguments[j].push_back(argument);
+            values[k] = MeetValues(values[k], argument);
+        }
+    }
+
+    int32_t replaced = 0;
+
+    // Parameters that receive the same constant from all call sites are not passed at all
+    for (int32_t k = (int32_t)values.size() - 1; k >= 0; k--) {
+        if (values[k].state != OptimizerValueState::Constant) {
+            continue;
+        }
+
+        for (size_t j = 0; j < arguments.size(); j++) {
+            arguments[j].erase(arguments[j].begin() + k);
+        }
+        replaced++;
+    }
+
+    if (replaced > 0) {
+        std::vector<InstructionEntry*> entries;
+        RemoveParameters(callee, values, sites, entries);
+
+        int32_t begin_ip = callee->ip;
+        int32_t count = (int32_t)entries.size();
+        InsertInstructions(begin_ip, entries, nullptr);
+        end_ip += count;
+
+        // Loops created from tail calls and labels on the first statement jump to the beginning
+        // of the function, the constants are assigned only once
+        for (int32_t ip = begin_ip + count; ip < end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+            if (i->type == InstructionType::Goto && i->goto_statement.ip == begin_ip) {
+                i->goto_statement.ip += count;
+            } else if (i->type == InstructionType::If && i->if_statement.ip == begin_ip) {
+                i->if_statement.ip += count;
+            }
+        }
+
+        SymbolTableEntry* symbol = compiler->GetSymbols();
+        while (symbol) {
+            if (symbol->parent && strcmp(symbol->parent, callee->name) == 0 &&
+                symbol->type.base == BaseSymbolType::Label && symbol->ip == begin_ip) {
+                symbol->ip += count;
+            }
+
+            symbol = symbol->next;
+        }
+
+        SelectFunction(callee, end_ip);
+        CreateControlFlowGraph();
+
+        for (size_t j = 0; j < sites.size(); j++) {
+            if (sites[j].push_ip >= begin_ip) {
+                sites[j].push_ip += count;
+                sites[j].call_ip += count;
+            }
+        }
+
+        Log::Write(LogType::Verbose, "Replaced %d parameters of \"%s\" by constant arguments", replaced, callee->name);
+    }
+
+    if (callee->parameter == 0) {
+        return replaced;
+    }
+
+    // Copies are created only for small non-recursive functions, whose branches depend on the constants
+    int32_t size = 0;
+    for (int32_t ip = callee->ip; ip < end_ip; ip++) {
+        if (instructions[ip]->type != InstructionType::Nop) {
+            size++;
+        }
+    }
+
+    if (size > SpecializeFunctionMaxSize) {
+        return replaced;
+    }
+
+    std::set<SymbolTableEntry*> reachable;
+    std::stack<SymbolTableEntry*> pending;
+    pending.push(callee);
+
+    while (!pending.empty()) {
+        std::vector<SymbolTableEntry*>& callees = call_graph[pending.top()];
+        pending.pop();
+
+        for (size_t j = 0; j < callees.size(); j++) {
+            if (callees[j] == callee) {
+                return replaced;
+            }
+
+            if (reachable.insert(callees[j]).second) {
+                pending.push(callees[j]);
+            }
+        }
+    }
+
+    // Remaining parameters were renumbered
+    parameters.assign(callee->parameter, nullptr);
+
+    symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, callee->name) == 0 &&
+            symbol->parameter > 0 && symbol->parameter <= callee->parameter) {
+            parameters[symbol->parameter - 1] = symbol;
+        }
+
+        symbol = symbol->next;
+    }
+
+    // Call sites are grouped by constants passed to parameters, that make any condition constant
+    std::vector<std::vector<OptimizerValue>> keys;
+    std::vector<std::vector<OptimizerCallSite>> groups;
+
+    for (size_t j = 0; j < sites.size(); j++) {
+        std::vector<bool> used;
+        if (!FindFoldableConditions(parameters, arguments[j], callee->ip, end_ip, used)) {
+            continue;
+        }
+
+        std::vector<OptimizerValue> key(callee->parameter, { OptimizerValueState::Undefined, 0 });
+        for (int32_t k = 0; k < callee->parameter; k++) {
+            if (used[k]) {
+                key[k] = arguments[j][k];
+            }
+        }
+
+        size_t group = std::find(keys.begin(), keys.end(), key) - keys.begin();
+        if (group == keys.size()) {
+            if (keys.size() >= SpecializeFunctionMaxCount) {
+                continue;
+            }
+
+            keys.push_back(key);
+            groups.emplace_back();
+        }
+
+        groups[group].push_back(sites[j]);
+    }
+
+    for (size_t j = 0; j < keys.size(); j++) {
+        SymbolTableEntry* copy = SpecializeFunction(callee, end_ip, keys[j], groups[j]);
+        specialized.push_back(copy);
+
+        for (size_t k = 0; k < keys[j].size(); k++) {
+            if (keys[j][k].state == OptimizerValueState::Constant) {
+                replaced++;
+            }
+        }
+
+        Log::Write(LogType::Verbose, "Specialized \"%s\" for %d call sites as \"%s\"", callee->name, (int32_t)groups[j].size(), copy->name);
+    }
+
+    return replaced;
+}
+
+bool Optimizer::FindFoldableConditions(const std::vector<SymbolTableEntry*>& parameters, const std::vector<OptimizerValue>& values,
+    int32_t begin_ip, int32_t end_ip, std::vector<bool>& used)
+{
+    std::unordered_map<std::string, std::vector<InstructionEntry*>> assignments;
+    std::set<std::string> unknown = referenced_symbols;
+
+    for (int32_t ip = begin_ip; ip < end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type == InstructionType::Assign && !i->assignment.dst_index.value) {
+            assignments[i->assignment.dst_value].push_back(i);
+        } else if (i->type == InstructionType::Call && i->call_statement.return_symbol) {
+            unknown.insert(i->call_statement.return_symbol);
+        }
+    }
+
+    // Parameters that each known variable depends on
+    std::unordered_map<std::string, std::vector<bool>> known;
+    for (size_t k = 0; k < parameters.size(); k++) {
+        if (values[k].state == OptimizerValueState::Constant &&
+            assignments.find(parameters[k]->name) == assignments.end()) {
+            std::vector<bool>& depends = known[parameters[k]->name];
+            depends.assign(parameters.size(), false);
+            depends[k] = true;
+        }
+    }
+
+    auto is_known = [&](const InstructionOperand& op, std::vector<bool>* depends) {
+        if (op.index.value) {
+            return false;
+        }
+        if (op.exp_type == ExpressionType::Constant) {
+            return true;
+        }
+        if (op.exp_type != ExpressionType::Variable) {
+            return false;
+        }
+
+        std::unordered_map<std::string, std::vector<bool>>::iterator it = known.find(op.value);
+        if (it == known.end()) {
+            return false;
+        }
+
+        if (depends) {
+            for (size_t k = 0; k < depends->size(); k++) {
+                (*depends)[k] = (*depends)[k] || it->second[k];
+            }
+        }
+        return true;
+    };
+
+    // Only local variables, whose all assignments use known values, are known too
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        std::unordered_map<std::string, std::vector<InstructionEntry*>>::iterator it = assignments.begin();
+        for (; it != assignments.end(); ++it) {
+            SymbolTableEntry* symbol = FindSymbolByName(it->first.c_str());
+            if (!symbol || !symbol->parent || symbol->parameter || !IsScalarType(symbol->type) ||
+                unknown.find(it->first) != unknown.end() || known.find(it->first) != known.end()) {
+                continue;
+            }
+
+            std::vector<bool> depends(parameters.size(), false);
+            bool is_valid = true;
+            for (size_t j = 0; is_valid && j < it->second.size(); j++) {
+                InstructionEntry* i = it->second[j];
+                is_valid = is_known(i->assignment.op1, &depends) &&
+                    (i->assignment.type == AssignType::None || i->assignment.type == AssignType::Negation ||
+                     is_known(i->assignment.op2, &depends));
+            }
+
+            if (is_valid) {
+                known[it->first] = depends;
+                changed = true;
+            }
+        }
+    }
+
+    used.assign(parameters.size(), false);
+
+    bool found = false;
+    for (int32_t ip = begin_ip; ip < end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        std::vector<bool> depends(parameters.size(), false);
+        bool is_foldable;
+        switch (i->type) {
+            case InstructionType::If: {
+                is_foldable = is_known(i->if_statement.op1, &depends) && is_known(i->if_statement.op2, &depends);
+                break;
+            }
+            case InstructionType::Switch: {
+                is_foldable = is_known(i->switch_statement.op, &depends);
+                break;
+            }
+
+            default: continue;
+        }
+
+        // Conditions with constant operands only are folded anyway
+        if (!is_foldable || std::find(depends.begin(), depends.end(), true) == depends.end()) {
+            continue;
+        }
+
+        for (size_t k = 0; k < depends.size(); k++) {
+            used[k] = used[k] || depends[k];
+        }
+        found = true;
+    }
+
+    return found;
+}
+
+SymbolTableEntry* Optimizer::SpecializeFunction(SymbolTableEntry* function, int32_t end_ip,
+    const std::vector<OptimizerValue>& values, std::vector<OptimizerCallSite>& sites)
+{
+    int32_t base_ip = (int32_t)instructions.size();
+    SymbolTableEntry* copy = compiler->AddFunctionCopy(function, base_ip);
+
+    for (size_t j = 0; j < sites.size(); j++) {
+        instructions[sites[j].call_ip]->call_statement.target = copy;
+    }
+
+    std::vector<InstructionEntry*> entries;
+    RemoveParameters(copy, values, sites, entries);
+
+    // Jumps to the beginning of the function skip assignments of the constants
+    int32_t shift = base_ip + (int32_t)entries.size() - function->ip;
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, copy->name) == 0 && symbol->type.base == BaseSymbolType::Label) {
+            symbol->ip += shift;
+        }
+
+        symbol = symbol->next;
+    }
+
+    for (int32_t ip = function->ip; ip < end_ip; ip++) {
+        InstructionEntry* entry = new InstructionEntry(*instructions[ip]);
+        if (entry->type == InstructionType::Push) {
+            entry->push_statement.symbol = new SymbolTableEntry(*entry->push_statement.symbol);
+        }
+
+        int32_t* target_ip = nullptr;
+        switch (entry->type) {
+            case InstructionType::Goto: target_ip = &entry->goto_statement.ip; break;
+            case InstructionType::If: target_ip = &entry->if_statement.ip; break;
+        }
+
+        if (target_ip && *target_ip >= function->ip && *target_ip <= end_ip) {
+            *target_ip += shift;
+        }
+
+        entries.push_back(entry);
+    }
+
+    instructions.back()->next = entries[0];
+    for (size_t j = 0; j + 1 < entries.size(); j++) {
+        entries[j]->next = entries[j + 1];
+    }
+    entries.back()->next = nullptr;
+
+    instructions.insert(instructions.end(), entries.begin(), entries.end());
+
+    return copy;
+}
+
+void Optimizer::RemoveParameters(SymbolTableEntry* function, const std::vector<OptimizerValue>& values,
+    std::vector<OptimizerCallSite>& sites, std::vector<InstructionEntry*>& entries)
+{
+    std::vector<SymbolTableEntry*> parameters(function->parameter);
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, function->name) == 0 &&
+            symbol->parameter > 0 && symbol->parameter <= function->parameter) {
+            parameters[symbol->parameter - 1] = symbol;
+        }
+
+        symbol = symbol->next;
+    }
+
+    int32_t parameter_count = 0;
+    for (int32_t k = 0; k < function->parameter; k++) {
+        SymbolTableEntry* param = parameters[k];
+        if (!param) {
+            ThrowOnUnreachableCode();
+        }
+
+        if (values[k].state != OptimizerValueState::Constant) {
+            parameter_count++;
+            param->parameter = parameter_count;
+            continue;
+        }
+
+        // Parameter becomes local variable initialized at the beginning of the function
+        param->parameter = 0;
+
+        InstructionEntry* i = new InstructionEntry();
+        i->type = InstructionType::Assign;
+        i->assignment.type = AssignType::None;
+        i->assignment.dst_value = param->name;
+        i->assignment.op1.value = ValueToString(values[k].value);
+        i->assignment.op1.type = param->type;
+        i->assignment.op1.exp_type = ExpressionType::Constant;
+        entries.push_back(i);
+    }
+
+    // Remaining "push" instructions are moved right before the call, so they stay contiguous
+    int32_t removed = function->parameter - parameter_count;
+    for (size_t j = 0; j < sites.size(); j++) {
+        std::vector<InstructionEntry> kept;
+        for (int32_t k = 0; k < function->parameter; k++) {
+            if (values[k].state != OptimizerValueState::Constant) {
+                kept.push_back(*instructions[sites[j].push_ip + k]);
+            }
+        }
+
+        for (int32_t k = 0; k < function->parameter; k++) {
+            InstructionEntry* i = instructions[sites[j].push_ip + k];
+            if (k < removed) {
+                i->type = InstructionType::Nop;
+            } else {
+                InstructionEntry* next = i->next;
+                *i = kept[k - removed];
+                i->next = next;
+            }
+        }
+
+        sites[j].push_ip += removed;
+    }
+
+    function->parameter = parameter_count;
+}
+
+int32_t Optimizer::EliminateTailCalls()
+{
+    if (function->type.base != BaseSymbolType::Function) {
+        return 0;
+    }
+
+    // Local variables are shared by all iterations, so pointers to them cannot be passed to the next one
+    std::set<std::string>::iterator it = referenced_symbols.begin();
+    while (it != referenced_symbols.end()) {
+        SymbolTableEntry* referenced = FindSymbolByName(it->c_str());
+        if (referenced && referenced->parent) {
+            return 0;
+        }
+        ++it;
+    }
+
+    std::vector<SymbolTableEntry*> parameters(function->parameter);
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, function->name) == 0) {
+            if (symbol->size > 0) {
+                return 0;
+            }
+
+            if (symbol->parameter > 0 && symbol->parameter <= function->parameter) {
+                parameters[symbol->parameter - 1] = symbol;
+            }
+        }
+
+        symbol = symbol->next;
+    }
+
+    auto create_assign = [&](char* dst, const InstructionOperand& op1) {
+        InstructionEntry* i = new InstructionEntry();
+        i->type = InstructionType::Assign;
+        i->assignment.type = AssignType::None;
+        i->assignment.dst_value = dst;
+        i->assignment.op1 = op1;
+        return i;
+    };
+
+    int32_t converted = 0;
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* call = instructions[ip];
+        if (call->type != InstructionType::Call || call->call_statement.target != function) {
+            continue;
+        }
+
+        int32_t push_ip = ip - function->parameter;
+        if (push_ip < function_begin_ip) {
+            continue;
+        }
+
+        bool is_contiguous = true;
+        for (int32_t k = push_ip; k < ip; k++) {
+            if (instructions[k]->type != InstructionType::Push) {
+                is_contiguous = false;
+                break;
+            }
+        }
+
+        if (!is_contiguous) {
+            continue;
+        }
+
+        // Result of the call has to be returned immediately, void function can also fall off its end
+        int32_t next_ip = ip + 1;
+        while (next_ip < function_end_ip && instructions[next_ip]->type == InstructionType::Nop) {
+            next_ip++;
+        }
+
+        bool is_tail_call;
+        if (next_ip >= function_end_ip) {
+            is_tail_call = !call->call_statement.return_symbol;
+        } else if (instructions[next_ip]->type == InstructionType::Return) {
+            InstructionOperand& op = instructions[next_ip]->return_statement.op;
+            if (op.exp_type == ExpressionType::None) {
+                is_tail_call = !call->call_statement.return_symbol;
+            } else {
+                is_tail_call = (call->call_statement.return_symbol && op.exp_type == ExpressionType::Variable &&
+                    !op.index.value && strcmp(op.value, call->call_statement.return_symbol) == 0);
+            }
+        } else {
+            is_tail_call = false;
+        }
+
+        if (!is_tail_call) {
+            continue;
+        }
+
+        // Parameters are assigned one by one, so parameters passed to later parameters are saved first
+        std::vector<InstructionEntry*> entries;
+        std::vector<InstructionOperand> values(function->parameter);
+
+        for (int32_t k = 0; k < function->parameter; k++) {
+            SymbolTableEntry* value = instructions[push_ip + k]->push_statement.symbol;
+            if (!parameters[k]) {
+                ThrowOnUnreachableCode();
+            }
+
+            InstructionOperand& op1 = values[k];
+            op1 = { };
+            op1.value = value->name;
+            op1.type = value->type;
+            op1.exp_type = value->exp_type;
+
+            if (value->exp_type != ExpressionType::Variable) {
+                continue;
+            }
+
+            for (int32_t j = 0; j < k; j++) {
+                if (strcmp(value->name, parameters[j]->name) == 0) {
+                    SymbolTableEntry* decl = compiler->AddTempVariable(parameters[j]->type, function->name);
+                    entries.push_back(create_assign(decl->name, op1));
+
+                    op1.value = decl->name;
+                    op1.type = decl->type;
+                    break;
+                }
+            }
+        }
+
+        for (int32_t k = 0; k < function->parameter; k++) {
+            // Parameter passed at its own position is not changed
+            if (values[k].exp_type == ExpressionType::Variable && strcmp(values[k].value, parameters[k]->name) == 0) {
+                continue;
+            }
+
+            entries.push_back(create_assign(parameters[k]->name, values[k]));
+        }
+
+        // Jump to the beginning of the function reuses its call frame
+        InstructionEntry* jump = new InstructionEntry();
+        jump->type = InstructionType::Goto;
+        jump->goto_statement.ip = function_begin_ip;
+        entries.push_back(jump);
+
+        // Instructions replace "push" and "call" instructions, the rest is inserted before the jump
+        int32_t count = (int32_t)entries.size();
+        std::vector<InstructionEntry*> inserted;
+        for (int32_t k = 0; k < count - 1; k++) {
+            if (k < function->parameter) {
+                InstructionEntry* i = instructions[push_ip + k];
+                InstructionEntry* next = i->next;
+                *i = *entries[k];
+                i->next = next;
+                delete entries[k];
+            } else {
+                inserted.push_back(entries[k]);
+            }
+        }
+
+        for (int32_t k = count - 1; k < function->parameter; k++) {
+            instructions[push_ip + k]->type = InstructionType::Nop;
+        }
+
+        InstructionEntry* next = call->next;
+        *call = *jump;
+        call->next = next;
+        delete jump;
+
+        if (!inserted.empty()) {
+            InsertInstructions(ip, inserted, nullptr);
+            ip += (int32_t)inserted.size();
+        }
+
+        converted++;
+    }
+
+    if (converted > 0) {
+        CreateControlFlowGraph();
+    }
+
+    return converted;
+}
+
+void Optimizer::SelectFunction(SymbolTableEntry* function, int32_t end_ip)
+{
+    this->function = function;
+    function_begin_ip = function->ip;
+    function_end_ip = end_ip;
+
+    function_symbols.clear();
+    function_labels.clear();
+    scalars.clear();
+    scalar_indices.clear();
+
+    // Local variables hide static variables with the same name
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (!symbol->parent) {
+            if (symbol->type.base != BaseSymbolType::Function &&
+                symbol->type.base != BaseSymbolType::FunctionPrototype &&
+                symbol->type.base != BaseSymbolType::EntryPoint &&
+                symbol->type.base != BaseSymbolType::SharedFunction) {
+
+                function_symbols.emplace(symbol->name, symbol);
+            }
+        } else if (strcmp(symbol->parent, function->name) == 0) {
+            if (symbol->type.base == BaseSymbolType::Label) {
+                function_labels[symbol->name] = symbol->ip;
+            } else {
+                function_symbols[symbol->name] = symbol;
+            }
+        }
+
+        symbol = symbol->next;
+    }
+
+    // Variables with taken address can be changed indirectly (through pointer)
+    referenced_symbols.clear();
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type != InstructionType::Assign || i->assignment.type != AssignType::None ||
+            i->assignment.dst_index.value || i->assignment.op1.exp_type != ExpressionType::Variable ||
+            i->assignment.op1.index.value) {
+            continue;
+        }
+
+        SymbolTableEntry* dst = FindSymbolByName(i->assignment.dst_value);
+        SymbolTableEntry* op1 = FindSymbolByName(i->assignment.op1.value);
+        if (dst && op1 && dst->type.pointer > op1->type.pointer) {
+            referenced_symbols.insert(op1->name);
+        }
+    }
+
+    symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->parent && strcmp(symbol->parent, function->name) == 0 &&
+            symbol->size == 0 && IsScalarType(symbol->type) &&
+            referenced_symbols.find(symbol->name) == referenced_symbols.end()) {
+
+            scalar_indices[symbol->name] = (int32_t)scalars.size();
+            scalars.push_back(symbol);
+        }
+
+        symbol = symbol->next;
+    }
+}
+
+void Optimizer::CreateControlFlowGraph()
+{
+    blocks.clear();
+    ip_to_block.assign(function_end_ip - function_begin_ip, -1);
+
+    // Find the first instruction of each block
+    std::vector<bool> is_leader(function_end_ip - function_begin_ip + 1, false);
+    is_leader[0] = true;
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        int32_t target_ip = -1;
+        switch (i->type) {
+            case InstructionType::Goto: target_ip = i->goto_statement.ip; break;
+            case InstructionType::If: target_ip = i->if_statement.ip; break;
+            case InstructionType::GotoLabel: target_ip = FindLabelIp(i->goto_label_statement.label); break;
+            case InstructionType::Switch: break;
+            case InstructionType::Return: break;
+
+            default: continue;
+        }
+
+        if (target_ip >= function_begin_ip && target_ip < function_end_ip) {
+            is_leader[target_ip - function_begin_ip] = true;
+        }
+
+        is_leader[ip + 1 - function_begin_ip] = true;
+    }
+
+    std::unordered_map<std::string, int32_t>::iterator it = function_labels.begin();
+    while (it != function_labels.end()) {
+        if (it->second >= function_begin_ip && it->second < function_end_ip) {
+            is_leader[it->second - function_begin_ip] = true;
+        }
+
+        ++it;
+    }
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        if (is_leader[ip - function_begin_ip]) {
+            if (!blocks.empty()) {
+                blocks.back().end_ip = ip;
+            }
+
+            blocks.push_back({ ip, function_end_ip });
+        }
+
+        ip_to_block[ip - function_begin_ip] = (int32_t)blocks.size() - 1;
+    }
+
+    // Connect blocks, jumps outside of the function leave it
+    for (size_t j = 0; j < blocks.size(); j++) {
+        InstructionEntry* last = instructions[blocks[j].end_ip - 1];
+
+        bool falls_through = true;
+        int32_t target_ip = -1;
+        switch (last->type) {
+            case InstructionType::Goto: target_ip = last->goto_statement.ip; falls_through = false; break;
+            case InstructionType::GotoLabel: target_ip = FindLabelIp(last->goto_label_statement.label); falls_through = false; break;
+            case InstructionType::If: target_ip = last->if_statement.ip; break;
+            case InstructionType::Return: falls_through = false; break;
+
+            case InstructionType::Switch: {
+                // Every entry of the jump table is a separate block
+                for (uint32_t k = 0; k <= last->switch_statement.count; k++) {
+                    int32_t entry = FindBlockByIp(blocks[j].end_ip + k);
+                    if (entry >= 0) {
+                        blocks[j].successors.push_back(entry);
+                    }
+                }
+                falls_through = false;
+                break;
+            }
+        }
+
+        int32_t target = FindBlockByIp(target_ip);
+        if (target >= 0) {
+            blocks[j].successors.push_back(target);
+        }
+
+        if (falls_through) {
+            int32_t next = FindBlockByIp(blocks[j].end_ip);
+            if (next >= 0 && next != target) {
+                blocks[j].successors.push_back(next);
+            }
+        }
+
+        for (size_t k = 0; k < blocks[j].successors.size(); k++) {
+            blocks[blocks[j].successors[k]].predecessors.push_back((int32_t)j);
+        }
+    }
+}
+
+SymbolTableEntry* Optimizer::FindSymbolByName(const char* name)
+{
+    if (!name) {
+        return nullptr;
+    }
+
+    std::unordered_map<std::string, SymbolTableEntry*>::iterator it = function_symbols.find(name);
+    return (it != function_symbols.end() ? it->second : nullptr);
+}
+
+int32_t Optimizer::FindScalarByName(const char* name)
+{
+    if (!name) {
+        return -1;
+    }
+
+    std::unordered_map<std::string, int32_t>::iterator it = scalar_indices.find(name);
+    return (it != scalar_indices.end() ? it->second : -1);
+}
+
+int32_t Optimizer::FindLabelIp(const char* name)
+{
+    std::unordered_map<std::string, int32_t>::iterator it = function_labels.find(name);
+    return (it != function_labels.end() ? it->second : -1);
+}
+
+int32_t Optimizer::FindBlockByIp(int32_t ip)
+{
+    if (ip < function_begin_ip || ip >= function_end_ip) {
+        return -1;
+    }
+
+    return ip_to_block[ip - function_begin_ip];
+}
+
+int32_t Optimizer::PropagateConstants()
+{
+    size_t scalar_count = scalars.size();
+
+    std::vector<std::vector<OptimizerValue>> block_in(blocks.size(),
+        std::vector<OptimizerValue>(scalar_count, { OptimizerValueState::Undefined, 0 }));
+    std::vector<std::vector<OptimizerValue>> block_out(blocks.size());
+    std::vector<bool> is_executable(blocks.size(), false);
+    std::set<std::pair<int32_t, int32_t>> executable_edges;
+
+    // Parameters and uninitialized variables are unknown at the beginning of the function
+    for (size_t j = 0; j < scalar_count; j++) {
+        block_in[0][j].state = OptimizerValueState::Overdefined;
+    }
+
+    std::vector<int32_t> worklist;
+    worklist.push_back(0);
+    is_executable[0] = true;
+
+    while (!worklist.empty()) {
+        int32_t block = worklist.back();
+        worklist.pop_back();
+
+        std::vector<OptimizerValue> values = block_in[block];
+        for (int32_t ip = blocks[block].begin_ip; ip < blocks[block].end_ip; ip++) {
+            PropagateInstruction(instructions[ip], values);
+        }
+
+        block_out[block] = values;
+
+        // Follow only branches, that can be taken with known values
+        std::vector<int32_t> successors;
+
+        InstructionEntry* last = instructions[blocks[block].end_ip - 1];
+        if (last->type == InstructionType::If) {
+            OptimizerValue condition = EvaluateIf(last, values);
+
+            int32_t target = FindBlockByIp(last->if_statement.ip);
+            int32_t next = FindBlockByIp(blocks[block].end_ip);
+
+            switch (condition.state) {
+                case OptimizerValueState::Constant: {
+                    int32_t taken = (condition.value ? target : next);
+                    if (taken >= 0) {
+                        successors.push_back(taken);
+                    }
+                    break;
+                }
+                case OptimizerValueState::Overdefined: {
+                    successors = blocks[block].successors;
+                    break;
+                }
+            }
+        } else {
+            successors = blocks[block].successors;
+        }
+
+        for (size_t j = 0; j < successors.size(); j++) {
+            int32_t successor = successors[j];
+            executable_edges.insert({ block, successor });
+
+            // Values at the beginning of the function never change
+            if (successor == 0) {
+                continue;
+            }
+
+            std::vector<OptimizerValue> merged(scalar_count, { OptimizerValueState::Undefined, 0 });
+            std::vector<int32_t>& predecessors = blocks[successor].predecessors;
+            for (size_t k = 0; k < predecessors.size(); k++) {
+                if (executable_edges.find({ predecessors[k], successor }) == executable_edges.end()) {
+                    continue;
+                }
+
+                std::vector<OptimizerValue>& out = block_out[predecessors[k]];
+                for (size_t l = 0; l < scalar_count; l++) {
+                    merged[l] = MeetValues(merged[l], out[l]);
+                }
+            }
+
+            if (!is_executable[successor] || merged != block_in[successor]) {
+                is_executable[successor] = true;
+                block_in[successor] = merged;
+
+                if (std::find(worklist.begin(), worklist.end(), successor) == worklist.end()) {
+                    worklist.push_back(successor);
+                }
+            }
+        }
+    }
+
+    // Rewrite instructions of reachable blocks with final values,
+    // unreachable blocks are left untouched
+    int32_t folded = 0;
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (!is_executable[j]) {
+            continue;
+        }
+
+        std::vector<OptimizerValue>& values = block_in[j];
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            if (FoldInstruction(instructions[ip], values)) {
+                folded++;
+            }
+
+            PropagateInstruction(instructions[ip], values);
+        }
+    }
+
+    return folded;
+}
+
+int32_t Optimizer::RemoveUnreachableBlocks()
+{
+    std::vector<bool> is_reachable;
+    FindReachableBlocks(is_reachable);
+
+    int32_t removed = 0;
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (is_reachable[j]) {
+            continue;
+        }
+
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+
+            // Emitter requires "return" as the last instruction of function with return value
+            if (i->type == InstructionType::Nop ||
+                (i->type == InstructionType::Return && ip == function_end_ip - 1)) {
+                continue;
+            }
+
+            i->type = InstructionType::Nop;
+            removed++;
+        }
+
+        // Removed block doesn't continue to its successors anymore
+        std::vector<int32_t>& successors = blocks[j].successors;
+        for (size_t k = 0; k < successors.size(); k++) {
+            std::vector<int32_t>& predecessors = blocks[successors[k]].predecessors;
+            predecessors.erase(std::remove(predecessors.begin(), predecessors.end(), (int32_t)j), predecessors.end());
+        }
+        successors.clear();
+    }
+
+    return removed;
+}
+
+void Optimizer::FindReachableBlocks(std::vector<bool>& is_reachable)
+{
+    is_reachable.assign(blocks.size(), false);
+
+    std::vector<int32_t> worklist;
+    worklist.push_back(0);
+    is_reachable[0] = true;
+
+    while (!worklist.empty()) {
+        int32_t block = worklist.back();
+        worklist.pop_back();
+
+        std::vector<int32_t>& successors = blocks[block].successors;
+        for (size_t j = 0; j < successors.size(); j++) {
+            if (!is_reachable[successors[j]]) {
+                is_reachable[successors[j]] = true;
+                worklist.push_back(successors[j]);
+            }
+        }
+    }
+}
+
+int32_t Optimizer::RemoveDeadAssignments()
+{
+    int32_t removed = 0;
+
+    std::vector<std::vector<bool>> live_in, live_out;
+    std::vector<int32_t> uses;
+
+    // Variable is needed only if it's read by an instruction with side effects
+    // or by an assignment to another needed variable, so variables that only
+    // feed themselves (e.g. unused counters in loops) are removed too
+    {
+        std::vector<bool> is_needed(scalars.size(), false);
+        std::vector<int32_t> worklist;
+
+        std::vector<std::vector<int32_t>> def_ips(scalars.size());
+        for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+
+            int32_t def = GetInstructionDefinition(i);
+            if (def >= 0 && i->type == InstructionType::Assign) {
+                def_ips[def].push_back(ip);
+                continue;
+            }
+
+            GetInstructionUses(i, uses);
+            for (size_t k = 0; k < uses.size(); k++) {
+                if (!is_needed[uses[k]]) {
+                    is_needed[uses[k]] = true;
+                    worklist.push_back(uses[k]);
+                }
+            }
+        }
+
+        while (!worklist.empty()) {
+            int32_t var = worklist.back();
+            worklist.pop_back();
+
+            for (size_t j = 0; j < def_ips[var].size(); j++) {
+                GetInstructionUses(instructions[def_ips[var][j]], uses);
+                for (size_t k = 0; k < uses.size(); k++) {
+                    if (!is_needed[uses[k]]) {
+                        is_needed[uses[k]] = true;
+                        worklist.push_back(uses[k]);
+                    }
+                }
+            }
+        }
+
+        for (size_t j = 0; j < scalars.size(); j++) {
+            if (is_needed[j]) {
+                continue;
+            }
+
+            for (size_t k = 0; k < def_ips[j].size(); k++) {
+                instructions[def_ips[j][k]]->type = InstructionType::Nop;
+                removed++;
+            }
+        }
+    }
+
+    // Removed assignment can make its operands dead too, so repeat until nothing changes
+    bool changed;
+    do {
+        changed = false;
+
+        ComputeLiveVariables(live_in, live_out);
+
+        for (size_t j = 0; j < blocks.size(); j++) {
+            std::vector<bool> live = live_out[j];
+
+            for (int32_t ip = blocks[j].end_ip - 1; ip >= blocks[j].begin_ip; ip--) {
+                InstructionEntry* i = instructions[ip];
+
+                int32_t def = GetInstructionDefinition(i);
+                if (def >= 0) {
+                    if (i->type == InstructionType::Assign && !live[def]) {
+                        // Assignments don't have any side effects
+                        i->type = InstructionType::Nop;
+                        removed++;
+                        changed = true;
+                        continue;
+                    }
+
+                    live[def] = false;
+                }
+
+                GetInstructionUses(i, uses);
+                for (size_t k = 0; k < uses.size(); k++) {
+                    live[uses[k]] = true;
+                }
+            }
+        }
+    } while (changed);
+
+    return removed;
+}
+
+int32_t Optimizer::RemoveDeadStores()
+{
+    int32_t removed = 0;
+
+    // Static variables, that are overwritten later in the block without being read
+    std::set<SymbolTableEntry*> overwritten;
+
+    auto is_tracked_static = [&](SymbolTableEntry* symbol) {
+        return (symbol && !symbol->parent && symbol->size == 0 && IsScalarType(symbol->type) &&
+                referenced_statics.find(symbol->name) == referenced_statics.end());
+    };
+
+    auto read_operand = [&](const char* value, ExpressionType exp_type) {
+        if (value && exp_type == ExpressionType::Variable) {
+            SymbolTableEntry* symbol = FindSymbolByName(value);
+            if (symbol) {
+                overwritten.erase(symbol);
+            }
+        }
+    };
+
+    auto read_index = [&](const InstructionOperandIndex& index) {
+        read_operand(index.value, index.exp_type);
+    };
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        // Static variables are visible to other functions, so they are live at the end of each block
+        overwritten.clear();
+
+        for (int32_t ip = blocks[j].end_ip - 1; ip >= blocks[j].begin_ip; ip--) {
+            InstructionEntry* i = instructions[ip];
+
+            switch (i->type) {
+                case InstructionType::Assign: {
+                    if (!i->assignment.dst_index.value) {
+                        SymbolTableEntry* dst = FindSymbolByName(i->assignment.dst_value);
+                        if (is_tracked_static(dst)) {
+                            if (overwritten.find(dst) != overwritten.end()) {
+                                // Assignments don't have any side effects
+                                i->type = InstructionType::Nop;
+                                removed++;
+                                continue;
+                            }
+
+                            overwritten.insert(dst);
+                        }
+                    }
+
+                    read_index(i->assignment.dst_index);
+                    read_operand(i->assignment.op1.value, i->assignment.op1.exp_type);
+                    read_index(i->assignment.op1.index);
+
+                    if (i->assignment.type != AssignType::None && i->assignment.type != AssignType::Negation) {
+                        read_operand(i->assignment.op2.value, i->assignment.op2.exp_type);
+                        read_index(i->assignment.op2.index);
+                    }
+                    break;
+                }
+                case InstructionType::If: {
+                    read_operand(i->if_statement.op1.value, i->if_statement.op1.exp_type);
+                    read_index(i->if_statement.op1.index);
+                    read_operand(i->if_statement.op2.value, i->if_statement.op2.exp_type);
+                    read_index(i->if_statement.op2.index);
+                    break;
+                }
+                case InstructionType::Switch: {
+                    read_operand(i->switch_statement.op.value, i->switch_statement.op.exp_type);
+                    read_index(i->switch_statement.op.index);
+                    break;
+                }
+                case InstructionType::Push: {
+                    read_operand(i->push_statement.symbol->name, i->push_statement.symbol->exp_type);
+                    break;
+                }
+                case InstructionType::Call:
+                case InstructionType::Return: {
+                    // Called function or caller can read any static variable
+                    overwritten.clear();
+                    break;
+                }
+            }
+        }
+    }
+
+    return removed;
+}
+
+void Optimizer::FindStaticAccesses(const std::vector<SymbolTableEntry*>& functions)
+{
+    referenced_statics.clear();
+    accessed_statics.clear();
+
+    std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>> call_graph;
+    compiler->ReferenceFunctions(&call_graph);
+
+    for (size_t j = 0; j < functions.size(); j++) {
+        int32_t end_ip = (j + 1 < functions.size() ? functions[j + 1]->ip : (int32_t)instructions.size());
+
+        if (functions[j]->ref_count == 0 || functions[j]->ip >= end_ip) {
+            continue;
+        }
+
+        SelectFunction(functions[j], end_ip);
+
+        std::set<std::string>::iterator it = referenced_symbols.begin();
+        while (it != referenced_symbols.end()) {
+            SymbolTableEntry* symbol = FindSymbolByName(it->c_str());
+            if (symbol && !symbol->parent) {
+                referenced_statics.insert(*it);
+            }
+
+            ++it;
+        }
+
+        std::set<SymbolTableEntry*>& accessed = accessed_statics[functions[j]];
+        for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+            ForEachVariable(instructions[ip], [&](char*& value) {
+                SymbolTableEntry* symbol = FindSymbolByName(value);
+                if (symbol && !symbol->parent) {
+                    accessed.insert(symbol);
+                }
+            });
+        }
+    }
+
+    function = nullptr;
+
+    // Called functions can access static variables too
+    bool changed;
+    do {
+        changed = false;
+
+        for (size_t j = 0; j < functions.size(); j++) {
+            std::set<SymbolTableEntry*>& accessed = accessed_statics[functions[j]];
+            std::vector<SymbolTableEntry*>& callees = call_graph[functions[j]];
+
+            for (size_t k = 0; k < callees.size(); k++) {
+                std::unordered_map<SymbolTableEntry*, std::set<SymbolTableEntry*>>::iterator it = accessed_statics.find(callees[k]);
+                if (it == accessed_statics.end()) {
+                    continue;
+                }
+
+                size_t count = accessed.size();
+                accessed.insert(it->second.begin(), it->second.end());
+                if (accessed.size() != count) {
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+}
+
+int32_t Optimizer::PromoteStatics()
+{
+    // Loads and stores inside of loops are executed repeatedly
+    std::vector<int32_t> weights(function_end_ip - function_begin_ip, 1);
+    bool has_end_jump = false;
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        int32_t target_ip;
+        switch (i->type) {
+            case InstructionType::Goto: target_ip = i->goto_statement.ip; break;
+            case InstructionType::If: target_ip = i->if_statement.ip; break;
+            case InstructionType::GotoLabel: target_ip = FindLabelIp(i->goto_label_statement.label); break;
+
+            default: continue;
+        }
+
+        if (target_ip >= function_begin_ip && target_ip <= ip) {
+            for (int32_t k = target_ip; k <= ip; k++) {
+                weights[k - function_begin_ip] = PromoteStaticLoopWeight;
+            }
+        } else if (target_ip == function_end_ip) {
+            has_end_jump = true;
+        }
+    }
+
+    auto is_accessed_by_call = [&](InstructionEntry* i, SymbolTableEntry* symbol) {
+        std::unordered_map<SymbolTableEntry*, std::set<SymbolTableEntry*>>::iterator it = accessed_statics.find(i->call_statement.target);
+        return (it != accessed_statics.end() && it->second.find(symbol) != it->second.end());
+    };
+
+    // Only scalar static variables without taken address can be promoted
+    std::vector<SymbolTableEntry*> candidates;
+    std::unordered_map<SymbolTableEntry*, int32_t> benefits;
+    std::set<SymbolTableEntry*> written;
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        ForEachVariable(i, [&](char*& value) {
+            SymbolTableEntry* symbol = FindSymbolByName(value);
+            if (!symbol || symbol->parent || symbol->size > 0 || !IsScalarType(symbol->type) ||
+                referenced_statics.find(symbol->name) != referenced_statics.end()) {
+                return;
+            }
+
+            if (benefits.find(symbol) == benefits.end()) {
+                candidates.push_back(symbol);
+            }
+            benefits[symbol]++;
+        });
+
+        if (i->type == InstructionType::Assign && !i->assignment.dst_index.value) {
+            written.insert(FindSymbolByName(i->assignment.dst_value));
+        } else if (i->type == InstructionType::Call && i->call_statement.return_symbol) {
+            written.insert(FindSymbolByName(i->call_statement.return_symbol));
+        }
+    }
+
+    if (candidates.empty()) {
+        return 0;
+    }
+
+    // Values of static variables are not needed anymore, when the entry point returns
+    bool is_entry_point = (function->type.base == BaseSymbolType::EntryPoint);
+
+    // Function can also end by a jump right after its last instruction
+    InstructionEntry* last = instructions[function_end_ip - 1];
+    bool falls_through = (has_end_jump || (last->type != InstructionType::Return && last->type != InstructionType::Goto));
+
+    // Value of static variable is needed at the beginning, if it's read before it's assigned
+    auto is_live_at_entry = [&](SymbolTableEntry* symbol) {
+        for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+
+            int32_t count = 0;
+            ForEachVariable(i, [&](char*& value) {
+                if (strcmp(value, symbol->name) == 0) {
+                    count++;
+                }
+            });
+
+            switch (i->type) {
+                case InstructionType::Nop: {
+                    break;
+                }
+                case InstructionType::Assign: {
+                    if (!i->assignment.dst_index.value && strcmp(i->assignment.dst_value, symbol->name) == 0) {
+                        return (count > 1);
+                    }
+                    if (count > 0) {
+                        return true;
+                    }
+                    break;
+                }
+                case InstructionType::Push: {
+                    if (count > 0) {
+                        return true;
+                    }
+                    break;
+                }
+                case InstructionType::Call: {
+                    if (is_accessed_by_call(i, symbol)) {
+                        return true;
+                    }
+                    if (count > 0) {
+                        return false;
+                    }
+                    break;
+                }
+
+                default: {
+                    // Value can be read after the jump
+                    return true;
+                }
+            }
+        }
+
+        return true;
+    };
+
+    auto create_assign = [&](const char* dst, const char* op1, SymbolType type) {
+        InstructionEntry* i = new InstructionEntry();
+        i->type = InstructionType::Assign;
+        i->assignment.type = AssignType::None;
+        i->assignment.dst_value = (char*)dst;
+        i->assignment.op1.value = (char*)op1;
+        i->assignment.op1.type = type;
+        i->assignment.op1.exp_type = ExpressionType::Variable;
+        return i;
+    };
+
+    // Instructions are inserted later, so IPs of all candidates are still valid,
+    // loads are skipped by jumps to the same IP, stores are executed by them
+    struct Insertion {
+        int32_t ip;
+        bool is_load;
+        InstructionEntry* entry;
+    };
+    std::vector<Insertion> insertions;
+
+    int32_t promoted = 0;
+
+    for (size_t j = 0; j < candidates.size(); j++) {
+        SymbolTableEntry* symbol = candidates[j];
+        bool is_written = (written.find(symbol) != written.end());
+
+        // Value is loaded at the beginning only if it's not assigned first, and it's stored back only if it was changed,
+        // local variable is not kept in register across jumps either, so each reference saves only the longer encoding
+        // and it allows other optimizations to track the value
+        bool is_live = is_live_at_entry(symbol);
+
+        int32_t cost = (is_live ? weights[0] : 0);
+        for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+            int32_t weight = weights[ip - function_begin_ip];
+
+            if (i->type == InstructionType::Call && is_accessed_by_call(i, symbol)) {
+                // Unchanged value doesn't have to be stored before the call, only reloaded after it
+                cost += (is_written ? 2 : 1) * weight;
+            } else if (i->type == InstructionType::Return && is_written && !is_entry_point) {
+                cost += weight;
+            }
+        }
+        if (falls_through && is_written && !is_entry_point) {
+            cost += weights[function_end_ip - 1 - function_begin_ip];
+        }
+
+        if (benefits[symbol] <= cost * PromoteStaticLoadCost) {
+            continue;
+        }
+
+        SymbolTableEntry* decl = compiler->AddTempVariable(symbol->type, function->name);
+        decl->is_temp = false;
+
+        if (is_live) {
+            insertions.push_back({ function_begin_ip, true, create_assign(decl->name, symbol->name, symbol->type) });
+        }
+
+        for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+
+            if (i->type == InstructionType::Call && is_accessed_by_call(i, symbol)) {
+                // Called function works with the static variable directly
+                if (is_written) {
+                    insertions.push_back({ ip, false, create_assign(symbol->name, decl->name, symbol->type) });
+                }
+
+                if (!i->call_statement.return_symbol || strcmp(i->call_statement.return_symbol, symbol->name) != 0) {
+                    insertions.push_back({ ip + 1, true, create_assign(decl->name, symbol->name, symbol->type) });
+                }
+            } else if (i->type == InstructionType::Return && is_written && !is_entry_point) {
+                insertions.push_back({ ip, false, create_assign(symbol->name, decl->name, symbol->type) });
+            }
+
+            ForEachVariable(i, [&](char*& value) {
+                if (strcmp(value, symbol->name) == 0) {
+                    value = decl->name;
+                }
+            });
+        }
+
+        if (falls_through && is_written && !is_entry_point) {
+            insertions.push_back({ function_end_ip, false, create_assign(symbol->name, decl->name, symbol->type) });
+        }
+
+        promoted++;
+    }
+
+    if (promoted == 0) {
+        return 0;
+    }
+
+    std::stable_sort(insertions.begin(), insertions.end(), [](const Insertion& a, const Insertion& b) {
+        return (a.ip != b.ip ? a.ip > b.ip : (!a.is_load && b.is_load));
+    });
+
+    for (size_t j = 0; j < insertions.size(); j++) {
+        int32_t ip = insertions[j].ip;
+        bool is_end = (ip == function_end_ip);
+
+        InsertInstructions(ip, { insertions[j].entry }, nullptr);
+
+        // Jumps from other functions can target only the beginning of the next function
+        for (int32_t k = 0; k < (int32_t)instructions.size(); k++) {
+            InstructionEntry* i = instructions[k];
+
+            int32_t* target_ip;
+            switch (i->type) {
+                case InstructionType::Goto: target_ip = &i->goto_statement.ip; break;
+                case InstructionType::If: target_ip = &i->if_statement.ip; break;
+
+                default: continue;
+            }
+
+            bool is_inside = (k >= function_begin_ip && k < function_end_ip);
+            if (*target_ip == ip && (is_inside ? insertions[j].is_load : is_end)) {
+                (*target_ip)++;
+            }
+        }
+
+        SymbolTableEntry* symbol = compiler->GetSymbols();
+        while (symbol) {
+            if (symbol->ip == ip && symbol != function) {
+                bool is_inside = (symbol->parent && strcmp(symbol->parent, function->name) == 0);
+                if (is_inside ? insertions[j].is_load : is_end) {
+                    symbol->ip++;
+                }
+            }
+
+            symbol = symbol->next;
+        }
+    }
+
+    // Labels were moved too, so all function symbols have to be collected again
+    SelectFunction(function, function_end_ip);
+    CreateControlFlowGraph();
+
+    return promoted;
+}
+
+int32_t Optimizer::CoalesceTemporaryMoves()
+{
+    int32_t coalesced = 0;
+
+    std::vector<std::vector<bool>> live_in, live_out;
+    ComputeLiveVariables(live_in, live_out);
+
+    std::vector<int32_t> uses;
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        std::vector<bool> live = live_out[j];
+
+        // Walk backwards, so liveness after each move is known
+        for (int32_t ip = blocks[j].end_ip - 1; ip >= blocks[j].begin_ip; ip--) {
+            InstructionEntry* i = instructions[ip];
+
+            InstructionEntry* def_i = nullptr;
+            int32_t temp = -1;
+
+            if (i->type == InstructionType::Assign && i->assignment.type == AssignType::None &&
+                !i->assignment.dst_index.value && i->assignment.op1.exp_type == ExpressionType::Variable &&
+                !i->assignment.op1.index.value) {
+
+                temp = FindScalarByName(i->assignment.op1.value);
+            }
+
+            if (temp >= 0 && !live[temp]) {
+                // Find the previous instruction in the same block
+                int32_t def_ip = ip - 1;
+                while (def_ip >= blocks[j].begin_ip && instructions[def_ip]->type == InstructionType::Nop) {
+                    def_ip--;
+                }
+
+                if (def_ip >= blocks[j].begin_ip && GetInstructionDefinition(instructions[def_ip]) == temp) {
+                    def_i = instructions[def_ip];
+                }
+            }
+
+            SymbolTableEntry* dst = (def_i ? FindSymbolByName(i->assignment.dst_value) : nullptr);
+            if (dst && dst != scalars[temp] && dst->size == 0 && dst->type == scalars[temp]->type) {
+                bool can_coalesce = true;
+
+                if (def_i->type == InstructionType::Assign) {
+                    // Emitters of these operations don't expect destination to be one of the operands
+                    if (def_i->assignment.type == AssignType::Multiply || def_i->assignment.type == AssignType::Divide ||
+                        def_i->assignment.type == AssignType::Remainder || def_i->assignment.type == AssignType::ShiftLeft ||
+                        def_i->assignment.type == AssignType::ShiftRight) {
+
+                        if ((def_i->assignment.op1.value && strcmp(def_i->assignment.op1.value, dst->name) == 0) ||
+                            (def_i->assignment.op2.value && strcmp(def_i->assignment.op2.value, dst->name) == 0)) {
+                            can_coalesce = false;
+                        }
+                    }
+                }
+
+                if (can_coalesce) {
+                    // Compute the value directly to the destination of the move
+                    if (def_i->type == InstructionType::Assign) {
+                        def_i->assignment.dst_value = i->assignment.dst_value;
+                    } else {
+                        def_i->call_statement.return_symbol = i->assignment.dst_value;
+                    }
+
+                    i->type = InstructionType::Nop;
+                    coalesced++;
+
+                    // Continue with the rewritten definition
+                    continue;
+                }
+            }
+
+            int32_t def = GetInstructionDefinition(i);
+            if (def >= 0) {
+                live[def] = false;
+            }
+
+            GetInstructionUses(i, uses);
+            for (size_t k = 0; k < uses.size(); k++) {
+                live[uses[k]] = true;
+            }
+        }
+    }
+
+    return coalesced;
+}
+
+int32_t Optimizer::PropagateCopies()
+{
+    size_t scalar_count = scalars.size();
+
+    // Find all copies between tracked variables of the same type
+    std::vector<OptimizerCopy> copies;
+    std::vector<int32_t> copy_at_ip(function_end_ip - function_begin_ip, -1);
+    std::vector<std::vector<int32_t>> var_copies(scalar_count);
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type != InstructionType::Assign || i->assignment.type != AssignType::None ||
+            i->assignment.dst_index.value || i->assignment.op1.exp_type != ExpressionType::Variable ||
+            i->assignment.op1.index.value) {
+            continue;
+        }
+
+        int32_t dst = FindScalarByName(i->assignment.dst_value);
+        int32_t src = FindScalarByName(i->assignment.op1.value);
+        if (dst < 0 || src < 0 || dst == src || scalars[dst]->type != scalars[src]->type) {
+            continue;
+        }
+
+        int32_t id = (int32_t)copies.size();
+        copies.push_back({ dst, src });
+        copy_at_ip[ip - function_begin_ip] = id;
+        var_copies[dst].push_back(id);
+        var_copies[src].push_back(id);
+    }
+
+    if (copies.empty()) {
+        return 0;
+    }
+
+    // Emitter expects that temporary variables don't live across jumps,
+    // so copies of them are propagated only inside the block
+    auto transfer = [&](int32_t block, std::vector<bool>& available) {
+        for (int32_t ip = blocks[block].begin_ip; ip < blocks[block].end_ip; ip++) {
+            int32_t def = GetInstructionDefinition(instructions[ip]);
+            if (def >= 0) {
+                for (size_t k = 0; k < var_copies[def].size(); k++) {
+                    available[var_copies[def][k]] = false;
+                }
+            }
+
+            int32_t copy = copy_at_ip[ip - function_begin_ip];
+            if (copy >= 0) {
+                available[copy] = true;
+            }
+        }
+
+        for (size_t k = 0; k < copies.size(); k++) {
+            if (scalars[copies[k].src]->is_temp) {
+                available[k] = false;
+            }
+        }
+    };
+
+    // Copy is available only if it reaches the block on all paths
+    std::vector<std::vector<bool>> block_in(blocks.size(), std::vector<bool>(copies.size(), true));
+    std::vector<std::vector<bool>> block_out(blocks.size(), std::vector<bool>(copies.size(), true));
+    block_in[0].assign(copies.size(), false);
+
+    bool changed;
+    do {
+        changed = false;
+
+        for (size_t j = 0; j < blocks.size(); j++) {
+            if (j != 0) {
+                std::vector<int32_t>& predecessors = blocks[j].predecessors;
+                std::vector<bool> in(copies.size(), !predecessors.empty());
+                for (size_t k = 0; k < predecessors.size(); k++) {
+                    std::vector<bool>& out = block_out[predecessors[k]];
+                    for (size_t l = 0; l < copies.size(); l++) {
+                        if (!out[l]) {
+                            in[l] = false;
+                        }
+                    }
+                }
+                block_in[j] = in;
+            }
+
+            std::vector<bool> out = block_in[j];
+            transfer((int32_t)j, out);
+            if (out != block_out[j]) {
+                block_out[j] = out;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    // Replace uses of copied variables with their sources
+    int32_t propagated = 0;
+
+    auto replace = [&](char*& value, ExpressionType exp_type, const char* other, const std::vector<bool>& available) {
+        if (!value || exp_type != ExpressionType::Variable) {
+            return;
+        }
+
+        int32_t var = FindScalarByName(value);
+        if (var < 0) {
+            return;
+        }
+
+        for (size_t k = 0; k < var_copies[var].size(); k++) {
+            int32_t copy = var_copies[var][k];
+            if (!available[copy] || copies[copy].dst != var) {
+                continue;
+            }
+
+            char* src_name = scalars[copies[copy].src]->name;
+
+            // Both operands of the same instruction must be different variables
+            if (other && strcmp(other, src_name) == 0) {
+                return;
+            }
+
+            value = src_name;
+            propagated++;
+            return;
+        }
+    };
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        std::vector<bool> available = block_in[j];
+
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+
+            switch (i->type) {
+                case InstructionType::Assign: {
+                    InstructionOperand& op1 = i->assignment.op1;
+                    InstructionOperand& op2 = i->assignment.op2;
+
+                    bool has_two_operands = (i->assignment.type != AssignType::None && i->assignment.type != AssignType::Negation);
+
+                    replace(i->assignment.dst_index.value, i->assignment.dst_index.exp_type, nullptr, available);
+                    replace(op1.index.value, op1.index.exp_type, nullptr, available);
+
+                    if (!op1.index.value) {
+                        replace(op1.value, op1.exp_type, (has_two_operands ? op2.value : nullptr), available);
+                    }
+
+                    if (has_two_operands) {
+                        replace(op2.index.value, op2.index.exp_type, nullptr, available);
+
+                        if (!op2.index.value) {
+                            replace(op2.value, op2.exp_type, op1.value, available);
+                        }
+                    }
+                    break;
+                }
+                case InstructionType::If: {
+                    InstructionOperand& op1 = i->if_statement.op1;
+                    InstructionOperand& op2 = i->if_statement.op2;
+
+                    replace(op1.index.value, op1.index.exp_type, nullptr, available);
+                    replace(op2.index.value, op2.index.exp_type, nullptr, available);
+
+                    if (!op1.index.value) {
+                        replace(op1.value, op1.exp_type, op2.value, available);
+                    }
+                    if (!op2.index.value) {
+                        replace(op2.value, op2.exp_type, op1.value, available);
+                    }
+                    break;
+                }
+                case InstructionType::Switch: {
+                    InstructionOperand& op = i->switch_statement.op;
+                    if (!op.index.value) {
+                        replace(op.value, op.exp_type, nullptr, available);
+                    }
+                    break;
+                }
+                case InstructionType::Push: {
+                    SymbolTableEntry* symbol = i->push_statement.symbol;
+                    replace(symbol->name, symbol->exp_type, nullptr, available);
+                    break;
+                }
+                case InstructionType::Return: {
+                    InstructionOperand& op = i->return_statement.op;
+                    if (!op.index.value) {
+                        replace(op.value, op.exp_type, nullptr, available);
+                    }
+                    break;
+                }
+            }
+
+            int32_t def = GetInstructionDefinition(i);
+            if (def >= 0) {
+                for (size_t k = 0; k < var_copies[def].size(); k++) {
+                    available[var_copies[def][k]] = false;
+                }
+            }
+
+            int32_t copy = copy_at_ip[ip - function_begin_ip];
+            if (copy >= 0) {
+                available[copy] = true;
+            }
+        }
+    }
+
+    return propagated;
+}
+
+int32_t Optimizer::EliminateCommonSubexpressions()
+{
+    size_t scalar_count = scalars.size();
+
+    // Find all expressions together with variables that hold their results,
+    // the same expression can be held by more variables
+    std::vector<OptimizerExpression> expressions;
+    std::vector<int32_t> expression_at_ip(function_end_ip - function_begin_ip, -1);
+    std::vector<std::vector<int32_t>> var_expressions(scalar_count);
+    std::vector<int32_t> loads;
+
+    std::unordered_map<std::string, int32_t> expression_indices;
+    std::unordered_map<std::string, std::vector<int32_t>> same_expressions;
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        OptimizerExpression expression;
+        if (!GetAssignExpression(i, expression)) {
+            continue;
+        }
+
+        expression.holder = FindScalarByName(i->assignment.dst_value);
+
+        // Assignment like "a = a + b" overwrites its own operand
+        if (std::find(expression.operands.begin(), expression.operands.end(), expression.holder) != expression.operands.end()) {
+            continue;
+        }
+
+        std::string name = expression.key + "|" + std::to_string(expression.holder);
+        std::unordered_map<std::string, int32_t>::iterator it = expression_indices.find(name);
+        if (it != expression_indices.end()) {
+            expression_at_ip[ip - function_begin_ip] = it->second;
+            continue;
+        }
+
+        int32_t id = (int32_t)expressions.size();
+        expression_indices[name] = id;
+        same_expressions[expression.key].push_back(id);
+        expression_at_ip[ip - function_begin_ip] = id;
+
+        var_expressions[expression.holder].push_back(id);
+        for (size_t k = 0; k < expression.operands.size(); k++) {
+            var_expressions[expression.operands[k]].push_back(id);
+        }
+        if (expression.base) {
+            loads.push_back(id);
+        }
+
+        expressions.push_back(expression);
+    }
+
+    if (expressions.empty()) {
+        return 0;
+    }
+
+    auto transfer_instruction = [&](int32_t ip, std::vector<bool>& available) {
+        InstructionEntry* i = instructions[ip];
+
+        int32_t def = GetInstructionDefinition(i);
+        if (def >= 0) {
+            for (size_t k = 0; k < var_expressions[def].size(); k++) {
+                available[var_expressions[def][k]] = false;
+            }
+        }
+
+        // Any store to memory or call can change loaded values
+        bool kill_loads = (i->type == InstructionType::Call ||
+            (i->type == InstructionType::Assign && i->assignment.dst_index.value));
+
+        for (size_t k = 0; k < loads.size(); k++) {
+            if (kill_loads || (i->type == InstructionType::Assign &&
+                strcmp(expressions[loads[k]].base, i->assignment.dst_value) == 0)) {
+
+                available[loads[k]] = false;
+            }
+        }
+
+        int32_t id = expression_at_ip[ip - function_begin_ip];
+        if (id >= 0) {
+            available[id] = true;
+        }
+    };
+
+    // Expression is available only if it was computed on all paths
+    std::vector<std::vector<bool>> block_in(blocks.size(), std::vector<bool>(expressions.size(), true));
+    std::vector<std::vector<bool>> block_out(blocks.size(), std::vector<bool>(expressions.size(), true));
+    block_in[0].assign(expressions.size(), false);
+
+    bool changed;
+    do {
+        changed = false;
+
+        for (size_t j = 0; j < blocks.size(); j++) {
+            if (j != 0) {
+                std::vector<int32_t>& predecessors = blocks[j].predecessors;
+                std::vector<bool> in(expressions.size(), !predecessors.empty());
+                for (size_t k = 0; k < predecessors.size(); k++) {
+                    std::vector<bool>& out = block_out[predecessors[k]];
+                    for (size_t l = 0; l < expressions.size(); l++) {
+                        if (!out[l]) {
+                            in[l] = false;
+                        }
+                    }
+                }
+                block_in[j] = in;
+            }
+
+            std::vector<bool> out = block_in[j];
+            for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+                transfer_instruction(ip, out);
+            }
+
+            if (out != block_out[j]) {
+                block_out[j] = out;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    // Replace recomputed expressions with variables that already hold them
+    int32_t eliminated = 0;
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        std::vector<bool> available = block_in[j];
+        std::vector<bool> is_local(expressions.size(), false);
+
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+
+            int32_t id = expression_at_ip[ip - function_begin_ip];
+            int32_t found = -1;
+            if (id >= 0) {
+                std::vector<int32_t>& same = same_expressions[expressions[id].key];
+                for (size_t k = 0; k < same.size(); k++) {
+                    if (available[same[k]] && (found < 0 || same[k] == id)) {
+                        found = same[k];
+                    }
+                }
+            }
+
+            bool found_is_local = (found >= 0 && is_local[found]);
+
+            transfer_instruction(ip, available);
+            if (id >= 0) {
+                is_local[id] = true;
+            }
+
+            if (found < 0) {
+                continue;
+            }
+
+            SymbolTableEntry* holder = scalars[expressions[found].holder];
+            if (holder->is_temp && !found_is_local) {
+                // Value is held across blocks, so the variable cannot be treated as temp. variable anymore
+                holder->is_temp = false;
+            }
+
+            if (found == id) {
+                // Destination already holds the same value
+                i->type = InstructionType::Nop;
+            } else {
+                i->assignment.type = AssignType::None;
+
+                i->assignment.op1.value = holder->name;
+                i->assignment.op1.type = holder->type;
+                i->assignment.op1.exp_type = ExpressionType::Variable;
+                i->assignment.op1.index.value = nullptr;
+
+                i->assignment.op2.value = nullptr;
+                i->assignment.op2.exp_type = ExpressionType::None;
+                i->assignment.op2.index.value = nullptr;
+            }
+
+            eliminated++;
+        }
+    }
+
+    return eliminated;
+}
+
+int32_t Optimizer::ThreadJumps()
+{
+    int32_t threaded = 0;
+
+    // Jumps that were moved before their source, temporary variables don't live across them
+    std::vector<int32_t> backward_ips;
+
+    auto set_target = [&](int32_t ip, int32_t& target_ip, int32_t new_ip) {
+        if (target_ip > ip && new_ip <= ip) {
+            backward_ips.push_back(ip);
+        }
+
+        target_ip = new_ip;
+        threaded++;
+    };
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        if (i->type == InstructionType::Goto) {
+            int32_t target_ip = FindJumpDestination(i->goto_statement.ip);
+            if (target_ip != i->goto_statement.ip) {
+                set_target(ip, i->goto_statement.ip, target_ip);
+            }
+        } else if (i->type == InstructionType::If) {
+            int32_t target_ip = FindJumpDestination(i->if_statement.ip);
+
+            // Condition with the same operands jumps to the same destination
+            std::set<int32_t> visited;
+            while (target_ip >= function_begin_ip && target_ip < function_end_ip && visited.insert(target_ip).second) {
+                InstructionEntry* target = instructions[target_ip];
+                if (target->type != InstructionType::If ||
+                    !AreOperandsEqual(target->if_statement.op1, i->if_statement.op1) ||
+                    !AreOperandsEqual(target->if_statement.op2, i->if_statement.op2)) {
+                    break;
+                }
+
+                if (target->if_statement.type == i->if_statement.type) {
+                    target_ip = FindJumpDestination(target->if_statement.ip);
+                } else if (target->if_statement.type == GetInvertedCompareType(i->if_statement.type)) {
+                    target_ip = FindJumpDestination(target_ip + 1);
+                } else {
+                    break;
+                }
+            }
+
+            if (target_ip != i->if_statement.ip) {
+                set_target(ip, i->if_statement.ip, target_ip);
+            }
+        }
+    }
+
+    // Jumps that are removed must not be targets of other jumps
+    std::set<int32_t> target_ips;
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        switch (i->type) {
+            case InstructionType::Goto: target_ips.insert(i->goto_statement.ip); break;
+            case InstructionType::If: target_ips.insert(i->if_statement.ip); break;
+        }
+    }
+
+    std::unordered_map<std::string, int32_t>::iterator it = function_labels.begin();
+    while (it != function_labels.end()) {
+        target_ips.insert(it->second);
+        ++it;
+    }
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+
+        if (i->type == InstructionType::Switch) {
+            // Entries of the jump table are never executed in sequence, so they have to stay
+            ip += i->switch_statement.count + 1;
+        } else if (i->type == InstructionType::Goto) {
+            if (i->goto_statement.ip == FindJumpDestination(ip + 1)) {
+                i->type = InstructionType::Nop;
+                threaded++;
+            }
+        } else if (i->type == InstructionType::If) {
+            int32_t next_ip = ip + 1;
+            while (next_ip < function_end_ip && instructions[next_ip]->type == InstructionType::Nop) {
+                next_ip++;
+            }
+
+            if (i->if_statement.ip == FindJumpDestination(next_ip)) {
+                // Both branches lead to the same instruction, conditions have no side effects
+                i->type = InstructionType::Nop;
+                threaded++;
+                continue;
+            }
+
+            // Condition that only skips the following jump is inverted, so it falls through
+            CompareType inverted = GetInvertedCompareType(i->if_statement.type);
+            if (next_ip < function_end_ip && instructions[next_ip]->type == InstructionType::Goto &&
+                inverted != CompareType::None && target_ips.find(next_ip) == target_ips.end() &&
+                i->if_statement.ip == FindJumpDestination(next_ip + 1)) {
+
+                InstructionEntry* next = instructions[next_ip];
+                i->if_statement.type = inverted;
+                set_target(ip, i->if_statement.ip, next->goto_statement.ip);
+                next->type = InstructionType::Nop;
+            }
+        }
+    }
+
+    if (threaded == 0) {
+        return 0;
+    }
+
+    CreateControlFlowGraph();
+
+    if (!backward_ips.empty()) {
+        // Emitter drops temporary variables on backward jumps, so variables
+        // that are live across the new backward jumps cannot be temporary anymore
+        std::vector<std::vector<bool>> live_in, live_out;
+        ComputeLiveVariables(live_in, live_out);
+
+        for (size_t j = 0; j < blocks.size(); j++) {
+            std::vector<int32_t>& successors = blocks[j].successors;
+            for (size_t k = 0; k < successors.size(); k++) {
+                int32_t begin_ip = blocks[successors[k]].begin_ip;
+
+                bool crosses_jump = false;
+                for (size_t l = 0; l < backward_ips.size(); l++) {
+                    if (blocks[j].begin_ip <= backward_ips[l] && begin_ip > backward_ips[l]) {
+                        crosses_jump = true;
+                        break;
+                    }
+                }
+
+                if (!crosses_jump) {
+                    continue;
+                }
+
+                for (size_t l = 0; l < scalars.size(); l++) {
+                    if (live_in[successors[k]][l] && scalars[l]->is_temp) {
+                        scalars[l]->is_temp = false;
+                    }
+                }
+            }
+        }
+    }
+
+    return threaded;
+}
+
+int32_t Optimizer::ThreadConditions()
+{
+    int32_t threaded = 0;
+
+    // Each change invalidates values followed through predecessors, so the graph is always created again
+    bool changed;
+    do {
+        changed = false;
+
+        for (size_t j = 1; j < blocks.size() && !changed; j++) {
+            int32_t if_ip = blocks[j].begin_ip;
+            while (if_ip < blocks[j].end_ip && instructions[if_ip]->type == InstructionType::Nop) {
+                if_ip++;
+            }
+
+            if (if_ip >= blocks[j].end_ip || instructions[if_ip]->type != InstructionType::If) {
+                continue;
+            }
+
+            InstructionEntry* i = instructions[if_ip];
+            int32_t index1 = (i->if_statement.op1.exp_type == ExpressionType::Variable ? FindScalarByName(i->if_statement.op1.value) : -1);
+            int32_t index2 = (i->if_statement.op2.exp_type == ExpressionType::Variable ? FindScalarByName(i->if_statement.op2.value) : -1);
+            if (index1 < 0 && index2 < 0) {
+                continue;
+            }
+
+            std::vector<int32_t>& predecessors = blocks[j].predecessors;
+            for (size_t k = 0; k < predecessors.size(); k++) {
+                std::vector<OptimizerValue> values(scalars.size(), { OptimizerValueState::Overdefined, 0 });
+
+                uint32_t value;
+                if (index1 >= 0 && GetValueAtEnd(predecessors[k], index1, value)) {
+                    values[index1] = { OptimizerValueState::Constant, value };
+                }
+                if (index2 >= 0 && GetValueAtEnd(predecessors[k], index2, value)) {
+                    values[index2] = { OptimizerValueState::Constant, value };
+                }
+
+                OptimizerValue condition = EvaluateIf(i, values);
+                if (condition.state != OptimizerValueState::Constant) {
+                    continue;
+                }
+
+                if (predecessors.size() == 1) {
+                    // Condition is reached only from this block, so it can be folded in place
+                    if (condition.value) {
+                        int32_t target_ip = i->if_statement.ip;
+                        i->type = InstructionType::Goto;
+                        i->goto_statement.ip = target_ip;
+                    } else {
+                        i->type = InstructionType::Nop;
+                    }
+                } else {
+                    InstructionEntry* last = instructions[blocks[predecessors[k]].end_ip - 1];
+
+                    int32_t* target_ip;
+                    switch (last->type) {
+                        case InstructionType::Goto: target_ip = &last->goto_statement.ip; break;
+                        case InstructionType::If: target_ip = &last->if_statement.ip; break;
+
+                        default: continue;
+                    }
+
+                    if (FindBlockByIp(*target_ip) != (int32_t)j) {
+                        continue;
+                    }
+
+                    // Emitter drops temporary variables on backward jumps, so no new ones are created
+                    int32_t new_ip = (condition.value ? i->if_statement.ip : if_ip + 1);
+                    int32_t source_ip = blocks[predecessors[k]].end_ip - 1;
+                    if (new_ip <= source_ip) {
+                        continue;
+                    }
+
+                    *target_ip = new_ip;
+                }
+
+                threaded++;
+                changed = true;
+                break;
+            }
+        }
+
+        if (changed) {
+            CreateControlFlowGraph();
+        }
+    } while (changed);
+
+    return threaded;
+}
+
+bool Optimizer::GetValueAtEnd(int32_t block, int32_t var, uint32_t& value)
+{
+    std::set<int32_t> visited;
+
+    while (visited.insert(block).second) {
+        for (int32_t ip = blocks[block].end_ip - 1; ip >= blocks[block].begin_ip; ip--) {
+            InstructionEntry* i = instructions[ip];
+            if (GetInstructionDefinition(i) != var) {
+                continue;
+            }
+
+            if (i->type != InstructionType::Assign || i->assignment.type != AssignType::None ||
+                i->assignment.op1.exp_type != ExpressionType::Constant || i->assignment.op1.type.base == BaseSymbolType::String) {
+                return false;
+            }
+
+            value = TruncateValue((uint32_t)atoi(i->assignment.op1.value), compiler->GetSymbolTypeSize(scalars[var]->type));
+            return true;
+        }
+
+        // Value is followed only through straight-line code, the first block is entered by call
+        if (block == 0 || blocks[block].predecessors.size() != 1) {
+            return false;
+        }
+
+        block = blocks[block].predecessors[0];
+    }
+
+    return false;
+}
+
+int32_t Optimizer::FindJumpDestination(int32_t ip)
+{
+    std::set<int32_t> visited;
+
+    while (ip >= function_begin_ip && ip < function_end_ip && visited.insert(ip).second) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type == InstructionType::Nop) {
+            ip++;
+        } else if (i->type == InstructionType::Goto) {
+            ip = i->goto_statement.ip;
+        } else {
+            break;
+        }
+    }
+
+    return ip;
+}
+
+int32_t Optimizer::HashStringComparisons()
+{
+    int32_t replaced = 0;
+
+    // Removed blocks still fall through to their successors
+    std::vector<bool> is_reachable;
+    FindReachableBlocks(is_reachable);
+
+    // Block has to start at specified IP and it has to be entered only from the block of source IP
+    auto is_entered_only_from = [&](int32_t ip, int32_t source_ip) {
+        std::unordered_map<std::string, int32_t>::iterator it = function_labels.begin();
+        while (it != function_labels.end()) {
+            if (it->second == ip) {
+                return false;
+            }
+            ++it;
+        }
+
+        OptimizerBlock& block = blocks[FindBlockByIp(ip)];
+        if (block.begin_ip != ip) {
+            return false;
+        }
+
+        int32_t source_block = FindBlockByIp(source_ip);
+        for (size_t j = 0; j < block.predecessors.size(); j++) {
+            if (block.predecessors[j] != source_block && is_reachable[block.predecessors[j]]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionOperand* var;
+        const char* value;
+        if (!GetStringComparison(instructions[ip], var, value)) {
+            continue;
+        }
+
+        // Each comparison continues to the next one by "goto", that can be reached only from the previous one
+        std::vector<int32_t> chain { ip };
+        std::vector<const char*> values { value };
+        std::vector<int32_t> value_ips { ip };
+
+        int32_t last_ip = ip;
+        while (last_ip + 1 < function_end_ip && instructions[last_ip + 1]->type == InstructionType::Goto &&
+               is_entered_only_from(last_ip + 1, last_ip)) {
+            int32_t next_ip = instructions[last_ip + 1]->goto_statement.ip;
+            if (next_ip <= last_ip + 1 || next_ip >= function_end_ip || !is_entered_only_from(next_ip, last_ip + 1)) {
+                break;
+            }
+
+            InstructionOperand* next_var;
+            if (!GetStringComparison(instructions[next_ip], next_var, value) || !AreOperandsEqual(*next_var, *var)) {
+                break;
+            }
+
+            // Only the first comparison of the same constant can match
+            bool is_duplicate = false;
+            for (size_t j = 0; j < values.size(); j++) {
+                if (strcmp(values[j], value) == 0) {
+                    is_duplicate = true;
+                    break;
+                }
+            }
+
+            if (!is_duplicate) {
+                values.push_back(value);
+                value_ips.push_back(next_ip);
+            }
+
+            chain.push_back(next_ip);
+            last_ip = next_ip;
+        }
+
+        uint16_t multiplier;
+        uint8_t bits;
+        if (values.size() < SwitchStringHashMinCases || !compiler->FindStringHash(values, multiplier, bits)) {
+            ip = last_ip;
+            continue;
+        }
+
+        // Comparison that doesn't match continues directly to the end of the chain
+        bool has_goto = (last_ip + 1 < function_end_ip && instructions[last_ip + 1]->type == InstructionType::Goto);
+        int32_t default_ip = (has_goto ? instructions[last_ip + 1]->goto_statement.ip : last_ip + 1);
+
+        for (size_t j = 0; j + 1 < chain.size(); j++) {
+            instructions[chain[j] + 1]->goto_statement.ip = default_ip;
+        }
+
+        // Jump table is inserted before the first comparison, so all following IPs are shifted
+        uint32_t count = (1u << bits);
+        int32_t shift = (int32_t)count + 1;
+
+        std::vector<InstructionEntry*> entries;
+
+        InstructionEntry* i = new InstructionEntry();
+        i->type = InstructionType::Switch;
+        i->switch_statement.op = *var;
+        i->switch_statement.count = count - 1;
+        i->switch_statement.hash_multiplier = multiplier;
+        i->switch_statement.hash_bits = bits;
+        entries.push_back(i);
+
+        for (uint32_t j = 0; j < count; j++) {
+            InstructionEntry* entry = new InstructionEntry();
+            entry->type = InstructionType::Goto;
+            entry->goto_statement.ip = (default_ip > ip ? default_ip + shift : default_ip);
+            entries.push_back(entry);
+        }
+
+        for (size_t j = 0; j < values.size(); j++) {
+            uint32_t index = compiler->GetStringHashIndex(values[j], multiplier, bits);
+            entries[1 + index]->goto_statement.ip = value_ips[j] + shift;
+        }
+
+        InsertInstructions(ip, entries, nullptr);
+        FindReachableBlocks(is_reachable);
+
+        ip = last_ip + shift;
+        replaced++;
+    }
+
+    return replaced;
+}
+
+bool Optimizer::GetStringComparison(InstructionEntry* i, InstructionOperand*& var, const char*& value)
+{
+    if (i->type != InstructionType::If || i->if_statement.type != CompareType::Equal) {
+        return false;
+    }
+
+    InstructionOperand& op1 = i->if_statement.op1;
+    InstructionOperand& op2 = i->if_statement.op2;
+    if (op1.type.base != BaseSymbolType::String || op1.type.pointer != 0 ||
+        op2.type.base != BaseSymbolType::String || op2.type.pointer != 0) {
+        return false;
+    }
+
+    if (op1.exp_type == ExpressionType::Variable && !op1.index.value && op2.exp_type == ExpressionType::Constant) {
+        var = &op1;
+        value = op2.value;
+        return true;
+    }
+
+    if (op2.exp_type == ExpressionType::Variable && !op2.index.value && op1.exp_type == ExpressionType::Constant) {
+        var = &op2;
+        value = op1.value;
+        return true;
+    }
+
+    return false;
+}
+
+int32_t Optimizer::AllocateOnStack()
+{
+    int32_t allocated = 0;
+
+    std::vector<std::vector<bool>> dominators;
+    ComputeDominators(dominators);
+
+    std::vector<OptimizerLoop> loops;
+    FindLoops(dominators, loops);
+
+    // Local variables are addressed by 8-bit displacement, so the whole stack frame must fit
+    int32_t frame_size = GetFrameSize(function, false);
+
+    for (int32_t ip = function_begin_ip + 1; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type != InstructionType::Call || !i->call_statement.return_symbol ||
+            i->call_statement.target->type.base != BaseSymbolType::SharedFunction ||
+            strcmp(i->call_statement.target->name, "#Alloc") != 0) {
+            continue;
+        }
+
+        // Size of the block must be known at compile time
+        InstructionEntry* push = instructions[ip - 1];
+        if (push->type != InstructionType::Push || push->push_statement.symbol->exp_type != ExpressionType::Constant) {
+            continue;
+        }
+
+        uint32_t bytes = (uint32_t)strtoul(push->push_statement.symbol->name, nullptr, 10);
+        if (bytes == 0 || bytes > StackAllocMaxSize || frame_size + (int32_t)bytes > StackAllocMaxFrameSize) {
+            continue;
+        }
+
+        // Allocation inside of a loop returns new block in each iteration
+        int32_t block = FindBlockByIp(ip);
+        if (block < 0) {
+            continue;
+        }
+
+        bool is_in_loop = false;
+        for (size_t j = 0; j < loops.size(); j++) {
+            if (loops[j].blocks[block]) {
+                is_in_loop = true;
+                break;
+            }
+        }
+        if (is_in_loop) {
+            continue;
+        }
+
+        SymbolTableEntry* dst = FindSymbolByName(i->call_statement.return_symbol);
+        // Parameters hold value of the caller on entry
+        if (!dst || !dst->parent || dst->parameter || dst->size > 0 || dst->type.pointer == 0) {
+            continue;
+        }
+
+        SymbolType resolved_type = dst->type;
+        resolved_type.pointer--;
+        int32_t item_size = compiler->GetSymbolTypeSize(resolved_type);
+        if (item_size <= 0 || (bytes % item_size) != 0) {
+            continue;
+        }
+
+        std::set<std::string> aliases;
+        std::vector<int32_t> release_ips;
+        if (!FindAllocationAliases(ip, aliases, release_ips)) {
+            continue;
+        }
+
+        // Pointer doesn't escape, so the block can be replaced by local array
+        SymbolTableEntry* array = compiler->AddTempVariable(dst->type, function->name);
+        array->size = (int32_t)(bytes / item_size);
+        array->is_temp = false;
+        function_symbols[array->name] = array;
+
+        push->type = InstructionType::Nop;
+
+        i->type = InstructionType::Assign;
+        i->assignment = { };
+        i->assignment.type = AssignType::None;
+        i->assignment.dst_value = dst->name;
+        i->assignment.op1.value = array->name;
+        i->assignment.op1.type = array->type;
+        i->assignment.op1.exp_type = ExpressionType::Variable;
+
+        for (size_t j = 0; j < release_ips.size(); j++) {
+            instructions[release_ips[j]]->type = InstructionType::Nop;
+            instructions[release_ips[j] + 1]->type = InstructionType::Nop;
+        }
+
+        frame_size += (int32_t)bytes;
+        allocated++;
+    }
+
+    return allocated;
+}
+
+bool Optimizer::FindAllocationAliases(int32_t call_ip, std::set<std::string>& aliases, std::vector<int32_t>& release_ips)
+{
+    const char* ret = instructions[call_ip]->call_statement.return_symbol;
+    if (referenced_symbols.find(ret) != referenced_symbols.end()) {
+        return false;
+    }
+
+    aliases.insert(ret);
+
+    auto is_alias = [&](const char* value, ExpressionType exp_type) {
+        return (exp_type == ExpressionType::Variable && value && aliases.find(value) != aliases.end());
+    };
+
+    auto is_alias_index = [&](const InstructionOperandIndex& index) {
+        return is_alias(index.value, index.exp_type);
+    };
+
+    // Pointer can be copied to other local variables or offset, any other use escapes
+    bool changed;
+    do {
+        changed = false;
+        release_ips.clear();
+
+        for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+            switch (i->type) {
+                case InstructionType::Assign: {
+                    InstructionOperand& op1 = i->assignment.op1;
+                    InstructionOperand& op2 = i->assignment.op2;
+                    if (is_alias_index(op1.index) || is_alias_index(op2.index) || is_alias_index(i->assignment.dst_index)) {
+                        return false;
+                    }
+
+                    // Items can be loaded through the pointer
+                    bool is_op1_alias = (!op1.index.value && is_alias(op1.value, op1.exp_type));
+                    bool is_op2_alias = (!op2.index.value && is_alias(op2.value, op2.exp_type));
+                    if (!is_op1_alias && !is_op2_alias) {
+                        break;
+                    }
+
+                    if (is_op2_alias || i->assignment.dst_index.value ||
+                        (i->assignment.type != AssignType::None && i->assignment.type != AssignType::Add &&
+                         i->assignment.type != AssignType::Subtract)) {
+                        return false;
+                    }
+
+                    // Address of the variable itself cannot be taken
+                    SymbolTableEntry* dst = FindSymbolByName(i->assignment.dst_value);
+                    if (!dst || !dst->parent || dst->parameter || dst->size > 0 || dst->type.pointer != op1.type.pointer ||
+                        referenced_symbols.find(dst->name) != referenced_symbols.end()) {
+                        return false;
+                    }
+
+                    if (aliases.insert(dst->name).second) {
+                        changed = true;
+                    }
+                    break;
+                }
+                case InstructionType::If: {
+                    // Pointer can be compared
+                    if (is_alias_index(i->if_statement.op1.index) || is_alias_index(i->if_statement.op2.index)) {
+                        return false;
+                    }
+                    break;
+                }
+                case InstructionType::Switch: {
+                    InstructionOperand& op = i->switch_statement.op;
+                    if (is_alias(op.value, op.exp_type) || is_alias_index(op.index)) {
+                        return false;
+                    }
+                    break;
+                }
+                case InstructionType::Push: {
+                    SymbolTableEntry* symbol = i->push_statement.symbol;
+                    if (!is_alias(symbol->name, symbol->exp_type)) {
+                        break;
+                    }
+
+                    // Only "release" is known not to keep the pointer
+                    InstructionEntry* call = (ip + 1 < function_end_ip ? instructions[ip + 1] : nullptr);
+                    if (!call || call->type != InstructionType::Call ||
+                        call->call_statement.target->type.base != BaseSymbolType::SharedFunction ||
+                        strcmp(call->call_statement.target->name, "release") != 0) {
+                        return false;
+                    }
+
+                    release_ips.push_back(ip);
+                    break;
+                }
+                case InstructionType::Return: {
+                    InstructionOperand& op = i->return_statement.op;
+                    if (is_alias(op.value, op.exp_type) || is_alias_index(op.index)) {
+                        return false;
+                    }
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    // All values of the variables have to be derived from this allocation,
+    // otherwise "release" could be called for another block
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        if (i->type == InstructionType::Assign) {
+            if (i->assignment.dst_index.value || aliases.find(i->assignment.dst_value) == aliases.end()) {
+                continue;
+            }
+
+            InstructionOperand& op1 = i->assignment.op1;
+            if (op1.index.value || !is_alias(op1.value, op1.exp_type)) {
+                return false;
+            }
+        } else if (i->type == InstructionType::Call) {
+            if (ip != call_ip && i->call_statement.return_symbol &&
+                aliases.find(i->call_statement.return_symbol) != aliases.end()) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool Optimizer::GetAssignExpression(InstructionEntry* i, OptimizerExpression& expression)
+{
+    if (i->type != InstructionType::Assign || i->assignment.dst_index.value) {
+        return false;
+    }
+
+    int32_t dst = FindScalarByName(i->assignment.dst_value);
+    if (dst < 0) {
+        return false;
+    }
+
+    expression.operands.clear();
+    expression.base = nullptr;
+
+    auto get_operand = [&](const char* value, ExpressionType exp_type, std::string& key) {
+        if (exp_type == ExpressionType::Constant) {
+            key += "#" + std::to_string((uint32_t)atoi(value));
+            return true;
+        }
+
+        if (exp_type == ExpressionType::Variable) {
+            int32_t index = FindScalarByName(value);
+            if (index >= 0) {
+                key += "v" + std::to_string(index);
+                expression.operands.push_back(index);
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    InstructionOperand& op1 = i->assignment.op1;
+    InstructionOperand& op2 = i->assignment.op2;
+
+    std::string key1, key2;
+
+    switch (i->assignment.type) {
+        case AssignType::None: {
+            // Only loads of array items are expressions, other assignments are copies
+            if (!op1.index.value || op1.exp_type != ExpressionType::Variable || FindScalarByName(op1.value) >= 0) {
+                return false;
+            }
+            if (!get_operand(op1.index.value, op1.index.exp_type, key2)) {
+                return false;
+            }
+
+            expression.base = op1.value;
+            key1 = std::string("[") + op1.value + "]";
+            break;
+        }
+        case AssignType::Negation: {
+            if (op1.index.value || !get_operand(op1.value, op1.exp_type, key1)) {
+                return false;
+            }
+            break;
+        }
+
+        default: {
+            if (op1.index.value || op2.index.value ||
+                !get_operand(op1.value, op1.exp_type, key1) ||
+                !get_operand(op2.value, op2.exp_type, key2)) {
+                return false;
+            }
+
+            // Operands of commutative operations are sorted, so "a + b" and "b + a" are the same
+            if ((i->assignment.type == AssignType::Add || i->assignment.type == AssignType::Multiply) && key2 < key1) {
+                std::swap(key1, key2);
+            }
+            break;
+        }
+    }
+
+    // Arithmetic is performed with size of destination
+    SymbolType& type = scalars[dst]->type;
+    expression.key = std::to_string((int32_t)i->assignment.type) + ":" + std::to_string((int32_t)type.base) + ":" + key1 + "," + key2;
+    return true;
+}
+
+int32_t Optimizer::HoistLoopInvariants()
+{
+    int32_t hoisted = 0;
+
+    // Each hoisting inserts new instructions, so the loops have to be found again,
+    // inner loops are processed first, so their invariants can be hoisted further
+    bool changed;
+    do {
+        changed = false;
+
+        std::vector<std::vector<bool>> dominators;
+        ComputeDominators(dominators);
+
+        std::vector<OptimizerLoop> loops;
+        FindLoops(dominators, loops);
+
+        for (size_t j = 0; j < loops.size(); j++) {
+            int32_t count = HoistLoopInvariants(loops[j], dominators);
+            if (count > 0) {
+                hoisted += count;
+                changed = true;
+                break;
+            }
+        }
+    } while (changed);
+
+    return hoisted;
+}
+
+int32_t Optimizer::HoistLoopInvariants(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators)
+{
+    size_t scalar_count = scalars.size();
+
+    if (!CanInsertPreheader(loop)) {
+        return 0;
+    }
+
+    std::vector<int32_t> def_count = loop.def_count;
+
+    std::vector<std::vector<bool>> live_in, live_out;
+    ComputeLiveVariables(live_in, live_out);
+
+    std::vector<bool> is_hoisted(scalar_count, false);
+
+    // Non-tracked variables (statics, variables with taken address and arrays
+    // accessed through pointers) can be changed by calls and stores to memory
+    auto is_memory_invariant = [&](const char* name) {
+        return (!loop.has_call && !loop.has_store && loop.assigned_symbols.find(name) == loop.assigned_symbols.end());
+    };
+
+    auto is_invariant = [&](const char* value, ExpressionType exp_type) {
+        if (exp_type == ExpressionType::Constant) {
+            return true;
+        }
+        if (exp_type != ExpressionType::Variable) {
+            return false;
+        }
+
+        int32_t var = FindScalarByName(value);
+        if (var >= 0) {
+            return (def_count[var] == 0 || is_hoisted[var]);
+        }
+
+        SymbolTableEntry* symbol = FindSymbolByName(value);
+        return (symbol && symbol->size == 0 && IsScalarType(symbol->type) && is_memory_invariant(value));
+    };
+
+    std::vector<InstructionEntry*> entries;
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (!loop.blocks[j]) {
+            continue;
+        }
+
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+            if (i->type != InstructionType::Assign || i->assignment.dst_index.value) {
+                continue;
+            }
+
+            int32_t dst = FindScalarByName(i->assignment.dst_value);
+            if (dst < 0) {
+                continue;
+            }
+
+            // Temporary variables are reused by following statements, but the value assigned
+            // by this instruction can be moved to a new variable, if it's used only in this block
+            std::vector<int32_t> use_ips;
+            bool needs_split = (def_count[dst] != 1 || live_in[loop.header][dst]);
+            if (needs_split && (!scalars[dst]->is_temp || !GetLocalUses(dst, ip, live_out[j], use_ips))) {
+                continue;
+            }
+
+            InstructionOperand& op1 = i->assignment.op1;
+            InstructionOperand& op2 = i->assignment.op2;
+
+            bool can_hoist;
+            switch (i->assignment.type) {
+                case AssignType::None: {
+                    if (op1.exp_type != ExpressionType::Variable || FindScalarByName(op1.value) >= 0) {
+                        // Constants and copies of tracked variables are not worth it
+                        can_hoist = false;
+                    } else if (op1.index.value) {
+                        // Load of array item
+                        can_hoist = (is_memory_invariant(op1.value) && is_invariant(op1.index.value, op1.index.exp_type));
+                    } else {
+                        // Load of static variable
+                        can_hoist = is_invariant(op1.value, op1.exp_type);
+                    }
+                    break;
+                }
+                case AssignType::Negation: {
+                    can_hoist = (!op1.index.value && is_invariant(op1.value, op1.exp_type));
+                    break;
+                }
+                case AssignType::Divide:
+                case AssignType::Remainder: {
+                    // Division by zero must not be executed, if the loop would not execute it
+                    can_hoist = (!op1.index.value && !op2.index.value &&
+                        op2.exp_type == ExpressionType::Constant && atoi(op2.value) != 0 &&
+                        is_invariant(op1.value, op1.exp_type));
+                    break;
+                }
+
+                default: {
+                    can_hoist = (!op1.index.value && !op2.index.value &&
+                        is_invariant(op1.value, op1.exp_type) && is_invariant(op2.value, op2.exp_type));
+                    break;
+                }
+            }
+
+            if (!can_hoist) {
+                continue;
+            }
+
+            // Value assigned before the loop must not leave the loop on paths, that skipped the assignment
+            for (size_t k = 0; k < blocks.size() && can_hoist && !needs_split; k++) {
+                if (!loop.blocks[k]) {
+                    continue;
+                }
+
+                std::vector<int32_t>& successors = blocks[k].successors;
+                for (size_t l = 0; l < successors.size(); l++) {
+                    if (!loop.blocks[successors[l]] && live_in[successors[l]][dst] && !dominators[k][j]) {
+                        can_hoist = false;
+                        break;
+                    }
+                }
+            }
+
+            if (!can_hoist) {
+                continue;
+            }
+
+            if (needs_split) {
+                dst = SplitVariable(dst, ip, use_ips);
+                def_count.push_back(1);
+                is_hoisted.push_back(false);
+            }
+
+            InstructionEntry* entry = new InstructionEntry(*i);
+            entries.push_back(entry);
+
+            i->type = InstructionType::Nop;
+            is_hoisted[dst] = true;
+
+            // Value is held across the loop, so the variable cannot be treated as temp. variable anymore
+            scalars[dst]->is_temp = false;
+        }
+    }
+
+    if (entries.empty()) {
+        return 0;
+    }
+
+    InsertInstructions(blocks[loop.header].begin_ip, entries, &loop);
+
+    return (int32_t)entries.size();
+}
+
+bool Optimizer::GetLocalUses(int32_t var, int32_t ip, const std::vector<bool>& live_out, std::vector<int32_t>& use_ips)
+{
+    use_ips.clear();
+
+    int32_t block = ip_to_block[ip - function_begin_ip];
+
+    std::vector<int32_t> uses;
+    for (int32_t k = ip + 1; k < blocks[block].end_ip; k++) {
+        InstructionEntry* i = instructions[k];
+
+        GetInstructionUses(i, uses);
+        if (std::find(uses.begin(), uses.end(), var) != uses.end()) {
+            use_ips.push_back(k);
+        }
+
+        // The value is overwritten in the same block
+        if (GetInstructionDefinition(i) == var) {
+            return true;
+        }
+    }
+
+    return !live_out[var];
+}
+
+int32_t Optimizer::SplitVariable(int32_t var, int32_t ip, const std::vector<int32_t>& use_ips)
+{
+    SymbolTableEntry* symbol = compiler->AddTempVariable(scalars[var]->type, function->name);
+
+    const char* old_name = scalars[var]->name;
+
+    auto rename = [&](char*& value, ExpressionType exp_type) {
+        if (value && exp_type == ExpressionType::Variable && strcmp(value, old_name) == 0) {
+            value = symbol->name;
+        }
+    };
+
+    for (size_t j = 0; j < use_ips.size(); j++) {
+        InstructionEntry* i = instructions[use_ips[j]];
+
+        switch (i->type) {
+            case InstructionType::Assign: {
+                rename(i->assignment.dst_index.value, i->assignment.dst_index.exp_type);
+                rename(i->assignment.op1.value, i->assignment.op1.exp_type);
+                rename(i->assignment.op1.index.value, i->assignment.op1.index.exp_type);
+
+                if (i->assignment.type != AssignType::None && i->assignment.type != AssignType::Negation) {
+                    rename(i->assignment.op2.value, i->assignment.op2.exp_type);
+                    rename(i->assignment.op2.index.value, i->assignment.op2.index.exp_type);
+                }
+                break;
+            }
+            case InstructionType::If: {
+                rename(i->if_statement.op1.value, i->if_statement.op1.exp_type);
+                rename(i->if_statement.op1.index.value, i->if_statement.op1.index.exp_type);
+                rename(i->if_statement.op2.value, i->if_statement.op2.exp_type);
+                rename(i->if_statement.op2.index.value, i->if_statement.op2.index.exp_type);
+                break;
+            }
+            case InstructionType::Switch: {
+                rename(i->switch_statement.op.value, i->switch_statement.op.exp_type);
+                rename(i->switch_statement.op.index.value, i->switch_statement.op.index.exp_type);
+                break;
+            }
+            case InstructionType::Push: {
+                rename(i->push_statement.symbol->name, i->push_statement.symbol->exp_type);
+                break;
+            }
+            case InstructionType::Return: {
+                rename(i->return_statement.op.value, i->return_statement.op.exp_type);
+                rename(i->return_statement.op.index.value, i->return_statement.op.index.exp_type);
+                break;
+            }
+        }
+    }
+
+    instructions[ip]->assignment.dst_value = symbol->name;
+
+    function_symbols[symbol->name] = symbol;
+
+    int32_t index = (int32_t)scalars.size();
+    scalar_indices[symbol->name] = index;
+    scalars.push_back(symbol);
+    return index;
+}
+
+int32_t Optimizer::ReduceInductionVariables()
+{
+    int32_t reduced = 0;
+
+    // Each reduction inserts new instructions, so the loops have to be found again
+    bool changed;
+    do {
+        changed = false;
+
+        std::vector<std::vector<bool>> dominators;
+        ComputeDominators(dominators);
+
+        std::vector<OptimizerLoop> loops;
+        FindLoops(dominators, loops);
+
+        for (size_t j = 0; j < loops.size(); j++) {
+            int32_t count = ReduceInductionVariables(loops[j], dominators);
+            if (count > 0) {
+                reduced += count;
+                changed = true;
+                break;
+            }
+        }
+    } while (changed);
+
+    return reduced;
+}
+
+int32_t Optimizer::ReduceInductionVariables(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators)
+{
+    if (!CanInsertPreheader(loop)) {
+        return 0;
+    }
+
+    // Pointers can be changed through pointers or by calls only if their address was taken
+    auto is_base_invariant = [&](SymbolTableEntry* symbol) {
+        if (!symbol || symbol->type.pointer == 0 || loop.assigned_symbols.find(symbol->name) != loop.assigned_symbols.end()) {
+            return false;
+        }
+
+        return (symbol->size > 0 || (!loop.has_call && !loop.has_store) ||
+            (symbol->parent && referenced_symbols.find(symbol->name) == referenced_symbols.end()));
+    };
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (!loop.blocks[j]) {
+            continue;
+        }
+
+        for (int32_t inc_ip = blocks[j].begin_ip; inc_ip < blocks[j].end_ip; inc_ip++) {
+            InstructionEntry* inc = instructions[inc_ip];
+
+            // Basic induction variable is changed only by constant step in the loop, 8-bit
+            // variables overflow sooner than index of array item, so they cannot be replaced
+            int32_t var = GetInstructionDefinition(inc);
+            if (var < 0 || loop.def_count[var] != 1 || inc->type != InstructionType::Assign ||
+                (scalars[var]->type.base != BaseSymbolType::Uint16 && scalars[var]->type.base != BaseSymbolType::Uint32)) {
+                continue;
+            }
+
+            uint32_t step;
+            if (!GetInductionStep(inc, step)) {
+                continue;
+            }
+
+            // Find array items indexed by the induction variable
+            SymbolTableEntry* base = nullptr;
+            std::vector<int32_t> access_ips;
+
+            for (size_t k = 0; k < blocks.size(); k++) {
+                if (!loop.blocks[k]) {
+                    continue;
+                }
+
+                for (int32_t ip = blocks[k].begin_ip; ip < blocks[k].end_ip; ip++) {
+                    InstructionEntry* i = instructions[ip];
+                    if (i->type != InstructionType::Assign || i->assignment.type != AssignType::None) {
+                        continue;
+                    }
+
+                    InstructionOperandIndex& dst_index = i->assignment.dst_index;
+                    InstructionOperand& op1 = i->assignment.op1;
+
+                    const char* candidates[2] = { nullptr, nullptr };
+                    if (dst_index.value && dst_index.exp_type == ExpressionType::Variable && FindScalarByName(dst_index.value) == var) {
+                        candidates[0] = i->assignment.dst_value;
+                    }
+                    if (op1.exp_type == ExpressionType::Variable && op1.index.value &&
+                        op1.index.exp_type == ExpressionType::Variable && FindScalarByName(op1.index.value) == var) {
+                        candidates[1] = op1.value;
+                    }
+
+                    for (int32_t l = 0; l < 2; l++) {
+                        if (!candidates[l]) {
+                            continue;
+                        }
+
+                        SymbolTableEntry* symbol = FindSymbolByName(candidates[l]);
+                        if (!base && is_base_invariant(symbol)) {
+                            base = symbol;
+                        }
+                        if (symbol == base) {
+                            access_ips.push_back(ip);
+                            break;
+                        }
+                    }
+                }
+            }
+
+            if (!base) {
+                continue;
+            }
+
+            // Pointer has to be moved in every iteration, so it's worth only if the induction
+            // variable can be removed or the pointer replaces more than one computed address
+            size_t unconditional_count = 0;
+            for (size_t k = 0; k < access_ips.size(); k++) {
+                if (dominators[j][FindBlockByIp(access_ips[k])]) {
+                    unconditional_count++;
+                }
+            }
+
+            uint32_t init;
+            bool is_init_known = GetInitialValue(loop, var, init);
+
+            InstructionEntry* exit_test;
+            if (!is_init_known || !FindExitTest(loop, var, inc_ip, step, base, init, access_ips, exit_test)) {
+                exit_test = nullptr;
+            }
+
+            if (!exit_test && unconditional_count < 2) {
+                continue;
+            }
+
+            ReduceInductionVariable(loop, var, inc_ip, step, base, access_ips, exit_test);
+            return (int32_t)access_ips.size();
+        }
+    }
+
+    return 0;
+}
+
+void Optimizer::ReduceInductionVariable(const OptimizerLoop& loop, int32_t var, int32_t inc_ip, uint32_t step,
+    SymbolTableEntry* base, const std::vector<int32_t>& access_ips, InstructionEntry* exit_test)
+{
+    SymbolType item_type = base->type;
+    item_type.pointer--;
+    uint32_t item_size = (uint32_t)compiler->GetSymbolTypeSize(item_type);
+
+    int32_t header_ip = blocks[loop.header].begin_ip;
+
+    SymbolTableEntry* ptr = compiler->AddTempVariable(base->type, function->name);
+    ptr->is_temp = false;
+
+    auto create_assign = [&](AssignType type, const char* dst, const char* op1, SymbolType op1_type, ExpressionType op1_exp_type) {
+        InstructionEntry* i = new InstructionEntry();
+        i->type = InstructionType::Assign;
+        i->assignment.type = type;
+        i->assignment.dst_value = (char*)dst;
+        i->assignment.op1.value = (char*)op1;
+        i->assignment.op1.type = op1_type;
+        i->assignment.op1.exp_type = op1_exp_type;
+        return i;
+    };
+
+    auto create_add = [&](const char* dst, uint32_t value) {
+        InstructionEntry* i = create_assign(AssignType::Add, dst, dst, base->type, ExpressionType::Variable);
+        i->assignment.op2.value = ValueToString(TruncateValue(value, 2));
+        i->assignment.op2.type = { BaseSymbolType::Uint16, 0 };
+        i->assignment.op2.exp_type = ExpressionType::Constant;
+        return i;
+    };
+
+    // Pointer to the item starts at the item indexed by the initial value
+    std::vector<InstructionEntry*> preheader;
+    preheader.push_back(create_assign(AssignType::None, ptr->name, base->name, base->type, ExpressionType::Variable));
+
+    uint32_t init;
+    if (GetInitialValue(loop, var, init)) {
+        if (init != 0) {
+            preheader.push_back(create_add(ptr->name, init * item_size));
+        }
+    } else {
+        // Pointer arithmetic is performed in bytes
+        const char* offset = scalars[var]->name;
+        if (item_size > 1) {
+            SymbolTableEntry* decl = compiler->AddTempVariable(scalars[var]->type, function->name);
+
+            InstructionEntry* i = create_assign(AssignType::ShiftLeft, decl->name, scalars[var]->name, scalars[var]->type, ExpressionType::Variable);
+            i->assignment.op2.value = ValueToString(compiler->SizeToShift(item_size));
+            i->assignment.op2.type = { BaseSymbolType::Uint8, 0 };
+            i->assignment.op2.exp_type = ExpressionType::Constant;
+            preheader.push_back(i);
+
+            offset = decl->name;
+        }
+
+        InstructionEntry* i = create_assign(AssignType::Add, ptr->name, ptr->name, base->type, ExpressionType::Variable);
+        i->assignment.op2.value = (char*)offset;
+        i->assignment.op2.type = scalars[var]->type;
+        i->assignment.op2.exp_type = ExpressionType::Variable;
+        preheader.push_back(i);
+    }
+
+    // Replace indexed items by the pointer
+    for (size_t j = 0; j < access_ips.size(); j++) {
+        ReplaceIndexedAccess(instructions[access_ips[j]], var, base, ptr->name);
+    }
+
+    // Exit condition can compare pointers instead, if the induction variable is not needed anymore
+    if (exit_test) {
+        bool is_swapped = (FindScalarByName(exit_test->if_statement.op2.value) == var);
+        InstructionOperand& op_var = (is_swapped ? exit_test->if_statement.op2 : exit_test->if_statement.op1);
+        InstructionOperand& op_limit = (is_swapped ? exit_test->if_statement.op1 : exit_test->if_statement.op2);
+
+        SymbolTableEntry* limit = compiler->AddTempVariable(base->type, function->name);
+        limit->is_temp = false;
+
+        preheader.push_back(create_assign(AssignType::None, limit->name, base->name, base->type, ExpressionType::Variable));
+        preheader.push_back(create_add(limit->name, (uint32_t)atoi(op_limit.value) * item_size));
+
+        op_var.value = ptr->name;
+        op_var.type = ptr->type;
+        op_var.index = { };
+        op_limit.value = limit->name;
+        op_limit.type = limit->type;
+        op_limit.exp_type = ExpressionType::Variable;
+        op_limit.index = { };
+
+        instructions[inc_ip]->type = InstructionType::Nop;
+    }
+
+    // Pointer is moved by the same step just before the induction variable
+    std::vector<InstructionEntry*> update;
+    update.push_back(create_add(ptr->name, step * item_size));
+
+    InsertInstructions(header_ip, preheader, &loop);
+    InsertInstructions(inc_ip + (int32_t)preheader.size(), update, nullptr);
+}
+
+void Optimizer::ReplaceIndexedAccess(InstructionEntry* i, int32_t var, SymbolTableEntry* base, const char* ptr)
+{
+    InstructionOperandIndex& dst_index = i->assignment.dst_index;
+    if (dst_index.value && dst_index.exp_type == ExpressionType::Variable &&
+        FindScalarByName(dst_index.value) == var && strcmp(i->assignment.dst_value, base->name) == 0) {
+        i->assignment.dst_value = (char*)ptr;
+        dst_index.value = ValueToString(0);
+        dst_index.type = { BaseSymbolType::Uint8, 0 };
+        dst_index.exp_type = ExpressionType::Constant;
+    }
+
+    InstructionOperand& op1 = i->assignment.op1;
+    if (op1.index.value && op1.index.exp_type == ExpressionType::Variable &&
+        FindScalarByName(op1.index.value) == var && strcmp(op1.value, base->name) == 0) {
+        op1.value = (char*)ptr;
+        op1.index.value = ValueToString(0);
+        op1.index.type = { BaseSymbolType::Uint8, 0 };
+        op1.index.exp_type = ExpressionType::Constant;
+    }
+}
+
+bool Optimizer::GetInductionStep(InstructionEntry* i, uint32_t& step)
+{
+    InstructionOperand& op1 = i->assignment.op1;
+    InstructionOperand& op2 = i->assignment.op2;
+    if (i->assignment.dst_index.value || op1.index.value || op2.index.value) {
+        return false;
+    }
+
+    const char* dst = i->assignment.dst_value;
+
+    switch (i->assignment.type) {
+        case AssignType::Add: {
+            if (op1.exp_type == ExpressionType::Variable && strcmp(op1.value, dst) == 0 && op2.exp_type == ExpressionType::Constant) {
+                step = (uint32_t)atoi(op2.value);
+                return true;
+            }
+            if (op2.exp_type == ExpressionType::Variable && strcmp(op2.value, dst) == 0 && op1.exp_type == ExpressionType::Constant) {
+                step = (uint32_t)atoi(op1.value);
+                return true;
+            }
+            return false;
+        }
+        case AssignType::Subtract: {
+            if (op1.exp_type == ExpressionType::Variable && strcmp(op1.value, dst) == 0 && op2.exp_type == ExpressionType::Constant) {
+                step = (uint32_t)0 - (uint32_t)atoi(op2.value);
+                return true;
+            }
+            return false;
+        }
+
+        default: return false;
+    }
+}
+
+bool Optimizer::GetInitialValue(const OptimizerLoop& loop, int32_t var, uint32_t& value)
+{
+    // Loop must be entered only from the block, that falls through to the header
+    int32_t entry = -1;
+    std::vector<int32_t>& predecessors = blocks[loop.header].predecessors;
+    for (size_t j = 0; j < predecessors.size(); j++) {
+        if (loop.blocks[predecessors[j]]) {
+            continue;
+        }
+        if (entry >= 0) {
+            return false;
+        }
+        entry = predecessors[j];
+    }
+
+    if (entry < 0 || blocks[entry].end_ip != blocks[loop.header].begin_ip) {
+        return false;
+    }
+
+    for (int32_t ip = blocks[entry].end_ip - 1; ip >= blocks[entry].begin_ip; ip--) {
+        InstructionEntry* i = instructions[ip];
+        if (GetInstructionDefinition(i) != var) {
+            continue;
+        }
+
+        if (i->type != InstructionType::Assign || i->assignment.type != AssignType::None ||
+            i->assignment.op1.exp_type != ExpressionType::Constant) {
+            return false;
+        }
+
+        value = (uint32_t)atoi(i->assignment.op1.value);
+        return true;
+    }
+
+    return false;
+}
+
+bool Optimizer::FindExitTest(const OptimizerLoop& loop, int32_t var, int32_t inc_ip, uint32_t step,
+    SymbolTableEntry* base, uint32_t init, const std::vector<int32_t>& access_ips, InstructionEntry*& exit_test)
+{
+    // Pointers are compared only inside of the array, so they cannot overflow
+    if (step != 1 || base->size == 0) {
+        return false;
+    }
+
+    std::vector<std::vector<bool>> live_in, live_out;
+    ComputeLiveVariables(live_in, live_out);
+
+    exit_test = nullptr;
+
+    std::vector<int32_t> uses;
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (!loop.blocks[j]) {
+            continue;
+        }
+
+        // Value of the induction variable must not be needed after the loop
+        std::vector<int32_t>& successors = blocks[j].successors;
+        for (size_t k = 0; k < successors.size(); k++) {
+            if (!loop.blocks[successors[k]] && live_in[successors[k]][var]) {
+                return false;
+            }
+        }
+
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            if (ip == inc_ip) {
+                continue;
+            }
+
+            InstructionEntry* i = instructions[ip];
+
+            // Accessed items will be replaced, but other operands can still use the variable
+            if (std::find(access_ips.begin(), access_ips.end(), ip) != access_ips.end()) {
+                InstructionEntry replaced = *i;
+                ReplaceIndexedAccess(&replaced, var, base, base->name);
+                GetInstructionUses(&replaced, uses);
+            } else {
+                GetInstructionUses(i, uses);
+            }
+
+            if (std::find(uses.begin(), uses.end(), var) == uses.end()) {
+                continue;
+            }
+
+            if (exit_test || i->type != InstructionType::If) {
+                return false;
+            }
+
+            // Only "var < limit" and "var != limit" conditions are supported
+            InstructionOperand& op1 = i->if_statement.op1;
+            InstructionOperand& op2 = i->if_statement.op2;
+            bool is_swapped = (op2.exp_type == ExpressionType::Variable && FindScalarByName(op2.value) == var);
+            InstructionOperand& op_var = (is_swapped ? op2 : op1);
+            InstructionOperand& op_limit = (is_swapped ? op1 : op2);
+
+            if (op_var.exp_type != ExpressionType::Variable || FindScalarByName(op_var.value) != var ||
+                op_limit.exp_type != ExpressionType::Constant || op_limit.type.base == BaseSymbolType::String) {
+                return false;
+            }
+
+            CompareType type = i->if_statement.type;
+            if (type != CompareType::NotEqual && type != (is_swapped ? CompareType::Greater : CompareType::Less)) {
+                return false;
+            }
+
+            uint32_t limit = (uint32_t)atoi(op_limit.value);
+            if (init > limit || limit > (uint32_t)base->size) {
+                return false;
+            }
+
+            exit_test = i;
+        }
+    }
+
+    return (exit_test != nullptr);
+}
+
+int32_t Optimizer::UnrollLoops()
+{
+    int32_t unrolled = 0;
+
+    // Original loops are kept in place, so they are remembered by their first instruction
+    std::set<InstructionEntry*> processed;
+    std::set<InstructionEntry*> used_hints;
+
+    // Each unrolling inserts new instructions, so the loops have to be found again
+    bool changed;
+    do {
+        changed = false;
+
+        std::vector<std::vector<bool>> dominators;
+        ComputeDominators(dominators);
+
+        std::vector<OptimizerLoop> loops;
+        FindLoops(dominators, loops);
+
+        // Directive is applied to the first loop, whose header follows it
+        std::vector<InstructionEntry*> hints(loops.size(), nullptr);
+        for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+            if (compiler->GetUnrollCount(i) == 0 || used_hints.find(i) != used_hints.end()) {
+                continue;
+            }
+
+            int32_t nearest = -1;
+            for (size_t j = 0; j < loops.size(); j++) {
+                int32_t header_ip = blocks[loops[j].header].begin_ip;
+                if (header_ip >= ip && (nearest < 0 || header_ip < blocks[loops[nearest].header].begin_ip)) {
+                    nearest = (int32_t)j;
+                }
+            }
+
+            if (nearest >= 0 && !hints[nearest]) {
+                hints[nearest] = i;
+            }
+        }
+
+        for (size_t j = 0; j < loops.size(); j++) {
+            int32_t header_ip = blocks[loops[j].header].begin_ip;
+            if (!processed.insert(instructions[header_ip]).second) {
+                continue;
+            }
+
+            int32_t hint = 0;
+            if (hints[j]) {
+                hint = compiler->GetUnrollCount(hints[j]);
+                used_hints.insert(hints[j]);
+            }
+
+            if (UnrollLoop(loops[j], dominators, loops, hint)) {
+                // The first copy is the header of partially unrolled loop now
+                processed.insert(instructions[header_ip]);
+
+                unrolled++;
+                changed = true;
+                break;
+            }
+        }
+    } while (changed);
+
+    return unrolled;
+}
+
+bool Optimizer::UnrollLoop(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators,
+    const std::vector<OptimizerLoop>& loops, int32_t hint)
+{
+    if (hint == 1) {
+        return false;
+    }
+
+    // Loop is copied as a whole range of instructions, that starts with the header
+    int32_t begin_ip = blocks[loop.header].begin_ip;
+    int32_t end_ip = begin_ip;
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (!loop.blocks[j]) {
+            continue;
+        }
+        if (blocks[j].begin_ip < begin_ip) {
+            return false;
+        }
+        if (end_ip < blocks[j].end_ip) {
+            end_ip = blocks[j].end_ip;
+        }
+    }
+
+    // Labels cannot be copied
+    std::unordered_map<std::string, int32_t>::iterator it = function_labels.begin();
+    while (it != function_labels.end()) {
+        if (it->second >= begin_ip && it->second < end_ip) {
+            return false;
+        }
+        ++it;
+    }
+
+    int32_t size = 0;
+    for (int32_t ip = function_begin_ip; ip < function_end_ip; ip++) {
+        InstructionEntry* i = instructions[ip];
+        bool is_inside = (ip >= begin_ip && ip < end_ip);
+
+        if (is_inside) {
+            if (i->type == InstructionType::GotoLabel) {
+                return false;
+            }
+            if (i->type != InstructionType::Nop) {
+                size++;
+            }
+            continue;
+        }
+
+        // The range can be entered only through the header
+        int32_t target_ip;
+        switch (i->type) {
+            case InstructionType::Goto: target_ip = i->goto_statement.ip; break;
+            case InstructionType::If: target_ip = i->if_statement.ip; break;
+
+            default: continue;
+        }
+
+        if (target_ip > begin_ip && target_ip < end_ip) {
+            return false;
+        }
+    }
+
+    OptimizerTripCount trip;
+    bool is_trip_known = FindTripCount(loop, dominators, loops, trip);
+
+    int32_t copies;
+    bool is_full;
+    if (is_trip_known && (hint > 0 ? trip.iterations <= hint :
+            (trip.iterations <= UnrollLoopMaxTripCount && trip.iterations * size <= UnrollLoopMaxSize))) {
+        copies = trip.iterations;
+        is_full = true;
+    } else if (hint > 1) {
+        copies = hint - 1;
+        is_full = false;
+    } else {
+        return false;
+    }
+
+    if (copies == 0) {
+        return false;
+    }
+
+    // Exit test is needed only in the copy, where the loop ends, the remaining ones continue unconditionally
+    auto remove_exit_test = [&](InstructionEntry* i) {
+        if (trip.is_exit_taken) {
+            i->type = InstructionType::Nop;
+        } else {
+            int32_t target_ip = i->if_statement.ip;
+            i->type = InstructionType::Goto;
+            i->goto_statement.ip = target_ip;
+        }
+    };
+
+    // Each copy has to jump to the end of the loop, if the last instruction falls through
+    InstructionEntry* last = instructions[end_ip - 1];
+    bool falls_through = (last->type != InstructionType::Goto && last->type != InstructionType::Return);
+    int32_t copy_size = (end_ip - begin_ip) + (falls_through ? 1 : 0);
+    int32_t count = copies * copy_size;
+
+    std::vector<InstructionEntry*> entries;
+    for (int32_t j = 0; j < copies; j++) {
+        int32_t copy_ip = begin_ip + j * copy_size;
+
+        for (int32_t ip = begin_ip; ip < end_ip; ip++) {
+            InstructionEntry* entry = new InstructionEntry(*instructions[ip]);
+            if (entry->type == InstructionType::Push) {
+                entry->push_statement.symbol = new SymbolTableEntry(*entry->push_statement.symbol);
+            }
+
+            int32_t* target_ip = nullptr;
+            switch (entry->type) {
+                case InstructionType::Goto: target_ip = &entry->goto_statement.ip; break;
+                case InstructionType::If: target_ip = &entry->if_statement.ip; break;
+            }
+
+            if (target_ip) {
+                if (*target_ip == begin_ip) {
+                    // Next iteration continues in the following copy
+                    *target_ip = copy_ip + copy_size;
+                } else if (*target_ip > begin_ip && *target_ip < end_ip) {
+                    *target_ip += copy_ip - begin_ip;
+                } else if (*target_ip > begin_ip) {
+                    *target_ip += count;
+                }
+            }
+
+            if (!is_full && is_trip_known && ip == trip.test_ip && j != trip.exit_iteration % hint) {
+                remove_exit_test(entry);
+            }
+
+            entries.push_back(entry);
+        }
+
+        if (falls_through) {
+            InstructionEntry* entry = new InstructionEntry();
+            entry->type = InstructionType::Goto;
+            entry->goto_statement.ip = end_ip + count;
+            entries.push_back(entry);
+        }
+    }
+
+    // Jumps from inside of the original loop to its header are not changed
+    InsertInstructions(begin_ip, entries, &loop);
+
+    if (!is_full) {
+        // Original loop is the last copy, so it jumps back to the first one
+        for (int32_t ip = begin_ip + count; ip < end_ip + count; ip++) {
+            InstructionEntry* i = instructions[ip];
+            switch (i->type) {
+                case InstructionType::Goto: {
+                    if (i->goto_statement.ip == begin_ip + count) {
+                        i->goto_statement.ip = begin_ip;
+                    }
+                    break;
+                }
+                case InstructionType::If: {
+                    if (i->if_statement.ip == begin_ip + count) {
+                        i->if_statement.ip = begin_ip;
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (is_trip_known && hint - 1 != trip.exit_iteration % hint) {
+            remove_exit_test(instructions[trip.test_ip + count]);
+        }
+
+        CreateControlFlowGraph();
+    }
+
+    return true;
+}
+
+bool Optimizer::FindTripCount(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators,
+    const std::vector<OptimizerLoop>& loops, OptimizerTripCount& trip)
+{
+    // Exit test compares induction variable to constant and only one of its targets is inside of the loop
+    int32_t var = -1;
+    int32_t test_block = -1;
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (!loop.blocks[j]) {
+            continue;
+        }
+
+        InstructionEntry* i = instructions[blocks[j].end_ip - 1];
+        if (i->type != InstructionType::If) {
+            continue;
+        }
+
+        int32_t taken = FindBlockByIp(i->if_statement.ip);
+        int32_t next = FindBlockByIp(blocks[j].end_ip);
+        bool is_taken_inside = (taken >= 0 && loop.blocks[taken]);
+        bool is_next_inside = (next >= 0 && loop.blocks[next]);
+        if (is_taken_inside == is_next_inside) {
+            continue;
+        }
+
+        InstructionOperand& op1 = i->if_statement.op1;
+        InstructionOperand& op2 = i->if_statement.op2;
+        if (op1.index.value || op2.index.value) {
+            continue;
+        }
+
+        int32_t index = -1;
+        if (op1.exp_type == ExpressionType::Variable && op2.exp_type == ExpressionType::Constant) {
+            index = FindScalarByName(op1.value);
+        } else if (op2.exp_type == ExpressionType::Variable && op1.exp_type == ExpressionType::Constant) {
+            index = FindScalarByName(op2.value);
+        }
+
+        if (index < 0 || loop.def_count[index] != 1) {
+            continue;
+        }
+
+        if (test_block >= 0) {
+            return false;
+        }
+
+        var = index;
+        test_block = (int32_t)j;
+        trip.test_ip = blocks[j].end_ip - 1;
+        trip.is_exit_taken = !is_taken_inside;
+    }
+
+    if (test_block < 0) {
+        return false;
+    }
+
+    int32_t inc_ip = -1;
+    for (size_t j = 0; j < blocks.size() && inc_ip < 0; j++) {
+        if (!loop.blocks[j]) {
+            continue;
+        }
+
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            if (GetInstructionDefinition(instructions[ip]) == var) {
+                inc_ip = ip;
+                break;
+            }
+        }
+    }
+
+    uint32_t step;
+    if (inc_ip < 0 || instructions[inc_ip]->type != InstructionType::Assign || !GetInductionStep(instructions[inc_ip], step)) {
+        return false;
+    }
+
+    // Test and step have to be executed exactly once in each iteration, so they cannot be in inner loop
+    int32_t inc_block = FindBlockByIp(inc_ip);
+    for (size_t j = 0; j < loops.size(); j++) {
+        if (loops[j].size < loop.size && (loops[j].blocks[inc_block] || loops[j].blocks[test_block])) {
+            return false;
+        }
+    }
+
+    bool is_step_first;
+    if (test_block == loop.header) {
+        if (inc_block == loop.header) {
+            // Test is the last instruction of the block, so the step precedes it
+            is_step_first = true;
+        } else {
+            for (size_t j = 0; j < blocks.size(); j++) {
+                if (loop.blocks[j] && !dominators[j][inc_block] &&
+                    std::find(blocks[j].successors.begin(), blocks[j].successors.end(), loop.header) != blocks[j].successors.end()) {
+                    return false;
+                }
+            }
+            is_step_first = false;
+        }
+    } else {
+        // Test at the end of the loop has to be the only way to the next iteration
+        for (size_t j = 0; j < blocks.size(); j++) {
+            if (loop.blocks[j] && (int32_t)j != test_block &&
+                std::find(blocks[j].successors.begin(), blocks[j].successors.end(), loop.header) != blocks[j].successors.end()) {
+                return false;
+            }
+        }
+
+        if (!dominators[test_block][inc_block]) {
+            return false;
+        }
+        is_step_first = true;
+    }
+
+    uint32_t value;
+    if (!GetInitialValue(loop, var, value)) {
+        return false;
+    }
+
+    std::vector<OptimizerValue> values(scalars.size(), { OptimizerValueState::Overdefined, 0 });
+    int32_t size = compiler->GetSymbolTypeSize(scalars[var]->type);
+    InstructionEntry* test = instructions[trip.test_ip];
+
+    for (int32_t k = 0; k < UnrollLoopMaxEvaluatedIterations; k++) {
+        if (is_step_first) {
+            value = TruncateValue(value + step, size);
+        }
+
+        values[var] = { OptimizerValueState::Constant, value };
+        OptimizerValue result = EvaluateIf(test, values);
+        if (result.state != OptimizerValueState::Constant) {
+            return false;
+        }
+
+        if ((result.value != 0) == trip.is_exit_taken) {
+            trip.exit_iteration = k;
+            trip.iterations = k + (is_step_first ? 1 : 0);
+            return true;
+        }
+
+        if (!is_step_first) {
+            value = TruncateValue(value + step, size);
+        }
+    }
+
+    return false;
+}
+
+bool Optimizer::CanInsertPreheader(const OptimizerLoop& loop)
+{
+    int32_t header_ip = blocks[loop.header].begin_ip;
+
+    // Labels cannot distinguish jumps from inside and outside of the loop
+    std::unordered_map<std::string, int32_t>::iterator it = function_labels.begin();
+    while (it != function_labels.end()) {
+        if (it->second == header_ip) {
+            return false;
+        }
+        ++it;
+    }
+
+    // Preheader is inserted before the header, so the loop cannot fall through to the header
+    std::vector<int32_t>& header_predecessors = blocks[loop.header].predecessors;
+    for (size_t j = 0; j < header_predecessors.size(); j++) {
+        if (loop.blocks[header_predecessors[j]] && blocks[header_predecessors[j]].end_ip == header_ip) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Optimizer::InsertInstructions(int32_t ip, const std::vector<InstructionEntry*>& entries, const OptimizerLoop* loop)
+{
+    int32_t count = (int32_t)entries.size();
+
+    // Jumps to specified IP execute the new instructions, only jumps inside of the loop skip them
+    for (int32_t k = 0; k < (int32_t)instructions.size(); k++) {
+        InstructionEntry* i = instructions[k];
+
+        int32_t* target_ip;
+        switch (i->type) {
+            case InstructionType::Goto: target_ip = &i->goto_statement.ip; break;
+            case InstructionType::If: target_ip = &i->if_statement.ip; break;
+
+            default: continue;
+        }
+
+        if (*target_ip > ip) {
+            *target_ip += count;
+        } else if (*target_ip == ip && loop) {
+            int32_t block = FindBlockByIp(k);
+            if (block >= 0 && loop->blocks[block]) {
+                *target_ip += count;
+            }
+        }
+    }
+
+    SymbolTableEntry* symbol = compiler->GetSymbols();
+    while (symbol) {
+        if (symbol->ip > ip) {
+            symbol->ip += count;
+        }
+
+        symbol = symbol->next;
+    }
+
+    // Link new instructions before the instruction at specified IP
+    for (int32_t j = 0; j < count - 1; j++) {
+        entries[j]->next = entries[j + 1];
+    }
+    entries[count - 1]->next = (ip < (int32_t)instructions.size() ? instructions[ip] : nullptr);
+    instructions[ip - 1]->next = entries[0];
+
+    instructions.insert(instructions.begin() + ip, entries.begin(), entries.end());
+
+    // Labels were moved too, so all function symbols have to be collected again
+    SelectFunction(function, function_end_ip + count);
+    CreateControlFlowGraph();
+}
+
+void Optimizer::ComputeDominators(std::vector<std::vector<bool>>& dominators)
+{
+    // Unreachable blocks are not dominated by any block
+    std::vector<bool> is_reachable(blocks.size(), false);
+
+    std::vector<int32_t> worklist;
+    worklist.push_back(0);
+    is_reachable[0] = true;
+
+    while (!worklist.empty()) {
+        int32_t block = worklist.back();
+        worklist.pop_back();
+
+        std::vector<int32_t>& successors = blocks[block].successors;
+        for (size_t j = 0; j < successors.size(); j++) {
+            if (!is_reachable[successors[j]]) {
+                is_reachable[successors[j]] = true;
+                worklist.push_back(successors[j]);
+            }
+        }
+    }
+
+    dominators.assign(blocks.size(), std::vector<bool>(blocks.size(), false));
+    for (size_t j = 1; j < blocks.size(); j++) {
+        if (is_reachable[j]) {
+            dominators[j].assign(blocks.size(), true);
+        }
+    }
+    dominators[0][0] = true;
+
+    bool changed;
+    do {
+        changed = false;
+
+        for (size_t j = 1; j < blocks.size(); j++) {
+            if (!is_reachable[j]) {
+                continue;
+            }
+
+            std::vector<bool> dom(blocks.size(), true);
+
+            std::vector<int32_t>& predecessors = blocks[j].predecessors;
+            for (size_t k = 0; k < predecessors.size(); k++) {
+                if (!is_reachable[predecessors[k]]) {
+                    continue;
+                }
+
+                std::vector<bool>& pred_dom = dominators[predecessors[k]];
+                for (size_t l = 0; l < blocks.size(); l++) {
+                    if (!pred_dom[l]) {
+                        dom[l] = false;
+                    }
+                }
+            }
+            dom[j] = true;
+
+            if (dom != dominators[j]) {
+                dominators[j] = dom;
+                changed = true;
+            }
+        }
+    } while (changed);
+}
+
+void Optimizer::FindLoops(const std::vector<std::vector<bool>>& dominators, std::vector<OptimizerLoop>& loops)
+{
+    loops.clear();
+
+    // Edge to a block that dominates its source is a back edge of natural loop
+    for (size_t j = 0; j < blocks.size(); j++) {
+        std::vector<int32_t>& successors = blocks[j].successors;
+        for (size_t k = 0; k < successors.size(); k++) {
+            int32_t header = successors[k];
+            if (!dominators[j][header]) {
+                continue;
+            }
+
+            // Loops with the same header are merged
+            OptimizerLoop* loop = nullptr;
+            for (size_t l = 0; l < loops.size(); l++) {
+                if (loops[l].header == header) {
+                    loop = &loops[l];
+                    break;
+                }
+            }
+
+            if (!loop) {
+                loops.emplace_back();
+                loop = &loops.back();
+                loop->header = header;
+                loop->blocks.assign(blocks.size(), false);
+                loop->blocks[header] = true;
+                loop->size = 1;
+            }
+
+            // All blocks that can reach the back edge without passing the header belong to the loop
+            std::vector<int32_t> worklist;
+            if (!loop->blocks[j]) {
+                loop->blocks[j] = true;
+                loop->size++;
+                worklist.push_back((int32_t)j);
+            }
+
+            while (!worklist.empty()) {
+                int32_t block = worklist.back();
+                worklist.pop_back();
+
+                std::vector<int32_t>& predecessors = blocks[block].predecessors;
+                for (size_t l = 0; l < predecessors.size(); l++) {
+                    if (!loop->blocks[predecessors[l]]) {
+                        loop->blocks[predecessors[l]] = true;
+                        loop->size++;
+                        worklist.push_back(predecessors[l]);
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t j = 0; j < loops.size(); j++) {
+        AnalyzeLoop(loops[j]);
+    }
+
+    std::sort(loops.begin(), loops.end(), [](const OptimizerLoop& a, const OptimizerLoop& b) {
+        return a.size < b.size;
+    });
+}
+
+void Optimizer::AnalyzeLoop(OptimizerLoop& loop)
+{
+    loop.def_count.assign(scalars.size(), 0);
+    loop.assigned_symbols.clear();
+    loop.has_call = false;
+    loop.has_store = false;
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        if (!loop.blocks[j]) {
+            continue;
+        }
+
+        for (int32_t ip = blocks[j].begin_ip; ip < blocks[j].end_ip; ip++) {
+            InstructionEntry* i = instructions[ip];
+
+            int32_t def = GetInstructionDefinition(i);
+            if (def >= 0) {
+                loop.def_count[def]++;
+            }
+
+            if (i->type == InstructionType::Call) {
+                loop.has_call = true;
+            } else if (i->type == InstructionType::Assign) {
+                if (i->assignment.dst_index.value) {
+                    loop.has_store = true;
+                } else {
+                    loop.assigned_symbols.insert(i->assignment.dst_value);
+                }
+            }
+        }
+    }
+}
+
+void Optimizer::ComputeLiveVariables(std::vector<std::vector<bool>>& live_in, std::vector<std::vector<bool>>& live_out)
+{
+    size_t scalar_count = scalars.size();
+
+    // Variables read before they are written in block and variables written in block
+    std::vector<std::vector<bool>> block_use(blocks.size(), std::vector<bool>(scalar_count, false));
+    std::vector<std::vector<bool>> block_def(blocks.size(), std::vector<bool>(scalar_count, false));
+    std::vector<int32_t> uses;
+
+    for (size_t j = 0; j < blocks.size(); j++) {
+        for (int32_t ip = blocks[j].end_ip - 1; ip >= blocks[j].begin_ip; ip--) {
+            InstructionEntry* i = instructions[ip];
+
+            int32_t def = GetInstructionDefinition(i);
+            if (def >= 0) {
+                block_def[j][def] = true;
+                block_use[j][def] = false;
+            }
+
+            GetInstructionUses(i, uses);
+            for (size_t k = 0; k < uses.size(); k++) {
+                block_use[j][uses[k]] = true;
+            }
+        }
+    }
+
+    // Local variables are not live after the function returns
+    live_in.assign(blocks.size(), std::vector<bool>(scalar_count, false));
+    live_out.assign(blocks.size(), std::vector<bool>(scalar_count, false));
+
+    bool changed;
+    do {
+        changed = false;
+
+        for (int32_t j = (int32_t)blocks.size() - 1; j >= 0; j--) {
+            std::vector<bool>& out = live_out[j];
+
+            std::vector<int32_t>& successors = blocks[j].successors;
+            for (size_t k = 0; k < successors.size(); k++) {
+                std::vector<bool>& in = live_in[successors[k]];
+                for (size_t l = 0; l < scalar_count; l++) {
+                    if (in[l]) {
+                        out[l] = true;
+                    }
+                }
+            }
+
+            for (size_t l = 0; l < scalar_count; l++) {
+                bool is_live = (block_use[j][l] || (out[l] && !block_def[j][l]));
+                if (is_live && !live_in[j][l]) {
+                    live_in[j][l] = true;
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+}
+
+void Optimizer::GetInstructionUses(InstructionEntry* i, std::vector<int32_t>& uses)
+{
+    uses.clear();
+
+    auto use_operand = [&](const char* value, ExpressionType exp_type) {
+        if (exp_type == ExpressionType::Variable) {
+            int32_t index = FindScalarByName(value);
+            if (index >= 0) {
+                uses.push_back(index);
+            }
+        }
+    };
+
+    auto use_index = [&](const InstructionOperandIndex& index) {
+        if (index.value) {
+            use_operand(index.value, index.exp_type);
+        }
+    };
+
+    switch (i->type) {
+        case InstructionType::Assign: {
+            use_index(i->assignment.dst_index);
+
+            use_operand(i->assignment.op1.value, i->assignment.op1.exp_type);
+            use_index(i->assignment.op1.index);
+
+            if (i->assignment.type != AssignType::None && i->assignment.type != AssignType::Negation) {
+                use_operand(i->assignment.op2.value, i->assignment.op2.exp_type);
+                use_index(i->assignment.op2.index);
+            }
+            break;
+        }
+        case InstructionType::If: {
+            use_operand(i->if_statement.op1.value, i->if_statement.op1.exp_type);
+            use_index(i->if_statement.op1.index);
+            use_operand(i->if_statement.op2.value, i->if_statement.op2.exp_type);
+            use_index(i->if_statement.op2.index);
+            break;
+        }
+        case InstructionType::Switch: {
+            use_operand(i->switch_statement.op.value, i->switch_statement.op.exp_type);
+            use_index(i->switch_statement.op.index);
+            break;
+        }
+        case InstructionType::Push: {
+            use_operand(i->push_statement.symbol->name, i->push_statement.symbol->exp_type);
+            break;
+        }
+        case InstructionType::Return: {
+            if (i->return_statement.op.value) {
+                use_operand(i->return_statement.op.value, i->return_statement.op.exp_type);
+                use_index(i->return_statement.op.index);
+            }
+            break;
+        }
+    }
+}
+
+int32_t Optimizer::GetInstructionDefinition(InstructionEntry* i)
+{
+    switch (i->type) {
+        case InstructionType::Assign: {
+            if (i->assignment.dst_index.value) {
+                return -1;
+            }
+
+            return FindScalarByName(i->assignment.dst_value);
+        }
+        case InstructionType::Call: {
+            return FindScalarByName(i->call_statement.return_symbol);
+        }
+    }
+
+    return -1;
+}
+
+void Optimizer::PropagateInstruction(InstructionEntry* i, std::vector<OptimizerValue>& values)
+{
+    switch (i->type) {
+        case InstructionType::Assign: {
+            int32_t dst = FindScalarByName(i->assignment.dst_value);
+            if (dst >= 0) {
+                values[dst] = EvaluateAssign(i, values);
+            }
+            break;
+        }
+        case InstructionType::Call: {
+            int32_t dst = FindScalarByName(i->call_statement.return_symbol);
+            if (dst >= 0) {
+                values[dst] = { OptimizerValueState::Overdefined, 0 };
+            }
+            break;
+        }
+    }
+}
+
+bool Optimizer::FoldInstruction(InstructionEntry* i, const std::vector<OptimizerValue>& values)
+{
+    switch (i->type) {
+        case InstructionType::Assign: {
+            bool changed = ReplaceIndexIfConstant(i->assignment.dst_index, values);
+
+            SymbolType dst_type;
+            if (!GetAssignDestinationType(i, dst_type) || !IsScalarType(dst_type)) {
+                // Pointer arithmetic and strings are not folded
+                changed |= ReplaceIndexIfConstant(i->assignment.op1.index, values);
+                changed |= ReplaceIndexIfConstant(i->assignment.op2.index, values);
+                return changed;
+            }
+
+            OptimizerValue result = EvaluateAssign(i, values);
+            if (result.state == OptimizerValueState::Constant) {
+                if (i->assignment.type == AssignType::None && i->assignment.op1.exp_type == ExpressionType::Constant &&
+                    (uint32_t)atoi(i->assignment.op1.value) == result.value) {
+                    // Already folded
+                    return changed;
+                }
+
+                i->assignment.type = AssignType::None;
+                i->assignment.op1.value = ValueToString(result.value);
+                i->assignment.op1.type = dst_type;
+                i->assignment.op1.exp_type = ExpressionType::Constant;
+                i->assignment.op1.index.value = nullptr;
+                i->assignment.op2.value = nullptr;
+                i->assignment.op2.exp_type = ExpressionType::None;
+                i->assignment.op2.index.value = nullptr;
+                return true;
+            }
+
+            changed |= ReplaceIndexIfConstant(i->assignment.op1.index, values);
+            changed |= ReplaceIndexIfConstant(i->assignment.op2.index, values);
+
+            // Only emitters of addition and subtraction can handle constant in any operand,
+            // the remaining ones are folded only if all operands are known
+            if (i->assignment.type == AssignType::Add || i->assignment.type == AssignType::Subtract) {
+                if (i->assignment.op1.exp_type != ExpressionType::Constant &&
+                    i->assignment.op2.exp_type != ExpressionType::Constant) {
+
+                    changed |= ReplaceOperandIfConstant(i->assignment.op1, values);
+                    if (i->assignment.op1.exp_type != ExpressionType::Constant) {
+                        changed |= ReplaceOperandIfConstant(i->assignment.op2, values);
+                    }
+                }
+            }
+            return changed;
+        }
+
+        case InstructionType::If: {
+            OptimizerValue condition = EvaluateIf(i, values);
+            if (condition.state == OptimizerValueState::Constant) {
+                if (condition.value) {
+                    int32_t target_ip = i->if_statement.ip;
+                    i->type = InstructionType::Goto;
+                    i->goto_statement.ip = target_ip;
+                } else {
+                    i->type = InstructionType::Nop;
+                }
+                return true;
+            }
+
+            if (i->if_statement.type == CompareType::LogOr || i->if_statement.type == CompareType::LogAnd ||
+                i->if_statement.op1.type.base == BaseSymbolType::String ||
+                i->if_statement.op2.type.base == BaseSymbolType::String ||
+                i->if_statement.op1.exp_type == ExpressionType::Constant ||
+                i->if_statement.op2.exp_type == ExpressionType::Constant) {
+                return false;
+            }
+
+            // Comparison is performed with size of the first variable,
+            // so the first operand can be replaced only if both have the same size
+            if (ReplaceOperandIfConstant(i->if_statement.op2, values)) {
+                return true;
+            }
+
+            int32_t op1 = FindScalarByName(i->if_statement.op1.value);
+            int32_t op2 = FindScalarByName(i->if_statement.op2.value);
+            if (op1 >= 0 && op2 >= 0 &&
+                compiler->GetSymbolTypeSize(scalars[op1]->type) == compiler->GetSymbolTypeSize(scalars[op2]->type)) {
+
+                return ReplaceOperandIfConstant(i->if_statement.op1, values);
+            }
+            return false;
+        }
+
+        case InstructionType::Push: {
+            SymbolTableEntry* symbol = i->push_statement.symbol;
+            if (symbol->exp_type != ExpressionType::Variable) {
+                return false;
+            }
+
+            int32_t index = FindScalarByName(symbol->name);
+            if (index < 0 || values[index].state != OptimizerValueState::Constant) {
+                return false;
+            }
+
+            symbol->name = ValueToString(values[index].value);
+            symbol->exp_type = ExpressionType::Constant;
+            return true;
+        }
+
+        case InstructionType::Return: {
+            if (!i->return_statement.op.value) {
+                return false;
+            }
+
+            return ReplaceOperandIfConstant(i->return_statement.op, values);
+        }
+    }
+
+    return false;
+}
+
+OptimizerValue Optimizer::EvaluateOperand(const InstructionOperand& op, const std::vector<OptimizerValue>& values)
+{
+    if (op.index.value) {
+        return { OptimizerValueState::Overdefined, 0 };
+    }
+
+    switch (op.exp_type) {
+        case ExpressionType::Constant: {
+            if (!IsScalarType(op.type)) {
+                return { OptimizerValueState::Overdefined, 0 };
+            }
+
+            return { OptimizerValueState::Constant, (uint32_t)atoi(op.value) };
+        }
+        case ExpressionType::Variable: {
+            int32_t index = FindScalarByName(op.value);
+            if (index < 0) {
+                return { OptimizerValueState::Overdefined, 0 };
+            }
+
+            return values[index];
+        }
+
+        default: return { OptimizerValueState::Overdefined, 0 };
+    }
+}
+
+OptimizerValue Optimizer::EvaluateAssign(InstructionEntry* i, const std::vector<OptimizerValue>& values)
+{
+    SymbolType dst_type;
+    if (!GetAssignDestinationType(i, dst_type) || !IsScalarType(dst_type)) {
+        return { OptimizerValueState::Overdefined, 0 };
+    }
+
+    bool has_two_operands = (i->assignment.type != AssignType::None && i->assignment.type != AssignType::Negation);
+
+    OptimizerValue op1 = EvaluateOperand(i->assignment.op1, values);
+    OptimizerValue op2 = (has_two_operands ? EvaluateOperand(i->assignment.op2, values) : op1);
+
+    if (op1.state == OptimizerValueState::Overdefined || op2.state == OptimizerValueState::Overdefined) {
+        return { OptimizerValueState::Overdefined, 0 };
+    }
+    if (op1.state == OptimizerValueState::Undefined || op2.state == OptimizerValueState::Undefined) {
+        return { OptimizerValueState::Undefined, 0 };
+    }
+
+    int32_t dst_size = compiler->GetSymbolTypeSize(dst_type);
+
+    uint32_t a = op1.value;
+    uint32_t b = op2.value;
+
+    // Division and right shift depend on upper bits, so operands must fit to destination
+    bool operands_fit = (a == TruncateValue(a, dst_size) && b == TruncateValue(b, dst_size));
+
+    uint32_t result;
+    switch (i->assignment.type) {
+        case AssignType::None:     result = a; break;
+        case AssignType::Negation: result = 0 - a; break;
+
+        case AssignType::Add:      result = a + b; break;
+        case AssignType::Subtract: result = a - b; break;
+        case AssignType::Multiply: result = a * b; break;
+
+        case AssignType::Divide:
+        case AssignType::Remainder: {
+            if (!operands_fit || b == 0) {
+                return { OptimizerValueState::Overdefined, 0 };
+            }
+
+            result = (i->assignment.type == AssignType::Divide ? a / b : a % b);
+            break;
+        }
+
+        case AssignType::ShiftLeft:
+        case AssignType::ShiftRight: {
+            if (b >= (uint32_t)dst_size * 8 || (i->assignment.type == AssignType::ShiftRight && !operands_fit)) {
+                return { OptimizerValueState::Overdefined, 0 };
+            }
+
+            result = (i->assignment.type == AssignType::ShiftLeft ? a << b : a >> b);
+            break;
+        }
+
+        default: return { OptimizerValueState::Overdefined, 0 };
+    }
+
+    return { OptimizerValueState::Constant, TruncateValue(result, dst_size) };
+}
+
+OptimizerValue Optimizer::EvaluateIf(InstructionEntry* i, const std::vector<OptimizerValue>& values)
+{
+    InstructionOperand& op1 = i->if_statement.op1;
+    InstructionOperand& op2 = i->if_statement.op2;
+
+    if (op1.type.base == BaseSymbolType::String || op2.type.base == BaseSymbolType::String) {
+        return { OptimizerValueState::Overdefined, 0 };
+    }
+
+    OptimizerValue value1 = EvaluateOperand(op1, values);
+    OptimizerValue value2 = EvaluateOperand(op2, values);
+
+    if (value1.state == OptimizerValueState::Overdefined || value2.state == OptimizerValueState::Overdefined) {
+        return { OptimizerValueState::Overdefined, 0 };
+    }
+    if (value1.state == OptimizerValueState::Undefined || value2.state == OptimizerValueState::Undefined) {
+        return { OptimizerValueState::Undefined, 0 };
+    }
+
+    // Emitter compares unsigned values with size of the first variable operand,
+    // comparison of two constants is evaluated as signed
+    int32_t size = 0;
+    int32_t index1 = (op1.exp_type == ExpressionType::Variable ? FindScalarByName(op1.value) : -1);
+    int32_t index2 = (op2.exp_type == ExpressionType::Variable ? FindScalarByName(op2.value) : -1);
+    if (index1 >= 0) {
+        size = compiler->GetSymbolTypeSize(scalars[index1]->type);
+
+        if (index2 >= 0 && size != compiler->GetSymbolTypeSize(scalars[index2]->type)) {
+            return { OptimizerValueState::Overdefined, 0 };
+        }
+    } else if (index2 >= 0) {
+        size = compiler->GetSymbolTypeSize(scalars[index2]->type);
+    }
+
+    uint32_t a = value1.value;
+    uint32_t b = value2.value;
+
+    bool result;
+    if (size == 0) {
+        int32_t sa = (int32_t)a;
+        int32_t sb = (int32_t)b;
+
+        switch (i->if_statement.type) {
+            case CompareType::LogOr:          result = (sa || sb); break;
+            case CompareType::LogAnd:         result = (sa && sb); break;
+
+            case CompareType::Equal:          result = (sa == sb); break;
+            case CompareType::NotEqual:       result = (sa != sb); break;
+            case CompareType::Greater:        result = (sa > sb); break;
+            case CompareType::Less:           result = (sa < sb); break;
+            case CompareType::GreaterOrEqual: result = (sa >= sb); break;
+            case CompareType::LessOrEqual:    result = (sa <= sb); break;
+
+            default: return { OptimizerValueState::Overdefined, 0 };
+        }
+    } else {
+        a = TruncateValue(a, size);
+        b = TruncateValue(b, size);
+
+        switch (i->if_statement.type) {
+            case CompareType::LogOr:          result = (a || b); break;
+            case CompareType::LogAnd:         result = (a && b); break;
+
+            case CompareType::Equal:          result = (a == b); break;
+            case CompareType::NotEqual:       result = (a != b); break;
+            case CompareType::Greater:        result = (a > b); break;
+            case CompareType::Less:           result = (a < b); break;
+            case CompareType::GreaterOrEqual: result = (a >= b); break;
+            case CompareType::LessOrEqual:    result = (a <= b); break;
+
+            default: return { OptimizerValueState::Overdefined, 0 };
+        }
+    }
+
+    return { OptimizerValueState::Constant, (uint32_t)result };
+}
+
+bool Optimizer::GetAssignDestinationType(InstructionEntry* i, SymbolType& type)
+{
+    SymbolTableEntry* dst = FindSymbolByName(i->assignment.dst_value);
+    if (!dst) {
+        return false;
+    }
+
+    type = dst->type;
+
+    if (i->assignment.dst_index.value) {
+        // Value is stored to array item
+        if (type.pointer == 0) {
+            return false;
+        }
+
+        type.pointer--;
+    }
+
+    return true;
+}
+
+bool Optimizer::ReplaceOperandIfConstant(InstructionOperand& op, const std::vector<OptimizerValue>& values)
+{
+    if (op.exp_type != ExpressionType::Variable || op.index.value) {
+        return false;
+    }
+
+    int32_t index = FindScalarByName(op.value);
+    if (index < 0 || values[index].state != OptimizerValueState::Constant) {
+        return false;
+    }
+
+    op.value = ValueToString(values[index].value);
+    op.type = scalars[index]->type;
+    op.exp_type = ExpressionType::Constant;
+    return true;
+}
+
+bool Optimizer::ReplaceIndexIfConstant(InstructionOperandIndex& index, const std::vector<OptimizerValue>& values)
+{
+    if (!index.value || index.exp_type != ExpressionType::Variable) {
+        return false;
+    }
+
+    int32_t scalar = FindScalarByName(index.value);
+    if (scalar < 0 || values[scalar].state != OptimizerValueState::Constant) {
+        return false;
+    }
+
+    index.value = ValueToString(values[scalar].value);
+    index.type = scalars[scalar]->type;
+    index.exp_type = ExpressionType::Constant;
+    return true;
+}
+
+void Optimizer::ForEachVariable(InstructionEntry* i, const std::function<void(char*& value)>& callback)
+{
+    auto visit = [&](char*& value, ExpressionType exp_type) {
+        if (value && exp_type == ExpressionType::Variable) {
+            callback(value);
+        }
+    };
+
+    switch (i->type) {
+        case InstructionType::Assign: {
+            if (i->assignment.dst_value) {
+                callback(i->assignment.dst_value);
+            }
+            visit(i->assignment.dst_index.value, i->assignment.dst_index.exp_type);
+            visit(i->assignment.op1.value, i->assignment.op1.exp_type);
+            visit(i->assignment.op1.index.value, i->assignment.op1.index.exp_type);
+
+            if (i->assignment.type != AssignType::None && i->assignment.type != AssignType::Negation) {
+                visit(i->assignment.op2.value, i->assignment.op2.exp_type);
+                visit(i->assignment.op2.index.value, i->assignment.op2.index.exp_type);
+            }
+            break;
+        }
+        case InstructionType::If: {
+            visit(i->if_statement.op1.value, i->if_statement.op1.exp_type);
+            visit(i->if_statement.op1.index.value, i->if_statement.op1.index.exp_type);
+            visit(i->if_statement.op2.value, i->if_statement.op2.exp_type);
+            visit(i->if_statement.op2.index.value, i->if_statement.op2.index.exp_type);
+            break;
+        }
+        case InstructionType::Switch: {
+            visit(i->switch_statement.op.value, i->switch_statement.op.exp_type);
+            visit(i->switch_statement.op.index.value, i->switch_statement.op.index.exp_type);
+            break;
+        }
+        case InstructionType::Push: {
+            visit(i->push_statement.symbol->name, i->push_statement.symbol->exp_type);
+            break;
+        }
+        case InstructionType::Call: {
+            if (i->call_statement.return_symbol) {
+                callback(i->call_statement.return_symbol);
+            }
+            break;
+        }
+        case InstructionType::Return: {
+            visit(i->return_statement.op.value, i->return_statement.op.exp_type);
+            visit(i->return_statement.op.index.value, i->return_statement.op.index.exp_type);
+            break;
+        }
+    }
+}
+
+bool Optimizer::AreOperandsEqual(const InstructionOperand& a, const InstructionOperand& b)
+{
+    if (a.exp_type != b.exp_type || a.type != b.type) {
+        return false;
+    }
+
+    if (a.exp_type != ExpressionType::Constant && a.exp_type != ExpressionType::Variable) {
+        return false;
+    }
+
+    if (strcmp(a.value, b.value) != 0) {
+        return false;
+    }
+
+    if (!a.index.value || !b.index.value) {
+        return (!a.index.value && !b.index.value);
+    }
+
+    return (strcmp(a.index.value, b.index.value) == 0);
+}
+
+CompareType Optimizer::GetInvertedCompareType(CompareType type)
+{
+    switch (type) {
+        case CompareType::Equal:          return CompareType::NotEqual;
+        case CompareType::NotEqual:       return CompareType::Equal;
+        case CompareType::Greater:        return CompareType::LessOrEqual;
+        case CompareType::Less:           return CompareType::GreaterOrEqual;
+        case CompareType::GreaterOrEqual: return CompareType::Less;
+        case CompareType::LessOrEqual:    return CompareType::Greater;
+
+        default: return CompareType::None;
+    }
+}
+
+OptimizerValue Optimizer::MeetValues(const OptimizerValue& a, const OptimizerValue& b)
+{
+    if (a.state == OptimizerValueState::Undefined) {
+        return b;
+    }
+    if (b.state == OptimizerValueState::Undefined) {
+        return a;
+    }
+    if (a.state == OptimizerValueState::Constant && b.state == OptimizerValueState::Constant && a.value == b.value) {
+        return a;
+    }
+
+    return { OptimizerValueState::Overdefined, 0 };
+}
+
+bool Optimizer::IsScalarType(SymbolType type)
+{
+    return (type.pointer == 0 &&
+            (type.base == BaseSymbolType::Bool   || type.base == BaseSymbolType::Uint8 ||
+             type.base == BaseSymbolType::Uint16 || type.base == BaseSymbolType::Uint32));
+}
+
+uint32_t Optimizer::TruncateValue(uint32_t value, int32_t size)
+{
+    if (size >= 4) {
+        return value;
+    }
+
+    return value & ((1u << (size * 8)) - 1);
+}
+
+char* Optimizer::ValueToString(uint32_t value)
+{
+    // Values are stored as signed, because emitter parses them with "atoi"
+    return _strdup(std::to_string((int32_t)value).c_str());
+}
@@ -0,0 +1,870 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+
+#include "InstructionEntry.h"
+#include "SymbolTableEntry.h"
+
+class Compiler;
+
+/// <summary>
+/// Maximum number of instructions of leaf function, that is inlined even without "inline" keyword
+/// </summary>
+#define InlineLeafFunctionSize 8
+
+/// <summary>
+/// Maximum number of instructions of function, that is copied to specialize it for constant arguments
+/// </summary>
+#define SpecializeFunctionMaxSize 32
+
+/// <summary>
+/// Maximum number of specialized copies of one function
+/// </summary>
+#define SpecializeFunctionMaxCount 2
+
+/// <summary>
+/// Cost of one load or store of static variable promoted to local variable, compared to one reference
+/// </summary>
+#define PromoteStaticLoadCost 4
+
+/// <summary>
+/// Weight of loads and stores inside of loops, when static variable is considered to be promoted to local variable
+/// </summary>
+#define PromoteStaticLoopWeight 8
+
+/// <summary>
+/// Maximum number of iterations of loop, that is fully unrolled even without "#unroll" directive
+/// </summary>
+#define UnrollLoopMaxTripCount 8
+
+/// <summary>
+/// Maximum number of instructions of fully unrolled loop without "#unroll" directive
+/// </summary>
+#define UnrollLoopMaxSize 64
+
+/// <summary>
+/// Maximum number of iterations, that are evaluated to find trip count of loop
+/// </summary>
+#define UnrollLoopMaxEvaluatedIterations 65536
+
+/// <summary>
+/// Maximum size in bytes of constant-size allocation, that is placed on the stack instead of heap
+/// </summary>
+#define StackAllocMaxSize 32
+
+/// <summary>
+/// Maximum size in bytes of all local variables of function after inlining or allocation on the stack,
+/// the stack frame is addressed by 8-bit displacement
+/// </summary>
+#define StackAllocMaxFrameSize 126
+
+/// <summary>
+/// State of variable value in constant propagation lattice
+/// </summary>
+enum struct OptimizerValueState {
+    Undefined,      // No value reached the variable yet
+    Constant,       // Variable has the same constant value on all paths
+    Overdefined     // Value of variable is not known at compile time
+};
+
+struct OptimizerValue {
+    OptimizerValueState state;
+    uint32_t value;
+};
+
+inline bool operator==(const OptimizerValue& lhs, const OptimizerValue& rhs)
+{
+    return lhs.state == rhs.state && (lhs.state != OptimizerValueState::Constant || lhs.value == rhs.value);
+}
+
+inline bool operator!=(const OptimizerValue& lhs, const OptimizerValue& rhs)
+{
+    return !(lhs == rhs);
+}
+
+/// <summary>
+/// Basic block of abstract instructions, it can be entered only at the first
+/// instruction and left only after the last instruction
+/// </summary>
+struct OptimizerBlock {
+    int32_t begin_ip;
+    int32_t end_ip;
+
+    std::vector<int32_t> successors;
+    std::vector<int32_t> predecessors;
+};
+
+/// <summary>
+/// Assignment that copies value of one tracked variable to another
+/// </summary>
+struct OptimizerCopy {
+    int32_t dst;
+    int32_t src;
+};
+
+/// <summary>
+/// Expression computed by assignment, whose result is held by a tracked variable
+/// </summary>
+struct OptimizerExpression {
+    std::string key;
+    int32_t holder;
+
+    std::vector<int32_t> operands;
+    const char* base;               // Array or pointer, if the expression loads an item
+};
+
+/// <summary>
+/// Call of function, whose parameters are all pushed right before the "call" instruction
+/// </summary>
+struct OptimizerCallSite {
+    int32_t push_ip;                // First "push" of parameters
+    int32_t call_ip;
+    SymbolTableEntry* callee;
+    int32_t callee_end_ip;
+};
+
+/// <summary>
+/// Natural loop in control flow graph, it can be entered only through its header
+/// </summary>
+struct OptimizerLoop {
+    int32_t header;
+    std::vector<bool> blocks;       // Blocks that belong to the loop
+    int32_t size;
+
+    std::vector<int32_t> def_count; // Number of assignments to each tracked variable
+    std::set<std::string> assigned_symbols;
+    bool has_call;
+    bool has_store;                 // Any item is assigned through pointer
+};
+
+/// <summary>
+/// Number of iterations of loop with constant initial value, step and limit of induction variable
+/// </summary>
+struct OptimizerTripCount {
+    int32_t iterations;             // Number of executions of the loop body
+    int32_t exit_iteration;         // Iteration, in which the exit test leaves the loop
+    int32_t test_ip;
+    bool is_exit_taken;             // Exit test leaves the loop by jump, not by falling through
+};
+
+/// <summary>
+/// Optimization pass, that can be individually enabled or disabled
+/// </summary>
+enum struct OptimizerPass {
+    EliminateTailCalls,         // "tailcall"
+    InlineFunctions,            // "inline"
+    PropagateArguments,         // "argprop"
+    PromoteStatics,             // "promote"
+    UnrollLoops,                // "unroll"
+    PropagateConstants,         // "sccp"
+    RemoveUnreachableBlocks,    // "unreachable"
+    CoalesceTemporaryMoves,     // "coalesce"
+    EliminateSubexpressions,    // "cse"
+    PropagateCopies,            // "copyprop"
+    HoistLoopInvariants,        // "licm"
+    ReduceInductionVariables,   // "ivr"
+    HashStringComparisons,      // "strhash"
+    AllocateOnStack,            // "stackalloc"
+    ThreadJumps,                // "jumpthread"
+    RemoveDeadCode,             // "dce"
+
+    Count
+};
+
+/// <summary>
+/// Optimization level, that selects default set of passes
+/// </summary>
+enum struct OptimizationLevel {
+    None,       // "/O0" - fastest compilation
+    Basic,      // "/O1" - only cheap passes that don't grow the code
+    Full,       // "/O2" - all passes
+    Size        // "/Os" - all passes that don't duplicate code
+};
+
+/// <summary>
+/// Accumulated statistics of one optimization pass
+/// </summary>
+struct OptimizerPassStats {
+    int32_t runs;
+    int32_t changes;
+    std::chrono::high_resolution_clock::duration time;
+};
+
+/// <summary>
+/// Class that performs machine-independent optimizations of abstract instructions,
+/// instructions are rewritten in place, only loop preheaders are inserted
+/// and all IPs (instruction pointers) are shifted accordingly
+/// </summary>
+class Optimizer
+{
+public:
+    Optimizer(Compiler* compiler, uint32_t passes);
+    ~Optimizer();
+
+    /// <summary>
+    /// Optimize all referenced functions in instruction stream
+    /// </summary>
+    /// <param name="instruction_stream">Instruction stream</param>
+    void OptimizeInstructions(InstructionEntry* instruction_stream);
+
+    /// <summary>
+    /// Get set of passes enabled by optimization level
+    /// </summary>
+    /// <param name="level">Optimization level</param>
+    /// <returns>Bit mask of enabled passes</returns>
+    static uint32_t GetPassesForLevel(OptimizationLevel level);
+
+    /// <summary>
+    /// Enable or disable passes by comma-separated list of names, e.g. "+licm,-inline"
+    /// </summary>
+    /// <param name="list">List of pass names, each prefixed by "+" or "-"</param>
+    /// <param name="passes">Bit mask of enabled passes to be modified</param>
+    /// <returns>False if the list contains unknown pass</returns>
+    static bool ParsePassList(const wchar_t* list, uint32_t& passes);
+
+private:
+    /// <summary>
+    /// Run the pass if it's enabled and accumulate its statistics
+    /// </summary>
+    /// <param name="pass">Pass type</param>
+    /// <param name="run">Callback that runs the pass</param>
+    /// <returns>Number of changes made by the pass, zero if the pass is disabled</returns>
+    int32_t RunPass(OptimizerPass pass, const std::function<int32_t()>& run);
+
+    /// <summary>
+    /// Check if the pass is enabled
+    /// </summary>
+    bool IsPassEnabled(OptimizerPass pass);
+
+    /// <summary>
+    /// Log accumulated statistics of all passes, that were run
+    /// </summary>
+    void LogPassStats();
+
+    /// <summary>
+    /// Collect all functions and entry point sorted by their IP, every function ends where the next one begins
+    /// </summary>
+    /// <param name="functions">Found functions</param>
+    void FindFunctions(std::vector<SymbolTableEntry*>& functions);
+
+    /// <summary>
+    /// Compute size of all local variables of function in stack, including temporary variables
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    /// <param name="include_parameters">Count parameters too, they become local variables if the function is inlined</param>
+    /// <returns>Size in bytes</returns>
+    int32_t GetFrameSize(SymbolTableEntry* function, bool include_parameters);
+
+    /// <summary>
+    /// Replace calls of small leaf functions and functions declared with "inline" keyword
+    /// by their instructions, callees are processed before their callers using call graph
+    /// </summary>
+    /// <returns>Number of inlined calls</returns>
+    int32_t InlineFunctions();
+
+    /// <summary>
+    /// Check if calls of the function can be replaced by its instructions
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    /// <param name="end_ip">End of function (exclusive)</param>
+    /// <param name="call_graph">Called functions for each function</param>
+    /// <returns>True if the function can be inlined</returns>
+    bool CanInlineFunction(SymbolTableEntry* function, int32_t end_ip,
+        std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>>& call_graph);
+
+    /// <summary>
+    /// Replace calls of inlinable functions in specified function by their instructions,
+    /// locals and temporary variables of callees are renamed to new variables of the caller
+    /// </summary>
+    /// <param name="caller">Function symbol</param>
+    /// <param name="begin_ip">Beginning of function</param>
+    /// <param name="end_ip">End of function (exclusive)</param>
+    /// <param name="inlinable">Functions that can be inlined</param>
+    /// <returns>Number of inlined calls</returns>
+    int32_t InlineCallSites(SymbolTableEntry* caller, int32_t begin_ip, int32_t end_ip, const std::set<SymbolTableEntry*>& inlinable);
+
+    /// <summary>
+    /// Copy instructions of callee to the end of the new instruction stream, parameters are assigned first,
+    /// returns are replaced by assignments to return variable and jumps after the copied instructions
+    /// </summary>
+    /// <param name="site">Call site</param>
+    /// <param name="caller">Function symbol of caller</param>
+    /// <param name="result">New instruction stream</param>
+    /// <returns>True if the copied instructions contain backward jump</returns>
+    bool CopyInlinedInstructions(const OptimizerCallSite& site, SymbolTableEntry* caller, std::vector<InstructionEntry*>& result);
+
+    /// <summary>
+    /// Propagate constant arguments into called functions, parameters that receive the same constant
+    /// from all call sites are replaced by local variables, functions called with different constants
+    /// are copied for each set of arguments, callers are processed before their callees
+    /// </summary>
+    /// <returns>Number of replaced parameters</returns>
+    int32_t PropagateArguments();
+
+    /// <summary>
+    /// Propagate constant arguments of all call sites into specified function
+    /// </summary>
+    /// <param name="callee">Function symbol</param>
+    /// <param name="call_graph">Called functions for each function</param>
+    /// <param name="specialized">Created copies of the function</param>
+    /// <returns>Number of replaced parameters</returns>
+    int32_t PropagateArguments(SymbolTableEntry* callee,
+        std::unordered_map<SymbolTableEntry*, std::vector<SymbolTableEntry*>>& call_graph, std::vector<SymbolTableEntry*>& specialized);
+
+    /// <summary>
+    /// Find parameters with constant value, that make any condition of the function constant,
+    /// values computed only from such parameters and constants are followed through local variables
+    /// </summary>
+    /// <param name="parameters">Parameters of the function</param>
+    /// <param name="values">Constant value of each parameter, the remaining parameters are unknown</param>
+    /// <param name="begin_ip">Beginning of function</param>
+    /// <param name="end_ip">End of function (exclusive)</param>
+    /// <param name="used">Parameters that the conditions depend on</param>
+    /// <returns>True if any condition can be folded</returns>
+    bool FindFoldableConditions(const std::vector<SymbolTableEntry*>& parameters, const std::vector<OptimizerValue>& values,
+        int32_t begin_ip, int32_t end_ip, std::vector<bool>& used);
+
+    /// <summary>
+    /// Copy function to the end of the instruction stream with specified parameters replaced by constants,
+    /// specified call sites are redirected to the copy
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    /// <param name="end_ip">End of function (exclusive)</param>
+    /// <param name="values">Constant value of each parameter, the remaining parameters are kept</param>
+    /// <param name="sites">Call sites</param>
+    /// <returns>Symbol of the copy</returns>
+    SymbolTableEntry* SpecializeFunction(SymbolTableEntry* function, int32_t end_ip,
+        const std::vector<OptimizerValue>& values, std::vector<OptimizerCallSite>& sites);
+
+    /// <summary>
+    /// Turn parameters with constant value to local variables and remove their "push" instructions
+    /// from all call sites, the remaining parameters are renumbered
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    /// <param name="values">Constant value of each parameter, the remaining parameters are kept</param>
+    /// <param name="sites">Call sites</param>
+    /// <param name="entries">Assignments of the constants, that have to be inserted to the beginning of the function</param>
+    void RemoveParameters(SymbolTableEntry* function, const std::vector<OptimizerValue>& values,
+        std::vector<OptimizerCallSite>& sites, std::vector<InstructionEntry*>& entries);
+
+    /// <summary>
+    /// Replace calls of current function, whose result is returned immediately, by assignments
+    /// of its parameters and jump to its beginning, so the recursion doesn't consume stack
+    /// </summary>
+    /// <returns>Number of converted calls</returns>
+    int32_t EliminateTailCalls();
+
+    /// <summary>
+    /// Select function for optimization and collect its symbols,
+    /// only local scalar variables without taken address are tracked by passes
+    /// </summary>
+    /// <param name="function">Function symbol</param>
+    /// <param name="end_ip">End of function (exclusive)</param>
+    void SelectFunction(SymbolTableEntry* function, int32_t end_ip);
+
+    /// <summary>
+    /// Split instructions of current function to basic blocks and connect them
+    /// </summary>
+    void CreateControlFlowGraph();
+
+    /// <summary>
+    /// Find symbol visible in current function by its name
+    /// </summary>
+    /// <param name="name">Name of symbol</param>
+    /// <returns>Symbol entry; or nullptr</returns>
+    SymbolTableEntry* FindSymbolByName(const char* name);
+
+    /// <summary>
+    /// Find index of tracked scalar variable by its name
+    /// </summary>
+    /// <param name="name">Name of variable</param>
+    /// <returns>Index of variable; or -1</returns>
+    int32_t FindScalarByName(const char* name);
+
+    /// <summary>
+    /// Find IP of label in current function
+    /// </summary>
+    /// <param name="name">Name of label</param>
+    /// <returns>IP of label; or -1</returns>
+    int32_t FindLabelIp(const char* name);
+
+    /// <summary>
+    /// Find basic block that contains specified IP
+    /// </summary>
+    /// <param name="ip">Instruction pointer</param>
+    /// <returns>Index of block; or -1 if IP is outside of current function</returns>
+    int32_t FindBlockByIp(int32_t ip);
+
+    /// <summary>
+    /// Propagate constants through assignments of current function and fold
+    /// arithmetic and comparisons, only branches reachable with known values are followed
+    /// </summary>
+    /// <returns>Number of rewritten instructions</returns>
+    int32_t PropagateConstants();
+
+    /// <summary>
+    /// Replace all instructions of blocks that cannot be reached from the beginning
+    /// of the function by "nop", so IPs of the remaining instructions are preserved
+    /// </summary>
+    /// <returns>Number of removed instructions</returns>
+    int32_t RemoveUnreachableBlocks();
+
+    /// <summary>
+    /// Find blocks that can be reached from the beginning of the function
+    /// </summary>
+    /// <param name="is_reachable">Reachability of each block</param>
+    void FindReachableBlocks(std::vector<bool>& is_reachable);
+
+    /// <summary>
+    /// Replace assignments to tracked variables, whose values are never read, by "nop"
+    /// </summary>
+    /// <returns>Number of removed instructions</returns>
+    int32_t RemoveDeadAssignments();
+
+    /// <summary>
+    /// Replace assignments to static variables, that are overwritten later in the same block
+    /// and are not read or visible to other functions in between, by "nop"
+    /// </summary>
+    /// <returns>Number of removed instructions</returns>
+    int32_t RemoveDeadStores();
+
+    /// <summary>
+    /// Find static variables, whose address is taken in any referenced function,
+    /// and static variables accessed by each function, including all its callees
+    /// </summary>
+    /// <param name="functions">All functions ordered by IP</param>
+    void FindStaticAccesses(const std::vector<SymbolTableEntry*>& functions);
+
+    /// <summary>
+    /// Replace static variables, that are often accessed in the function, by local variables,
+    /// the value is loaded at the beginning and stored back before returns and calls that access it
+    /// </summary>
+    /// <returns>Number of promoted variables</returns>
+    int32_t PromoteStatics();
+
+    /// <summary>
+    /// Compute values directly to variables, instead of moving them from temporary variables,
+    /// the temporary variable must not be used after the move
+    /// </summary>
+    /// <returns>Number of removed moves</returns>
+    int32_t CoalesceTemporaryMoves();
+
+    /// <summary>
+    /// Replace uses of variables that hold a copy of another variable with the original variable,
+    /// the copies can be removed later if they are not needed anymore
+    /// </summary>
+    /// <returns>Number of replaced operands</returns>
+    int32_t PropagateCopies();
+
+    /// <summary>
+    /// Replace expressions, that were already computed on all paths and their operands
+    /// were not changed since, by variables holding the results
+    /// </summary>
+    /// <returns>Number of replaced expressions</returns>
+    int32_t EliminateCommonSubexpressions();
+
+    /// <summary>
+    /// Retarget jumps that lead to another jump to their final destination, remove jumps
+    /// to the following instruction and invert conditions that only skip a jump
+    /// </summary>
+    /// <returns>Number of changed jumps</returns>
+    int32_t ThreadJumps();
+
+    /// <summary>
+    /// Retarget jumps to conditions, whose result is known on the path of the jump, to the destination
+    /// of the condition, so boolean variables assigned only to be tested again are not needed anymore
+    /// </summary>
+    /// <returns>Number of changed jumps</returns>
+    int32_t ThreadConditions();
+
+    /// <summary>
+    /// Find constant value of tracked variable at the end of the block, assignments are followed
+    /// backwards through blocks with only one predecessor
+    /// </summary>
+    /// <param name="block">Index of block</param>
+    /// <param name="var">Index of variable</param>
+    /// <param name="value">Value of variable</param>
+    /// <returns>True if the value is known</returns>
+    bool GetValueAtEnd(int32_t block, int32_t var, uint32_t& value);
+
+    /// <summary>
+    /// Find destination of jump, empty instructions and unconditional jumps are skipped,
+    /// jumps outside of current function are not followed
+    /// </summary>
+    /// <param name="ip">Target of jump</param>
+    /// <returns>Final target of jump</returns>
+    int32_t FindJumpDestination(int32_t ip);
+
+    /// <summary>
+    /// Replace chains of "if" instructions, that compare the same string variable to constants,
+    /// by dispatch through perfect hash, the original comparisons are used for verification
+    /// </summary>
+    /// <returns>Number of replaced chains</returns>
+    int32_t HashStringComparisons();
+
+    /// <summary>
+    /// Check if the instruction compares string variable to constant for equality
+    /// </summary>
+    /// <param name="i">Instruction</param>
+    /// <param name="var">Compared variable</param>
+    /// <param name="value">Compared constant</param>
+    /// <returns>True if the instruction is supported comparison</returns>
+    bool GetStringComparison(InstructionEntry* i, InstructionOperand*& var, const char*& value);
+
+    /// <summary>
+    /// Replace constant-size allocations, whose pointer doesn't escape the function,
+    /// by local arrays, matching "release" calls are removed
+    /// </summary>
+    /// <returns>Number of replaced allocations</returns>
+    int32_t AllocateOnStack();
+
+    /// <summary>
+    /// Find all variables, that can hold pointer returned by allocation, and all calls that release it
+    /// </summary>
+    /// <param name="call_ip">IP of allocation call</param>
+    /// <param name="aliases">Variables derived from the pointer</param>
+    /// <param name="release_ips">IPs of "push" instructions of "release" calls</param>
+    /// <returns>False if the pointer escapes the function</returns>
+    bool FindAllocationAliases(int32_t call_ip, std::set<std::string>& aliases, std::vector<int32_t>& release_ips);
+
+    /// <summary>
+    /// Describe expression computed by assignment to tracked variable, arithmetic and loads of array items
+    /// with constant or tracked variable operands are supported
+    /// </summary>
+    /// <param name="i">Instruction</param>
+    /// <param name="expression">Description of the expression</param>
+    /// <returns>True if the instruction computes supported expression</returns>
+    bool GetAssignExpression(InstructionEntry* i, OptimizerExpression& expression);
+
+    /// <summary>
+    /// Move computations, that produce the same value in every iteration, out of loops
+    /// </summary>
+    /// <returns>Number of hoisted instructions</returns>
+    int32_t HoistLoopInvariants();
+
+    /// <summary>
+    /// Move loop invariant computations of specified loop to its preheader,
+    /// variables without taken address cannot be changed by pointers or calls
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <param name="dominators">Dominators of each block</param>
+    /// <returns>Number of hoisted instructions</returns>
+    int32_t HoistLoopInvariants(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators);
+
+    /// <summary>
+    /// Find all uses of value assigned to variable by specified instruction,
+    /// the value must not be used outside of the block
+    /// </summary>
+    /// <param name="var">Index of variable</param>
+    /// <param name="ip">Instruction pointer of assignment</param>
+    /// <param name="live_out">Live variables at the end of the block</param>
+    /// <param name="use_ips">Instruction pointers of uses</param>
+    /// <returns>True if all uses are in the same block</returns>
+    bool GetLocalUses(int32_t var, int32_t ip, const std::vector<bool>& live_out, std::vector<int32_t>& use_ips);
+
+    /// <summary>
+    /// Move value assigned to variable by specified instruction to a new tracked variable
+    /// </summary>
+    /// <param name="var">Index of variable</param>
+    /// <param name="ip">Instruction pointer of assignment</param>
+    /// <param name="use_ips">Instruction pointers of uses</param>
+    /// <returns>Index of new variable</returns>
+    int32_t SplitVariable(int32_t var, int32_t ip, const std::vector<int32_t>& use_ips);
+
+    /// <summary>
+    /// Replace array items indexed by induction variables inside of loops by pointers, that are
+    /// moved together with the induction variables, and compare the pointers in exit conditions
+    /// </summary>
+    /// <returns>Number of replaced accesses</returns>
+    int32_t ReduceInductionVariables();
+
+    /// <summary>
+    /// Replace array items indexed by the first suitable induction variable of specified loop
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <param name="dominators">Dominators of each block</param>
+    /// <returns>Number of replaced accesses</returns>
+    int32_t ReduceInductionVariables(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators);
+
+    /// <summary>
+    /// Replace items of the array indexed by induction variable by a new pointer
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <param name="var">Index of induction variable</param>
+    /// <param name="inc_ip">Instruction pointer of induction variable step</param>
+    /// <param name="step">Step of induction variable</param>
+    /// <param name="base">Array or pointer</param>
+    /// <param name="access_ips">Instruction pointers of accesses to items</param>
+    /// <param name="exit_test">Condition that can compare pointers instead; or nullptr</param>
+    void ReduceInductionVariable(const OptimizerLoop& loop, int32_t var, int32_t inc_ip, uint32_t step,
+        SymbolTableEntry* base, const std::vector<int32_t>& access_ips, InstructionEntry* exit_test);
+
+    /// <summary>
+    /// Replace item of the array indexed by induction variable by item pointed to by pointer
+    /// </summary>
+    /// <param name="i">Assign instruction</param>
+    /// <param name="var">Index of induction variable</param>
+    /// <param name="base">Array or pointer</param>
+    /// <param name="ptr">Name of pointer</param>
+    void ReplaceIndexedAccess(InstructionEntry* i, int32_t var, SymbolTableEntry* base, const char* ptr);
+
+    /// <summary>
+    /// Get constant step of induction variable, that is added or subtracted by the instruction
+    /// </summary>
+    /// <param name="i">Assign instruction</param>
+    /// <param name="step">Step (two's complement if subtracted)</param>
+    /// <returns>True if the instruction changes the variable by constant step</returns>
+    bool GetInductionStep(InstructionEntry* i, uint32_t& step);
+
+    /// <summary>
+    /// Get constant value of variable assigned just before the loop
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <param name="var">Index of variable</param>
+    /// <param name="value">Initial value</param>
+    /// <returns>True if the initial value is known</returns>
+    bool GetInitialValue(const OptimizerLoop& loop, int32_t var, uint32_t& value);
+
+    /// <summary>
+    /// Find the only condition that uses induction variable inside of the loop, so it can be replaced
+    /// by comparison of pointers, all values of the variable must be valid indices of the array
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <param name="var">Index of induction variable</param>
+    /// <param name="inc_ip">Instruction pointer of induction variable step</param>
+    /// <param name="step">Step of induction variable</param>
+    /// <param name="base">Array</param>
+    /// <param name="init">Initial value of induction variable</param>
+    /// <param name="access_ips">Instruction pointers of accesses to items, that will be replaced</param>
+    /// <param name="exit_test">Found condition</param>
+    /// <returns>True if the condition can be replaced</returns>
+    bool FindExitTest(const OptimizerLoop& loop, int32_t var, int32_t inc_ip, uint32_t step,
+        SymbolTableEntry* base, uint32_t init, const std::vector<int32_t>& access_ips, InstructionEntry*& exit_test);
+
+    /// <summary>
+    /// Replace loops with small constant trip count by copies of their body and unroll loops
+    /// marked by "#unroll" directive, inner loops are processed first
+    /// </summary>
+    /// <returns>Number of unrolled loops</returns>
+    int32_t UnrollLoops();
+
+    /// <summary>
+    /// Insert copies of specified loop before it, each copy continues to the next one instead
+    /// of the next iteration, if the loop is fully unrolled the original loop is left to be removed
+    /// by constant propagation, otherwise the last copy is the original loop that jumps back to the first one
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <param name="dominators">Dominators of each block</param>
+    /// <param name="loops">All loops of the function</param>
+    /// <param name="hint">Number of copies requested by "#unroll" directive; or 0</param>
+    /// <returns>True if the loop was unrolled</returns>
+    bool UnrollLoop(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators,
+        const std::vector<OptimizerLoop>& loops, int32_t hint);
+
+    /// <summary>
+    /// Find trip count of the loop, that is controlled by one exit test of induction variable,
+    /// the test and the step have to be executed exactly once in each iteration
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <param name="dominators">Dominators of each block</param>
+    /// <param name="loops">All loops of the function</param>
+    /// <param name="trip">Found trip count</param>
+    /// <returns>True if the trip count is known</returns>
+    bool FindTripCount(const OptimizerLoop& loop, const std::vector<std::vector<bool>>& dominators,
+        const std::vector<OptimizerLoop>& loops, OptimizerTripCount& trip);
+
+    /// <summary>
+    /// Check if preheader can be inserted before the header of the loop,
+    /// so it's executed only on entering the loop
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    /// <returns>True if preheader can be inserted</returns>
+    bool CanInsertPreheader(const OptimizerLoop& loop);
+
+    /// <summary>
+    /// Insert instructions before specified IP and shift all following IPs,
+    /// jumps from inside of the loop (if specified) to the IP skip the new instructions
+    /// </summary>
+    /// <param name="ip">Instruction pointer</param>
+    /// <param name="entries">New instructions</param>
+    /// <param name="loop">Loop, if the instructions are inserted to its preheader; or nullptr</param>
+    void InsertInstructions(int32_t ip, const std::vector<InstructionEntry*>& entries, const OptimizerLoop* loop);
+
+    /// <summary>
+    /// Compute blocks that are present on all paths from the beginning of the function to each block
+    /// </summary>
+    /// <param name="dominators">Dominators of each block</param>
+    void ComputeDominators(std::vector<std::vector<bool>>& dominators);
+
+    /// <summary>
+    /// Find all natural loops of current function, inner loops are sorted first
+    /// </summary>
+    /// <param name="dominators">Dominators of each block</param>
+    /// <param name="loops">Found loops</param>
+    void FindLoops(const std::vector<std::vector<bool>>& dominators, std::vector<OptimizerLoop>& loops);
+
+    /// <summary>
+    /// Collect variables and memory changed inside of the loop
+    /// </summary>
+    /// <param name="loop">Loop</param>
+    void AnalyzeLoop(OptimizerLoop& loop);
+
+    /// <summary>
+    /// Compute tracked variables that are live at the beginning and at the end of each block
+    /// </summary>
+    /// <param name="live_in">Live variables at the beginning of each block</param>
+    /// <param name="live_out">Live variables at the end of each block</param>
+    void ComputeLiveVariables(std::vector<std::vector<bool>>& live_in, std::vector<std::vector<bool>>& live_out);
+
+    /// <summary>
+    /// Find all tracked variables read by specified instruction
+    /// </summary>
+    /// <param name="i">Instruction</param>
+    /// <param name="uses">Indices of read variables</param>
+    void GetInstructionUses(InstructionEntry* i, std::vector<int32_t>& uses);
+
+    /// <summary>
+    /// Find tracked variable written by specified instruction
+    /// </summary>
+    /// <param name="i">Instruction</param>
+    /// <returns>Index of written variable; or -1</returns>
+    int32_t GetInstructionDefinition(InstructionEntry* i);
+
+    /// <summary>
+    /// Update values of tracked variables by specified instruction
+    /// </summary>
+    /// <param name="i">Instruction</param>
+    /// <param name="values">Values of tracked variables</param>
+    void PropagateInstruction(InstructionEntry* i, std::vector<OptimizerValue>& values);
+
+    /// <summary>
+    /// Replace operands with known values by constants and fold the instruction if possible
+    /// </summary>
+    /// <param name="i">Instruction</param>
+    /// <param name="values">Values of tracked variables before the instruction</param>
+    /// <returns>True if the instruction was changed</returns>
+    bool FoldInstruction(InstructionEntry* i, const std::vector<OptimizerValue>& values);
+
+    /// <summary>
+    /// Evaluate value of operand
+    /// </summary>
+    /// <param name="op">Operand</param>
+    /// <param name="values">Values of tracked variables</param>
+    /// <returns>Value of operand</returns>
+    OptimizerValue EvaluateOperand(const InstructionOperand& op, const std::vector<OptimizerValue>& values);
+
+    /// <summary>
+    /// Evaluate result of assignment, arithmetic is performed with size of destination
+    /// </summary>
+    /// <param name="i">Assign instruction</param>
+    /// <param name="values">Values of tracked variables</param>
+    /// <returns>Value of result</returns>
+    OptimizerValue EvaluateAssign(InstructionEntry* i, const std::vector<OptimizerValue>& values);
+
+    /// <summary>
+    /// Evaluate condition of "if" instruction
+    /// </summary>
+    /// <param name="i">If instruction</param>
+    /// <param name="values">Values of tracked variables</param>
+    /// <returns>Value of condition (1 if the jump is taken)</returns>
+    OptimizerValue EvaluateIf(InstructionEntry* i, const std::vector<OptimizerValue>& values);
+
+    /// <summary>
+    /// Get type of value stored by assignment
+    /// </summary>
+    /// <param name="i">Assign instruction</param>
+    /// <param name="type">Type of stored value</param>
+    /// <returns>True if the destination is known</returns>
+    bool GetAssignDestinationType(InstructionEntry* i, SymbolType& type);
+
+    /// <summary>
+    /// Replace variable operand by constant, if its value is known
+    /// </summary>
+    /// <param name="op">Operand</param>
+    /// <param name="values">Values of tracked variables</param>
+    /// <returns>True if the operand was replaced</returns>
+    bool ReplaceOperandIfConstant(InstructionOperand& op, const std::vector<OptimizerValue>& values);
+
+    /// <summary>
+    /// Replace variable index by constant, if its value is known
+    /// </summary>
+    /// <param name="index">Index</param>
+    /// <param name="values">Values of tracked variables</param>
+    /// <returns>True if the index was replaced</returns>
+    bool ReplaceIndexIfConstant(InstructionOperandIndex& index, const std::vector<OptimizerValue>& values);
+
+    /// <summary>
+    /// Call specified function for every variable referenced by the instruction, so it can be renamed
+    /// </summary>
+    /// <param name="i">Instruction</param>
+    /// <param name="callback">Function called with name of each variable</param>
+    static void ForEachVariable(InstructionEntry* i, const std::function<void(char*& value)>& callback);
+
+    /// <summary>
+    /// Check if both operands refer to the same constant or variable
+    /// </summary>
+    static bool AreOperandsEqual(const InstructionOperand& a, const InstructionOperand& b);
+
+    /// <summary>
+    /// Get compare type with opposite result, logical operators cannot be inverted
+    /// </summary>
+    static CompareType GetInvertedCompareType(CompareType type);
+
+    /// <summary>
+    /// Meet two values in constant propagation lattice
+    /// </summary>
+    static OptimizerValue MeetValues(const OptimizerValue& a, const OptimizerValue& b);
+
+    /// <summary>
+    /// Check if the type is integer or bool without pointer
+    /// </summary>
+    static bool IsScalarType(SymbolType type);
+
+    /// <summary>
+    /// Truncate value to specified size in bytes
+    /// </summary>
+    static uint32_t TruncateValue(uint32_t value, int32_t size);
+
+    /// <summary>
+    /// Convert value to decimal string, that can be parsed by emitter
+    /// </summary>
+    static char* ValueToString(uint32_t value);
+
+
+    /// <summary>
+    /// Names of passes used in "/pass:" option
+    /// </summary>
+    static const char* PassNames[(int32_t)OptimizerPass::Count];
+
+
+    Compiler* compiler;
+
+    uint32_t passes;
+    OptimizerPassStats pass_stats[(int32_t)OptimizerPass::Count] { };
+
+    // All instructions indexed by their IP
+    std::vector<InstructionEntry*> instructions;
+
+    SymbolTableEntry* function = nullptr;
+    int32_t function_begin_ip = 0;
+    int32_t function_end_ip = 0;
+
+    std::unordered_map<std::string, SymbolTableEntry*> function_symbols;
+    std::unordered_map<std::string, int32_t> function_labels;
+    std::set<std::string> referenced_symbols;  // Variables with taken address
+    std::set<std::string> referenced_statics;  // Static variables with taken address in any function
+    std::unordered_map<SymbolTableEntry*, std::set<SymbolTableEntry*>> accessed_statics;  // Static variables accessed by each function and its callees
+
+    // Local scalar variables, whose values can be tracked across instructions
+    std::vector<SymbolTableEntry*> scalars;
+    std::unordered_map<std::string, int32_t> scalar_indices;
+
+    std::vector<OptimizerBlock> blocks;
+    std::vector<int32_t> ip_to_block;
+};
@@ -24,7 +24,7 @@ extern Compiler c;
 %locations
 %define parse.error verbose
 
-%token CONST STATIC VOID BOOL UINT8 UINT16 UINT32 STRING CONSTANT IDENTIFIER
+%token CONST STATIC INLINE VOID BOOL UINT8 UINT16 UINT32 STRING CONSTANT IDENTIFIER
 %token IF ELSE RETURN DO WHILE FOR SWITCH CASE DEFAULT CONTINUE BREAK GOTO CAST ALLOC
 %token INC_OP DEC_OP U_PLUS U_MINUS  
 %token EQUAL NOT_EQUAL GREATER_OR_EQUAL LESS_OR_EQUAL SHIFT_LEFT SHIFT_RIGHT LOG_AND LOG_OR
@@ -140,16 +140,28 @@ program
 function
     : declaration_type id '(' parameter_list ')' ';'
         {
-            c.AddFunctionPrototype($2, $1);
+            c.AddFunctionPrototype($2, $1, false);
+
+            // Nothing to backpatch here...
+            $$.next_list = nullptr;
+        }
+    | INLINE declaration_type id '(' parameter_list ')' ';'
+        {
+            c.AddFunctionPrototype($3, $2, true);
 
             // Nothing to backpatch here...
             $$.next_list = nullptr;
         }
     | declaration_type id '(' parameter_list ')' function_body
         {
-            c.AddFunction($2, $1);
+            c.AddFunction($2, $1, false);
             $$.next_list = $6.next_list;
         }
+    | INLINE declaration_type id '(' parameter_list ')' function_body
+        {
+            c.AddFunction($3, $2, true);
+            $$.next_list = $7.next_list;
+        }
     | static_declaration_list
         {
             // Nothing to backpatch here...
@@ -258,12 +270,16 @@ statement
             LogDebug("P: Processing matched statement");
 
             $$.next_list = $1.next_list;
+
+            c.ReleaseUnusedVariables();
         }
     | unmatched_statement
         {
             LogDebug("P: Processing unmatched statement");
 
             $$.next_list = $1.next_list;
+
+            c.ReleaseUnusedVariables();
         }
     | declaration_list
         {
@@ -271,6 +287,8 @@ statement
 
             // Nothing to backpatch here...
             $$.next_list = nullptr;
+
+            c.ReleaseUnusedVariables();
         }
     | goto_label
         {
@@ -278,6 +296,8 @@ statement
 
             // Nothing to backpatch here...
             $$.next_list = nullptr;
+
+            c.ReleaseUnusedVariables();
         }
     ;
 
@@ -371,20 +391,18 @@ matched_statement
             c.BackpatchScope(ScopeType::Continue, $8.ip);
             c.BackpatchScope(ScopeType::Break, $16.ip);
         }
-    | SWITCH '(' switch_next assignment ')' '{' break_marker switch_statement '}' switch_next
+    | SWITCH '(' assignment ')' switch_next pin_marker '{' break_marker switch_statement '}' switch_next
         {
             LogDebug("P: Processing switch statement");
         
-            CheckIsInt($4, "Only integer types are allowed in \"switch\" statement", @4);
+            bool is_string = ($3.type.base == BaseSymbolType::String && $3.type.pointer == 0);
+            if (!is_string) {
+                CheckIsInt($3, "Only integer and string types are allowed in \"switch\" statement", @3);
+            }
 
-            SwitchBackpatchList* current = $8.next_list;
+            SwitchBackpatchList* current = $9.next_list;
             SwitchBackpatchList* default_statement = nullptr;
 
-            int32_t start_ip = c.NextIp();
-
-            // Move indexed variables to temp. variables
-            PrepareIndexedVariableIfNeeded($4);
-
             while (current) {
                 if (current->is_default) {
                     if (default_statement) {
@@ -392,33 +410,39 @@ matched_statement
                     }
 
                     default_statement = current;
-                } else {
-                    InstructionEntry* i = c.AddToStream(InstructionType::If);
-                    i->if_statement.ip = current->source_ip;
-
-                    i->if_statement.type = CompareType::Equal;
-                    i->if_statement.op1.value = $4.value;
-                    i->if_statement.op1.type = $4.type;
-                    i->if_statement.op1.exp_type = $4.exp_type;
-                    i->if_statement.op2.value = current->value;
-                    i->if_statement.op2.type = current->type;
-                    i->if_statement.op2.exp_type = ExpressionType::Constant;
+                } else if (is_string != (current->type.base == BaseSymbolType::String)) {
+                    throw CompilerException(CompilerExceptionSource::Statement,
+                        "Switch case must have the same type as \"switch\" expression", current->line, -1);
                 }
+
+                // Fall through to the following case, the last one continues to the end of "switch" statement
+                c.BackpatchStream(current->next_list, current->next ? current->next->source_ip : $11.ip - 1);
                 current = current->next;
             }
 
-            if (default_statement) {
-                InstructionEntry* i = c.AddToStream(InstructionType::Goto);
-                i->goto_statement.ip = default_statement->source_ip;
-            }
+            int32_t start_ip = c.NextIp();
+
+            // Move indexed variables to temp. variables
+            PrepareIndexedVariableIfNeeded($3);
+
+            InstructionOperand op { };
+            op.value = $3.value;
+            op.type = $3.type;
+            op.exp_type = $3.exp_type;
+
+            BackpatchList* default_list = c.AddSwitchToStream(op, $9.next_list);
 
             int32_t end_ip = c.NextIp();
 
-            c.BackpatchStream($3.next_list, start_ip);      // Backpatch start of "switch" statement
-            c.BackpatchStream($10.next_list, end_ip);       // Backpatch end of "switch" statement
+            c.BackpatchStream($5.next_list, start_ip);      // Backpatch start of "switch" statement
+            c.BackpatchStream($11.next_list, end_ip);       // Backpatch end of "switch" statement
+            c.BackpatchStream(default_list, end_ip);        // Backpatch missing "default" case
 
             c.BackpatchScope(ScopeType::Break, end_ip);     // Backpatch all break statement(s)
 
+            // Temp. variables used by "switch" expression can be released now
+            c.UnpinUsedVariables();
+
             $$.next_list = nullptr;
         }
     | BREAK ';'
@@ -558,6 +582,7 @@ default_statement
             b->source_ip = $3.ip;
             b->is_default = true;
             b->line = @1.first_line;
+            b->next_list = $4.next_list;
             $$.next_list = b;
         }
     ;
@@ -572,6 +597,7 @@ case_list
             b->value = $2.value;
             b->type = $2.type;
             b->line = @2.first_line;
+            b->next_list = $5.next_list;
             $$.next_list = b;
         }
     | case_list CASE CONSTANT ':' marker statement_list
@@ -597,6 +623,7 @@ case_list
             b->value = $3.value;
             b->type = $3.type;
             b->line = @3.first_line;
+            b->next_list = $6.next_list;
             $$.next_list = MergeLists($1.next_list, b);
         }
     ;
@@ -1751,6 +1778,15 @@ continue_marker
         }
     ;
 
+pin_marker
+    :   {
+            LogDebug("P: Generating pin marker");
+
+            // Keep temp. variables alive until the end of the statement
+            c.PinUsedVariables();
+        }
+    ;
+
 switch_next
     :   {
             LogDebug("P: Generating switch next marker");
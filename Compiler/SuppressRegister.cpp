@@ -4,10 +4,10 @@ SuppressRegister::SuppressRegister(DosExeEmitter* emitter, i386::CpuRegister reg
     : emitter(emitter),
       reg(reg)
 {
-    emitter->suppressed_registers.insert(reg);
+    emitter->suppressed_registers |= (1 << (int32_t)reg);
 }
 
 SuppressRegister::~SuppressRegister()
 {
-    emitter->suppressed_registers.erase(reg);
+    emitter->suppressed_registers &= ~(1 << (int32_t)reg);
 }
\ No newline at end of file
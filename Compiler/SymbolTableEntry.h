@@ -57,6 +57,7 @@ struct SymbolTableEntry {
     int32_t ip, parameter;
     char* parent;
     bool is_temp;
+    bool is_inline;
 
     uint32_t ref_count;
 
@@ -176,6 +176,230 @@ namespace i386
         }
     }
 
+    void Emitter::AsmAnd(CpuRegister r, int32_t imm, int32_t size)
+    {
+        switch (size) {
+            case 1: {
+                uint8_t* a = AllocateBufferForInstruction(2 + 1);
+                a[0] = 0x80;    // and rm8, imm8
+                a[1] = ToXrm(3, 4, r);
+                *(int8_t*)(a + 2) = (int8_t)imm;
+                break;
+            }
+            case 2: {
+                if ((int16_t)imm == (int8_t)imm) {
+                    uint8_t* a = AllocateBufferForInstruction(2 + 1);
+                    a[0] = 0x83;    // and rm16, imm8
+                    a[1] = ToXrm(3, 4, r);
+                    *(int8_t*)(a + 2) = (int8_t)imm;
+                } else {
+                    uint8_t* a = AllocateBufferForInstruction(2 + 2);
+                    a[0] = 0x81;    // and rm16, imm16
+                    a[1] = ToXrm(3, 4, r);
+                    *(int16_t*)(a + 2) = (int16_t)imm;
+                }
+                break;
+            }
+            case 4: {
+                if (imm == (int8_t)imm) {
+                    uint8_t* a = AllocateBufferForInstruction(3 + 1);
+                    a[0] = 0x66;    // Operand size prefix
+                    a[1] = 0x83;    // and rm32, imm8
+                    a[2] = ToXrm(3, 4, r);
+                    *(int8_t*)(a + 3) = (int8_t)imm;
+                } else {
+                    uint8_t* a = AllocateBufferForInstruction(3 + 4);
+                    a[0] = 0x66;    // Operand size prefix
+                    a[1] = 0x81;    // and rm32, imm32
+                    a[2] = ToXrm(3, 4, r);
+                    *(int32_t*)(a + 3) = imm;
+                }
+                break;
+            }
+
+            default: ThrowOnUnreachableCode();
+        }
+    }
+
+    void Emitter::AsmShl(CpuRegister r, uint8_t imm8, int32_t size)
+    {
+        switch (size) {
+            case 1: {
+                uint8_t* a = AllocateBufferForInstruction(2 + 1);
+                a[0] = 0xC0;    // shl rm8, imm8
+                a[1] = ToXrm(3, 4, r);
+                a[2] = imm8;
+                break;
+            }
+            case 2: {
+                uint8_t* a = AllocateBufferForInstruction(2 + 1);
+                a[0] = 0xC1;    // shl rm16, imm8
+                a[1] = ToXrm(3, 4, r);
+                a[2] = imm8;
+                break;
+            }
+            case 4: {
+                uint8_t* a = AllocateBufferForInstruction(3 + 1);
+                a[0] = 0x66;    // Operand size prefix
+                a[1] = 0xC1;    // shl rm32, imm8
+                a[2] = ToXrm(3, 4, r);
+                a[3] = imm8;
+                break;
+            }
+
+            default: ThrowOnUnreachableCode();
+        }
+    }
+
+    void Emitter::AsmShr(CpuRegister r, uint8_t imm8, int32_t size)
+    {
+        switch (size) {
+            case 1: {
+                uint8_t* a = AllocateBufferForInstruction(2 + 1);
+                a[0] = 0xC0;    // shr rm8, imm8
+                a[1] = ToXrm(3, 5, r);
+                a[2] = imm8;
+                break;
+            }
+            case 2: {
+                uint8_t* a = AllocateBufferForInstruction(2 + 1);
+                a[0] = 0xC1;    // shr rm16, imm8
+                a[1] = ToXrm(3, 5, r);
+                a[2] = imm8;
+                break;
+            }
+            case 4: {
+                uint8_t* a = AllocateBufferForInstruction(3 + 1);
+                a[0] = 0x66;    // Operand size prefix
+                a[1] = 0xC1;    // shr rm32, imm8
+                a[2] = ToXrm(3, 5, r);
+                a[3] = imm8;
+                break;
+            }
+
+            default: ThrowOnUnreachableCode();
+        }
+    }
+
+    void Emitter::AsmMul(CpuRegister r, int32_t size)
+    {
+        switch (size) {
+            case 1: {
+                uint8_t* a = AllocateBufferForInstruction(2);
+                a[0] = 0xF6;    // mul rm8
+                a[1] = ToXrm(3, 4, r);
+                break;
+            }
+            case 2: {
+                uint8_t* a = AllocateBufferForInstruction(2);
+                a[0] = 0xF7;    // mul rm16
+                a[1] = ToXrm(3, 4, r);
+                break;
+            }
+            case 4: {
+                uint8_t* a = AllocateBufferForInstruction(3);
+                a[0] = 0x66;    // Operand size prefix
+                a[1] = 0xF7;    // mul rm32
+                a[2] = ToXrm(3, 4, r);
+                break;
+            }
+
+            default: ThrowOnUnreachableCode();
+        }
+    }
+
+    void Emitter::AsmImul(CpuRegister to, CpuRegister from, int32_t imm, int32_t size)
+    {
+        switch (size) {
+            case 2: {
+                if ((int16_t)imm == (int8_t)imm) {
+                    uint8_t* a = AllocateBufferForInstruction(2 + 1);
+                    a[0] = 0x6B;    // imul r16, rm16, imm8 (i386+)
+                    a[1] = ToXrm(3, to, from);
+                    *(int8_t*)(a + 2) = (int8_t)imm;
+                } else {
+                    uint8_t* a = AllocateBufferForInstruction(2 + 2);
+                    a[0] = 0x69;    // imul r16, rm16, imm16 (i386+)
+                    a[1] = ToXrm(3, to, from);
+                    *(int16_t*)(a + 2) = (int16_t)imm;
+                }
+                break;
+            }
+            case 4: {
+                if (imm == (int8_t)imm) {
+                    uint8_t* a = AllocateBufferForInstruction(3 + 1);
+                    a[0] = 0x66;    // Operand size prefix
+                    a[1] = 0x6B;    // imul r32, rm32, imm8 (i386+)
+                    a[2] = ToXrm(3, to, from);
+                    *(int8_t*)(a + 3) = (int8_t)imm;
+                } else {
+                    uint8_t* a = AllocateBufferForInstruction(3 + 4);
+                    a[0] = 0x66;    // Operand size prefix
+                    a[1] = 0x69;    // imul r32, rm32, imm32 (i386+)
+                    a[2] = ToXrm(3, to, from);
+                    *(int32_t*)(a + 3) = imm;
+                }
+                break;
+            }
+
+            default: ThrowOnUnreachableCode();
+        }
+    }
+
+    void Emitter::AsmLea(CpuRegister to, CpuRegister base, CpuRegister index, uint8_t shift, int32_t size)
+    {
+        if (base == CpuRegister::BP || index == CpuRegister::SP || shift > 3) {
+            // These combinations have special meaning in SIB byte
+            ThrowOnUnreachableCode();
+        }
+
+        switch (size) {
+            case 2: {
+                uint8_t* a = AllocateBufferForInstruction(4);
+                a[0] = 0x67;    // Address size prefix
+                a[1] = 0x8D;    // lea r16, [r32 + r32 * scale] (i386+)
+                a[2] = ToXrm(0, to, 4);
+                a[3] = ToXrm(shift, index, base);
+                break;
+            }
+            case 4: {
+                uint8_t* a = AllocateBufferForInstruction(5);
+                a[0] = 0x66;    // Operand size prefix
+                a[1] = 0x67;    // Address size prefix
+                a[2] = 0x8D;    // lea r32, [r32 + r32 * scale] (i386+)
+                a[3] = ToXrm(0, to, 4);
+                a[4] = ToXrm(shift, index, base);
+                break;
+            }
+
+            default: ThrowOnUnreachableCode();
+        }
+    }
+
+    void Emitter::AsmMovzx(CpuRegister to, CpuRegister from, int32_t from_size)
+    {
+        switch (from_size) {
+            case 1: {
+                uint8_t* a = AllocateBufferForInstruction(4);
+                a[0] = 0x66;    // Operand size prefix
+                a[1] = 0x0F;
+                a[2] = 0xB6;    // movzx r32, rm8 (i386+)
+                a[3] = ToXrm(3, to, from);
+                break;
+            }
+            case 2: {
+                uint8_t* a = AllocateBufferForInstruction(4);
+                a[0] = 0x66;    // Operand size prefix
+                a[1] = 0x0F;
+                a[2] = 0xB7;    // movzx r32, rm16 (i386+)
+                a[3] = ToXrm(3, to, from);
+                break;
+            }
+
+            default: ThrowOnUnreachableCode();
+        }
+    }
+
     void Emitter::AsmProcEnter()
     {
         uint8_t* a = AllocateBufferForInstruction(2 + 3);
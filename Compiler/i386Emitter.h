@@ -57,6 +57,29 @@ namespace i386
         void AsmInc(CpuRegister r, int32_t size);
         void AsmDec(CpuRegister r, int32_t size);
         void AsmOr(CpuRegister to, CpuRegister from, int32_t size);
+        void AsmAnd(CpuRegister r, int32_t imm, int32_t size);
+        void AsmShl(CpuRegister r, uint8_t imm8, int32_t size);
+        void AsmShr(CpuRegister r, uint8_t imm8, int32_t size);
+        void AsmMul(CpuRegister r, int32_t size);
+        void AsmImul(CpuRegister to, CpuRegister from, int32_t imm, int32_t size);
+
+        /// <summary>
+        /// Emit "lea" with scaled index to compute (base + (index << shift)) without memory access
+        /// </summary>
+        /// <param name="to">Target register</param>
+        /// <param name="base">Base register</param>
+        /// <param name="index">Index register</param>
+        /// <param name="shift">Scale of index (0 - 3)</param>
+        /// <param name="size">Size of target register</param>
+        void AsmLea(CpuRegister to, CpuRegister base, CpuRegister index, uint8_t shift, int32_t size);
+
+        /// <summary>
+        /// Zero-extend 8-bit or 16-bit register to 32-bit register
+        /// </summary>
+        /// <param name="to">Target register</param>
+        /// <param name="from">Source register</param>
+        /// <param name="from_size">Size of source register</param>
+        void AsmMovzx(CpuRegister to, CpuRegister from, int32_t from_size);
 
         /// <summary>
         /// Emit instructions for the start of a procedure